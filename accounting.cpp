@@ -0,0 +1,280 @@
+#include <time.h>
+
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Library statistics
+//
+// Global counters are kept per thread and summed on read. Counters of
+// threads that have exited are folded into 'retired'
+//
+// Record counts of loggers are kept the same way, by logger slot, and
+// folded into 'retiredlog'. A slot is reused once its logger is gone.
+// Counts left by its previous holders are not cleared, as other threads
+// own them, but taken as the base of the new holder. Byte and flush
+// counts are relaxed atomics in the handlers
+//
+
+struct statsregistry {
+  mutex                 lock;
+  set<ThreadStats*>     threads;
+  unsigned long long    retired[STAT_COUNTERS];
+  int                   nslots;       // slots handed out so far
+  vector<int>           freeslots;
+  vector<unsigned long long> retiredlog; // LOGGER_STATS per slot
+};
+
+static statsregistry& registry() {
+  // Never destroyed. Threads may exit during static destruction
+  //
+  static statsregistry* reg = new statsregistry();
+
+  return *reg;
+}
+
+// Registers the counters of a thread while it lives
+//
+struct statsslot {
+  ThreadStats stats;
+  //
+  statsslot() {
+    statsregistry& reg = registry();
+    lock_guard<mutex> lock(reg.lock);
+    reg.threads.insert(&stats);
+  }
+  ~statsslot() {
+    statsregistry& reg = registry();
+    lock_guard<mutex> lock(reg.lock);
+    for (int c = 0; c < STAT_COUNTERS; c++)
+      reg.retired[c] += stats.counter[c].load(memory_order_relaxed);
+    for (int slot = 0; slot < reg.nslots; slot++) {
+      LoggerStatsBlock* block = stats.loggers[slot / LOGGER_STATS_BLOCK].load(
+                                                       memory_order_relaxed);
+      if (block)
+        for (int c = 0; c < LOGGER_STATS; c++)
+          reg.retiredlog[slot * LOGGER_STATS + c] +=
+             block->counter[slot % LOGGER_STATS_BLOCK][c].load(
+                                                       memory_order_relaxed);
+    }
+    reg.threads.erase(&stats);
+  }
+};
+
+ThreadStats::ThreadStats() {
+  //
+  for (int c = 0; c < STAT_COUNTERS; c++)
+    counter[c].store(0, memory_order_relaxed);
+  for (int b = 0; b < LOGGER_STATS_BLOCKS; b++)
+    loggers[b].store(nullptr, memory_order_relaxed);
+  samples = 0;
+}
+
+ThreadStats::~ThreadStats() {
+  // no longer registered. Nobody reads the blocks
+  //
+  for (int b = 0; b < LOGGER_STATS_BLOCKS; b++)
+    delete loggers[b].load(memory_order_relaxed);
+}
+
+LoggerStatsBlock* ThreadStats::new_block(int index) {
+  // Readers load the block with acquire, and find its counters zeroed
+  //
+  LoggerStatsBlock* block = new LoggerStatsBlock;
+
+  for (int slot = 0; slot < LOGGER_STATS_BLOCK; slot++) {
+    for (int c = 0; c < LOGGER_STATS; c++)
+      block->counter[slot][c].store(0, memory_order_relaxed);
+    block->samples[slot] = 0;
+  }
+
+  loggers[index].store(block, memory_order_release);
+
+  return block;
+}
+
+static void slot_totals(statsregistry& reg, int slot,
+                        unsigned long long total[LOGGER_STATS]) {
+  // Under reg.lock
+  //
+  for (int c = 0; c < LOGGER_STATS; c++)
+    total[c] = reg.retiredlog[slot * LOGGER_STATS + c];
+
+  for (ThreadStats* ts : reg.threads) {
+    LoggerStatsBlock* block = ts->loggers[slot / LOGGER_STATS_BLOCK].load(
+                                                       memory_order_acquire);
+    if (block)
+      for (int c = 0; c < LOGGER_STATS; c++)
+        total[c] += block->counter[slot % LOGGER_STATS_BLOCK][c].load(
+                                                       memory_order_relaxed);
+  }
+}
+
+int ThreadStats::acquire_slot(unsigned long long base[LOGGER_STATS]) {
+  //
+  statsregistry& reg = registry();
+  lock_guard<mutex> lock(reg.lock);
+
+  int slot;
+  if (not reg.freeslots.empty()) {
+    slot = reg.freeslots.back();
+    reg.freeslots.pop_back();
+  }
+  else if (reg.nslots < LOGGER_STATS_BLOCK * LOGGER_STATS_BLOCKS) {
+    slot = reg.nslots++;
+    reg.retiredlog.resize(reg.nslots * LOGGER_STATS, 0);
+  }
+  else {
+    for (int c = 0; c < LOGGER_STATS; c++)
+      base[c] = 0;
+    return -1;
+  }
+
+  slot_totals(reg, slot, base);
+
+  return slot;
+}
+
+void ThreadStats::release_slot(int slot) {
+  //
+  if (slot < 0)
+    return;
+
+  statsregistry& reg = registry();
+  lock_guard<mutex> lock(reg.lock);
+
+  reg.freeslots.push_back(slot);
+}
+
+void ThreadStats::logger_totals(int slot,
+                                unsigned long long total[LOGGER_STATS]) {
+  //
+  if (slot < 0) {
+    for (int c = 0; c < LOGGER_STATS; c++)
+      total[c] = 0;
+    return;
+  }
+
+  statsregistry& reg = registry();
+  lock_guard<mutex> lock(reg.lock);
+
+  slot_totals(reg, slot, total);
+}
+
+ThreadStats& ThreadStats::get() {
+  //
+  static thread_local statsslot slot;
+
+  return slot.stats;
+}
+
+void ThreadStats::atfork(int stage) {
+  // Threads that do not survive fork() stay registered in the child, and
+  // their counters summed
+  //
+  statsregistry& reg = registry();
+
+  if (stage == FORK_PREPARE)
+    reg.lock.lock();
+  else
+    reg.lock.unlock();
+}
+
+unsigned long long logging::stats_clock() {
+  //
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+LogStats Logger::global_stats() {
+  // Totals for all loggers and threads since the program started
+  //
+  unsigned long long total[STAT_COUNTERS];
+  statsregistry& reg = registry();
+
+  {
+    lock_guard<mutex> lock(reg.lock);
+
+    for (int c = 0; c < STAT_COUNTERS; c++)
+      total[c] = reg.retired[c];
+    for (ThreadStats* ts : reg.threads)
+      for (int c = 0; c < STAT_COUNTERS; c++)
+        total[c] += ts->counter[c].load(memory_order_relaxed);
+  }
+
+  LogStats st;
+  st.emitted     = total[STAT_EMITTED];
+  st.filtered    = total[STAT_FILTERED];
+  st.dropped     = total[STAT_DROPPED];
+  st.suppressed  = total[STAT_SUPPRESSED];
+  st.sampled     = total[STAT_SAMPLED];
+  st.bytes       = total[STAT_BYTES];
+  st.flushes     = total[STAT_FLUSHES];
+  st.format_ns   = total[STAT_FORMAT_NS];
+  st.write_ns    = total[STAT_WRITE_NS];
+  st.lockwait_ns = total[STAT_LOCKWAIT_NS];
+
+  return st;
+}
+
+LogStats Logger::stats() {
+  // Counters of this logger. Records are counted where they are created,
+  // bytes and flushes where they are written. Handler counters start
+  // over when the handler is replaced. No timings
+  //
+  LogStats st = LogStats();
+  unsigned long long total[LOGGER_STATS];
+
+  ThreadStats::logger_totals(treeptr->statslot, total);
+
+  st.emitted    = total[STAT_EMITTED]    - treeptr->statbase[STAT_EMITTED];
+  st.filtered   = total[STAT_FILTERED]   - treeptr->statbase[STAT_FILTERED];
+  st.dropped    = total[STAT_DROPPED]    - treeptr->statbase[STAT_DROPPED];
+  st.suppressed = total[STAT_SUPPRESSED] - treeptr->statbase[STAT_SUPPRESSED];
+  st.sampled    = total[STAT_SAMPLED]    - treeptr->statbase[STAT_SAMPLED];
+  st.bytes      = treeptr->streambytes.load(memory_order_relaxed);
+
+  // handlers may be replaced meanwhile
+  //
+  SharedLock lock(logging::logmutex);
+
+  if (treeptr->logfile) {
+    st.bytes   += treeptr->logfile->bytes();
+    st.flushes += treeptr->logfile->flushes();
+  }
+  if (treeptr->shardfile) {
+    st.bytes   += treeptr->shardfile->file_bytes();
+    st.flushes += treeptr->shardfile->file_flushes();
+  }
+  if (treeptr->ringfile)
+    st.bytes   += treeptr->ringfile->bytes();
+  if (treeptr->binfile) {
+    st.bytes   += treeptr->binfile->bytes();
+    st.flushes += treeptr->binfile->flushes();
+  }
+  if (treeptr->netsink) {
+    st.bytes   += treeptr->netsink->bytes();
+    st.dropped += treeptr->netsink->drops();
+  }
+  for (LogTarget& target : treeptr->chain) {
+    st.bytes   += target.handler->bytes();
+    st.flushes += target.handler->flushes();
+    if (target.kind == HANDLER_NETSINK)
+      st.dropped += static_cast<NetworkHandler*>(target.handler)->drops();
+  }
+
+  return st;
+}
+
+bool Logger::set_stats_timing(bool mode) {
+  // Time formatting, handlers and lock waits. Costs two clock readings
+  // per measured step. Return the previous setting
+  //
+  return logging::stattiming.exchange(mode);
+}
@@ -0,0 +1,813 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Configuration files
+//
+// A configuration file describes loggers, one section each:
+//
+//   # comment
+//   [root]
+//   level         = WARNING
+//   stream        = stderr
+//   [app.net]
+//   level         = DEBUG
+//   format        = %t [%l] %n %m
+//   logfile       = /var/log/app/net.log
+//   logfile.level = INFO
+//
+// The file is parsed into a snapshot, a LogConfig, which is never changed
+// once applied. Applying one takes filemutex, opens the handlers it needs
+// with logmutex free and then swaps every setting in under a single
+// exclusive hold of logmutex: records are delivered either with the whole
+// old configuration or with the whole new one. Level changes bump the
+// level cache generation once, and checks of filtered out records take
+// no lock. Handlers replaced are closed, flushing them, once logmutex is
+// released
+//
+// Against the previous snapshot, settings the file still gives are kept
+// or changed, those it no longer gives return to the defaults of a new
+// logger and those it never gave are left alone
+//
+
+LoggerConfig::LoggerConfig() : set(0),
+                               level(NOTSET),
+                               propagate(true),
+                               stream(DEVNULL),
+                               recfmt(DEFAULT_RECORDFMT),
+                               timefmt(DEFAULT_TIMEFMT),
+                               mode(FORMAT_TEXT),
+                               bufsize(DEFAULT_FILE_BUFSIZE),
+                               flushlevel(DEFAULT_FLUSH_LEVEL),
+                               interval(DEFAULT_FLUSH_INTERVAL),
+                               sharding(SHARD_NONE),
+                               ringsize(DEFAULT_RING_SIZE),
+                               binbufsize(DEFAULT_FILE_BUFSIZE),
+                               binflushlevel(DEFAULT_FLUSH_LEVEL),
+                               bininterval(DEFAULT_FLUSH_INTERVAL),
+                               protocol(NET_UDP),
+                               facility(DEFAULT_NET_FACILITY),
+                               handlerset(0),
+                               handlerlevel{NOTSET, NOTSET, NOTSET, NOTSET,
+                                            NOTSET} {}
+
+//////////// Parsing
+//
+static string trim(const string& s) {
+  // strip blanks, then one pair of double quotes, which keep the blanks
+  // inside them
+  //
+  size_t first = s.find_first_not_of(" \t\r");
+  if (first == string::npos)
+    return string();
+
+  size_t last = s.find_last_not_of(" \t\r");
+  string value = s.substr(first, last - first + 1);
+
+  if (value.size() >= 2 and value.front() == '"' and value.back() == '"')
+    value = value.substr(1, value.size() - 2);
+
+  return value;
+}
+
+static bool parse_level(const string& value, int& level) {
+  // a level name, any case, or its number
+  //
+  static const char* names[] = { "NOTSET", "DEBUG", "INFO", "WARNING",
+                                 "ERROR", "CRITICAL" };
+
+  for (int l = MINLOG; l <= MAXLOG; l++)
+    if (strcasecmp(value.c_str(), names[l]) == 0) {
+      level = l;
+      return true;
+    }
+
+  char* end;
+  long  l = strtol(value.c_str(), &end, 10);
+  if (value.empty() or *end or l < MINLOG or l > MAXLOG)
+    return false;
+
+  level = l;
+  return true;
+}
+
+static bool parse_number(const string& value, size_t& number) {
+  // with an optional K, M or G suffix. Values that do not fit are invalid
+  //
+  char*         end;
+  int           shift = 0;
+
+  errno = 0;
+  unsigned long n = strtoul(value.c_str(), &end, 10);
+
+  if (value.empty() or end == value.c_str() or value[0] == '-' or
+      errno == ERANGE)
+    return false;
+
+  switch (toupper(*end)) {
+    case 'K':  shift = 10; end++; break;
+    case 'M':  shift = 20; end++; break;
+    case 'G':  shift = 30; end++; break;
+    default:   break;
+  }
+  if (*end or n > (SIZE_MAX >> shift))
+    return false;
+
+  n <<= shift;
+
+  number = n;
+  return true;
+}
+
+static bool parse_int(const string& value, int& number) {
+  //
+  size_t n;
+
+  if (not parse_number(value, n) or n > (size_t) INT_MAX)
+    return false;
+
+  number = n;
+  return true;
+}
+
+static bool parse_bool(const string& value, bool& mode) {
+  //
+  static const char* yes[] = { "yes", "true", "on", "1" };
+  static const char* no[]  = { "no", "false", "off", "0" };
+
+  for (const char* word : yes)
+    if (strcasecmp(value.c_str(), word) == 0)
+      return mode = true;
+  for (const char* word : no)
+    if (strcasecmp(value.c_str(), word) == 0) {
+      mode = false;
+      return true;
+    }
+
+  return false;
+}
+
+static bool parse_choice(const string& value, const char* const names[],
+                         const int values[], int n, int& choice) {
+  //
+  for (int i = 0; i < n; i++)
+    if (strcasecmp(value.c_str(), names[i]) == 0) {
+      choice = values[i];
+      return true;
+    }
+
+  return false;
+}
+
+static bool parse_sharding(const string& value, int& sharding) {
+  // "none", "cpu" or "node", then "merge", separated by blanks or commas
+  //
+  sharding = SHARD_NONE;
+
+  size_t pos = 0;
+  while ((pos = value.find_first_not_of(" \t,", pos)) != string::npos) {
+    size_t end  = value.find_first_of(" \t,", pos);
+    string word = value.substr(pos, end - pos);
+
+    if (strcasecmp(word.c_str(), "cpu") == 0)
+      sharding |= SHARD_CPU;
+    else if (strcasecmp(word.c_str(), "node") == 0)
+      sharding |= SHARD_NODE;
+    else if (strcasecmp(word.c_str(), "merge") == 0)
+      sharding |= SHARD_MERGE;
+    else if (strcasecmp(word.c_str(), "none") != 0)
+      return false;
+    pos = end;
+  }
+
+  return true;
+}
+
+static bool parse_setting(LoggerConfig& entry, const string& key,
+                          const string& value) {
+  // Return false for unknown keys and invalid values
+  //
+  static const char* const streams[]   = { "stdout", "stderr", "stdlog",
+                                           "fd_stdout", "fd_stderr",
+                                           "none" };
+  static const int         streamval[] = { STDOUT, STDERR, STDLOG,
+                                           FD_STDOUT, FD_STDERR, DEVNULL };
+  static const char* const modes[]     = { "text", "json", "logfmt" };
+  static const int         modeval[]   = { FORMAT_TEXT, FORMAT_JSON,
+                                           FORMAT_LOGFMT };
+  static const char* const protos[]    = { "udp", "tcp" };
+  static const int         protoval[]  = { NET_UDP, NET_TCP };
+  static const char* const handlers[]  = { "stream", "logfile", "ringfile",
+                                           "netsink", "binfile" };
+
+  // handler levels: "<handler>.level", by HANDLER_* bit position
+  //
+  for (int kind = 0; kind < HANDLER_KINDS; kind++)
+    if (key == string(handlers[kind]) + ".level") {
+      entry.handlerset |= 1 << kind;
+      return parse_level(value, entry.handlerlevel[kind]);
+    }
+
+  if (key == "level") {
+    entry.set |= CONFIG_LEVEL;
+    return parse_level(value, entry.level);
+  }
+  if (key == "propagate") {
+    entry.set |= CONFIG_PROPAGATE;
+    return parse_bool(value, entry.propagate);
+  }
+  if (key == "stream") {
+    entry.set |= CONFIG_STREAM;
+    return parse_choice(value, streams, streamval, 6, entry.stream);
+  }
+
+  if (key == "format") {
+    entry.set   |= CONFIG_FORMAT;
+    entry.recfmt = value;
+    return true;
+  }
+  if (key == "format.time") {
+    entry.set    |= CONFIG_FORMAT;
+    entry.timefmt = value;
+    return true;
+  }
+  if (key == "format.mode") {
+    entry.set |= CONFIG_FORMAT;
+    return parse_choice(value, modes, modeval, 3, entry.mode);
+  }
+
+  if (key == "logfile") {
+    entry.set    |= CONFIG_LOGFILE;
+    entry.logfile = value;
+    return true;
+  }
+  if (key == "logfile.buffer")
+    return parse_number(value, entry.bufsize);
+  if (key == "logfile.flushlevel")
+    return parse_level(value, entry.flushlevel);
+  if (key == "logfile.interval")
+    return parse_int(value, entry.interval);
+  if (key == "logfile.sharding")
+    return parse_sharding(value, entry.sharding);
+
+  if (key == "ringfile") {
+    entry.set     |= CONFIG_RINGFILE;
+    entry.ringfile = value;
+    return true;
+  }
+  if (key == "ringfile.size")
+    return parse_number(value, entry.ringsize) and entry.ringsize > 0;
+
+  if (key == "binfile") {
+    entry.set    |= CONFIG_BINFILE;
+    entry.binfile = value;
+    return true;
+  }
+  if (key == "binfile.buffer")
+    return parse_number(value, entry.binbufsize);
+  if (key == "binfile.flushlevel")
+    return parse_level(value, entry.binflushlevel);
+  if (key == "binfile.interval")
+    return parse_int(value, entry.bininterval);
+
+  if (key == "netsink") {
+    entry.set    |= CONFIG_NETSINK;
+    entry.netsink = value;
+    return true;
+  }
+  if (key == "netsink.protocol")
+    return parse_choice(value, protos, protoval, 2, entry.protocol);
+  if (key == "netsink.facility")
+    return parse_int(value, entry.facility) and entry.facility < 24;
+
+  return false;
+}
+
+static bool parse_config(const string& path, LogConfig& config,
+                         string& errmsg) {
+  // Return false and the error, as "file:line: message", on failure
+  //
+  ifstream in(path);
+  if (not in.is_open()) {
+    errmsg = path + ": " + strerror(errno);
+    return false;
+  }
+
+  map<string, size_t> sections;        // logger name -> entry
+  LoggerConfig*       entry = nullptr;
+  string              line;
+  int                 lineno = 0;
+
+  config.path = path;
+
+  while (getline(in, line)) {
+    lineno++;
+    string where = path + ":" + to_string(lineno) + ": ";
+    string text  = trim(line);
+
+    if (text.empty() or text[0] == '#' or text[0] == ';')
+      continue;
+
+    // a section names a logger. Sections for the same logger add up
+    //
+    if (text[0] == '[') {
+      if (text.back() != ']') {
+        errmsg = where + "unterminated section name";
+        return false;
+      }
+      string name = trim(text.substr(1, text.size() - 2));
+      if (name == ROOT_ALIAS)
+        name = string();
+
+      auto found = sections.find(name);
+      if (found == sections.end()) {
+        found = sections.insert(make_pair(name,
+                                          config.loggers.size())).first;
+        config.loggers.push_back(LoggerConfig());
+        config.loggers.back().name = name;
+      }
+      entry = &config.loggers[found->second];
+      continue;
+    }
+
+    size_t equal = text.find('=');
+    if (equal == string::npos) {
+      errmsg = where + "expected 'key = value'";
+      return false;
+    }
+    if (not entry) {
+      errmsg = where + "setting outside of a logger section";
+      return false;
+    }
+
+    string key   = trim(text.substr(0, equal));
+    string value = trim(text.substr(equal + 1));
+
+    if (not parse_setting(*entry, key, value)) {
+      errmsg = where + "invalid setting '" + key + "'";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+//////////// Loading
+//
+// Load the configuration file at 'path' and apply it (safe)
+// Nothing is applied if the file is invalid or a handler cannot be opened
+//
+int Logger::load_config(const string& path) {
+  //
+  shared_ptr<LogConfig> config = make_shared<LogConfig>();
+  string                errmsg;
+
+  if (not parse_config(path, *config, errmsg)) {
+    get_logger().error("error loading configuration: %s", errmsg.c_str());
+    return 1;
+  }
+
+  return apply_config(config);
+}
+
+// Load the configuration file in effect again (safe)
+//
+int Logger::reload_config() {
+  //
+  shared_ptr<const LogConfig> current = get_config();
+
+  if (not current) {
+    get_logger().error("error reloading configuration: none loaded");
+    return 1;
+  }
+
+  return load_config(current->path);
+}
+
+// The configuration file in effect, null if none. A snapshot: the next
+// load does not change it (safe)
+//
+shared_ptr<const LogConfig> Logger::get_config() {
+  //
+  SharedLock lock(logging::logmutex);
+
+  return LoggerTree::get_config();
+}
+
+int Logger::apply_config(const shared_ptr<LogConfig>& config) {
+  //
+  // Settings of a logger, before and after. A setting is given when in
+  // 'now', reset when only in 'was'
+  //
+  struct change {
+    LoggerTree*         tree;
+    const LoggerConfig* now;
+    const LoggerConfig* was;
+    fmtptr_t            formatter;
+    bool                newlog, newring, newbin, newnet;
+    FileHandler*        logfile;
+    ShardedHandler*     shardfile;
+    std::string         filename;
+    RingHandler*        ringfile;
+    BinaryHandler*      binfile;
+    NetworkHandler*     netsink;
+  };
+  static const LoggerConfig none;
+
+  shared_ptr<const LogConfig> previous;
+  vector<change>              changes;
+  vector<Handler*>            retired;
+  string                      errmsg;
+
+  // the loggers, created if new. Those only in the previous snapshot are
+  // held by it
+  //
+  for (const LoggerConfig& entry : config->loggers)
+    config->held.push_back(entry.name.empty() ?
+                  LoggerTree::get_logger_internal(true, "") :
+                  LoggerTree::get_logger_internal(false, entry.name));
+
+  TimedLock<mutex> lock(logging::filemutex);
+
+  {
+    SharedLock loglock(logging::logmutex);
+
+    previous = LoggerTree::get_config();
+  }
+
+  map<LoggerTree*, size_t> index;
+
+  for (size_t i = 0; i < config->loggers.size(); i++) {
+    change c = change();
+    c.tree = config->held[i].get();
+    c.now  = &config->loggers[i];
+    c.was  = &none;
+    index[c.tree] = changes.size();
+    changes.push_back(c);
+  }
+  for (size_t i = 0; previous and i < previous->loggers.size(); i++) {
+    LoggerTree* tree = previous->held[i].get();
+
+    auto found = index.find(tree);
+    if (found != index.end()) {
+      changes[found->second].was = &previous->loggers[i];
+      continue;
+    }
+    change c = change();
+    c.tree = tree;
+    c.now  = &none;
+    c.was  = &previous->loggers[i];
+    changes.push_back(c);
+  }
+
+  // Open what the new settings need, with logmutex free. Handlers whose
+  // settings did not change stay as they are
+  //
+  for (change& c : changes) {
+    const LoggerConfig& now = *c.now;
+    const LoggerConfig& was = *c.was;
+    LoggerTree*         t   = c.tree;
+
+    if (now.set & CONFIG_FORMAT) {
+      c.formatter = fmtptr_t(new Formatter(
+                      Formatter::get_formatter(now.recfmt, now.timefmt,
+                                               true, now.mode)));
+      c.formatter->fmtptr = nullptr;
+    }
+
+    // handlers are compared with those open, as set_logfile() does, so
+    // that a reload restores the sinks changed since by the program
+    //
+    if (now.set & CONFIG_LOGFILE) {
+      int    sharding = (now.sharding & (SHARD_CPU | SHARD_NODE)) ?
+                        now.sharding : SHARD_NONE;
+      string name;
+
+      if (not now.logfile.empty()) {
+        char* err = logging::absolute_path(now.logfile, name);
+        if (err) {
+          errmsg = "log file '" + now.logfile + "': " + err;
+          break;
+        }
+      }
+
+      if (name != t->filename or sharding != t->sharding) {
+        c.newlog = true;
+        if (not name.empty() and sharding != SHARD_NONE) {
+          c.shardfile = new ShardedHandler(name, now.bufsize,
+                                           now.flushlevel, now.interval,
+                                           sharding);
+          if (not c.shardfile->is_open()) {
+            errmsg = "log file '" + now.logfile + "': " +
+                     strerror(c.shardfile->open_error());
+            break;
+          }
+          c.shardfile->set_rotation(t->rotation);
+        }
+        else if (not name.empty()) {
+          c.logfile = new FileHandler(name, now.bufsize,
+                                      now.flushlevel, now.interval);
+          if (not c.logfile->is_open()) {
+            errmsg = "log file '" + now.logfile + "': " +
+                     strerror(c.logfile->open_error());
+            break;
+          }
+          c.logfile->set_rotation(t->rotation);
+        }
+        c.filename = name;
+      }
+    }
+    else if (was.set & CONFIG_LOGFILE)
+      c.newlog = true;
+
+    if ((now.set & CONFIG_RINGFILE) and
+        (now.ringfile != t->ringname or
+         (t->ringfile and t->ringfile->get_size() != now.ringsize))) {
+      c.newring = true;
+      if (not now.ringfile.empty()) {
+        c.ringfile = new RingHandler(now.ringfile, now.ringsize);
+        if (not c.ringfile->is_open()) {
+          errmsg = "ring file '" + now.ringfile + "': " +
+                   strerror(c.ringfile->open_error());
+          break;
+        }
+      }
+    }
+    else if (not (now.set & CONFIG_RINGFILE) and
+             (was.set & CONFIG_RINGFILE))
+      c.newring = true;
+
+    if ((now.set & CONFIG_BINFILE) and now.binfile != t->binname) {
+      c.newbin = true;
+      if (not now.binfile.empty()) {
+        c.binfile = new BinaryHandler(now.binfile, now.binbufsize,
+                                      now.binflushlevel, now.bininterval);
+        if (not c.binfile->is_open()) {
+          errmsg = "binary log file '" + now.binfile + "': " +
+                   strerror(c.binfile->open_error());
+          break;
+        }
+      }
+    }
+    else if (not (now.set & CONFIG_BINFILE) and (was.set & CONFIG_BINFILE))
+      c.newbin = true;
+
+    if ((now.set & CONFIG_NETSINK) and
+        (now.netsink != t->netaddr or
+         (t->netsink and (t->netsink->get_protocol() != now.protocol or
+                          t->netsink->get_facility() != now.facility)))) {
+      c.newnet = true;
+      if (not now.netsink.empty()) {
+        c.netsink = new NetworkHandler(now.netsink, now.protocol,
+                                       now.facility, DEFAULT_NET_QUEUE);
+        if (not c.netsink->is_open()) {
+          errmsg = "invalid network sink '" + now.netsink + "'";
+          break;
+        }
+      }
+    }
+    else if (not (now.set & CONFIG_NETSINK) and (was.set & CONFIG_NETSINK))
+      c.newnet = true;
+  }
+
+  if (not errmsg.empty()) {
+    for (change& c : changes) {
+      delete c.logfile;
+      delete c.shardfile;
+      delete c.ringfile;
+      delete c.binfile;
+      delete c.netsink;
+    }
+    get_logger().error("error applying configuration '%s': %s",
+                       config->path.c_str(), errmsg.c_str());
+    return 1;
+  }
+
+  // Swap everything in at once. Defaults are those of a new logger
+  //
+  {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    for (change& c : changes) {
+      const LoggerConfig& now = *c.now;
+      const LoggerConfig& was = *c.was;
+      LoggerTree*         t   = c.tree;
+
+      if (now.set & CONFIG_LEVEL)
+        t->loglevel = now.level;
+      else if (was.set & CONFIG_LEVEL)
+        t->loglevel = t->isroot ? WARNING : NOTSET;
+
+      if (now.set & CONFIG_PROPAGATE)
+        t->propagate = now.propagate;
+      else if (was.set & CONFIG_PROPAGATE)
+        t->propagate = true;
+
+      if (now.set & CONFIG_STREAM) {
+        t->outstream = now.stream == STDOUT ? &cout :
+                       now.stream == STDERR ? &cerr :
+                       now.stream == STDLOG ? &clog : nullptr;
+        t->outfd     = now.stream == FD_STDOUT ? STDOUT_FILENO :
+                       now.stream == FD_STDERR ? STDERR_FILENO : -1;
+      }
+      else if (was.set & CONFIG_STREAM) {
+        t->outstream = t->isroot ? &cerr : nullptr;
+        t->outfd     = -1;
+      }
+
+      if ((now.set | was.set) & CONFIG_FORMAT)
+        t->formatter = c.formatter;
+
+      for (int kind = 0; kind < HANDLER_KINDS; kind++)
+        if ((now.handlerset | was.handlerset) & (1 << kind))
+          t->handlerlevel[kind] = (now.handlerset & (1 << kind)) ?
+                                  now.handlerlevel[kind] : NOTSET;
+
+      if (c.newlog) {
+        retired.push_back(t->logfile);
+        retired.push_back(t->shardfile);
+        t->logfile   = c.logfile;
+        t->shardfile = c.shardfile;
+        t->filename  = c.filename;
+        t->sharding  = c.shardfile ? now.sharding : SHARD_NONE;
+      }
+
+      if (c.newring) {
+        retired.push_back(t->ringfile);
+        t->ringfile = c.ringfile;
+        t->ringname = c.ringfile ? now.ringfile : string();
+      }
+      if (c.newbin) {
+        retired.push_back(t->binfile);
+        t->binfile = c.binfile;
+        t->binname = c.binfile ? now.binfile : string();
+      }
+      if (c.newnet) {
+        retired.push_back(t->netsink);
+        t->netsink = c.netsink;
+        t->netaddr = c.netsink ? now.netsink : string();
+      }
+    }
+
+    LoggerTree::invalidate_loglevels();
+    previous = config;
+    LoggerTree::get_config().swap(previous);
+  }
+
+  // Files kept open take the new buffering, which flushes them, and the
+  // old handlers are closed with logmutex released, as set_logfile()
+  // does. The previous snapshot goes with 'previous', after filemutex
+  //
+  for (change& c : changes) {
+    const LoggerConfig& now = *c.now;
+    LoggerTree*         t   = c.tree;
+
+    if ((now.set & CONFIG_LOGFILE) and not c.newlog) {
+      if (t->logfile)
+        t->logfile->set_policy(now.bufsize, now.flushlevel, now.interval);
+      else if (t->shardfile)
+        t->shardfile->set_policy(now.bufsize, now.flushlevel, now.interval);
+    }
+    if ((now.set & CONFIG_BINFILE) and not c.newbin and t->binfile)
+      t->binfile->set_policy(now.binbufsize, now.binflushlevel,
+                             now.bininterval);
+  }
+
+  for (Handler* handler : retired)
+    delete handler;
+
+  return 0;
+}
+
+//////////// Reloading on SIGHUP
+//
+// The signal handler writes a byte to a pipe. A reloader thread reads it
+// and loads the configuration file again, out of signal context. Signals
+// arriving during a reload are coalesced into the next one
+//
+
+static atomic<int>      hupfd(-1);        // write end, for the handler
+static int              readfd = -1;      // read end, for the reloader
+static thread           reloader;
+static bool             reloading = false;
+static struct sigaction previoushup;
+
+static void hup_handler(int sig) {
+  // a full pipe has reloads pending already
+  //
+  int     saved = errno;
+  char    c     = 0;
+  ssize_t n     = write(hupfd.load(), &c, 1);
+
+  (void) n;
+  errno = saved;
+}
+
+static void reload_loop(int fd) {
+  // Closing the write end stops the thread
+  //
+  char buf[64];
+
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    Logger::reload_config();
+  }
+}
+
+static bool start_reloader() {
+  // Caller holds filemutex
+  //
+  int fds[2];
+
+  if (pipe2(fds, O_CLOEXEC) < 0)
+    return false;
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+  readfd = fds[0];
+  hupfd.store(fds[1]);
+  reloader = thread(reload_loop, readfd);
+
+  return true;
+}
+
+// Reload the configuration file on SIGHUP, or stop doing it. Return the
+// previous mode
+//
+bool Logger::set_config_reload(bool mode) {
+  //
+  thread stopped;
+  int    fd = -1;
+  bool   curmode;
+  {
+    lock_guard<mutex> lock(logging::filemutex);
+
+    curmode = reloading;
+    if (mode == curmode)
+      return curmode;
+
+    if (mode) {
+      if (not start_reloader())
+        return curmode;
+
+      struct sigaction action;
+
+      action.sa_handler = hup_handler;
+      action.sa_flags   = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGHUP, &action, &previoushup);
+    }
+    else {
+      sigaction(SIGHUP, &previoushup, nullptr);
+
+      close(hupfd.exchange(-1));
+      stopped.swap(reloader);
+      fd     = readfd;
+      readfd = -1;
+    }
+
+    reloading = mode;
+  }
+
+  // the reloader may be waiting for filemutex, in a reload
+  //
+  if (stopped.joinable())
+    stopped.join();
+  if (fd >= 0)
+    close(fd);
+
+  return curmode;
+}
+
+void LogConfig::atfork(int stage) {
+  // The child gets a pipe and a reloader of its own. Signals sent to
+  // either process would otherwise wake the reloader of the other
+  //
+  if (stage != FORK_CHILD or not reloading)
+    return;
+
+  logging::forget_thread(reloader);
+  close(readfd);
+  close(hupfd.load());
+  reloading = start_reloader();
+}
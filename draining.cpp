@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Lifecycle
+//
+// Handlers holding output of their own (buffered log files, network
+// sinks) are enlisted in a fixed table, so that they can be flushed all
+// at once, reset after fork() and drained from a signal handler.
+// Enlisting and delisting take 'regmutex'; the emergency drain reads the
+// table with no locks
+//
+// fork() is prepared by taking the library locks in order: filemutex,
+// the logger dictionaries and the name index, fmtmutex, logmutex
+// (exclusive), the filter mutexes, the file flusher and segment worker
+// mutexes, regmutex, the handler mutexes and the statistics registry
+// lock. No record is being delivered nor configured while the process
+// forks. The child finds every lock free and none of the library
+// threads: it discards the inherited buffers and queues, which the
+// parent writes, renders its process ids and starts threads of its own
+//
+
+static atomic<Handler*> registry[MAX_HANDLERS];
+static mutex            regmutex;
+
+void Handler::enlist(Handler* handler) {
+  // a full table leaves the handler out. It is still flushed when closed
+  //
+  lock_guard<mutex> lock(regmutex);
+
+  for (atomic<Handler*>& slot : registry)
+    if (slot.load(memory_order_relaxed) == nullptr) {
+      slot.store(handler);
+      return;
+    }
+}
+
+void Handler::delist(Handler* handler) {
+  // waits for flush_all() or fork() to be done with the handler
+  //
+  lock_guard<mutex> lock(regmutex);
+
+  for (atomic<Handler*>& slot : registry)
+    if (slot.load(memory_order_relaxed) == handler)
+      slot.store(nullptr);
+}
+
+static void each_handler(int stage) {
+  // fork() stage of every handler. Caller must hold regmutex
+  //
+  for (atomic<Handler*>& slot : registry) {
+    Handler* handler = slot.load(memory_order_relaxed);
+    if (handler)
+      handler->atfork(stage);
+  }
+}
+
+static void fork_prepare() {
+  //
+  logging::filemutex.lock();
+  LoggerTree::tree_atfork(FORK_PREPARE);
+  logging::fmtmutex.lock();
+  logging::logmutex.lock();
+  LoggerTree::filters_atfork(FORK_PREPARE);
+  FileHandler::workers_atfork(FORK_PREPARE);
+  regmutex.lock();
+  each_handler(FORK_PREPARE);
+  ThreadStats::atfork(FORK_PREPARE);
+}
+
+static void fork_parent() {
+  //
+  ThreadStats::atfork(FORK_PARENT);
+  each_handler(FORK_PARENT);
+  regmutex.unlock();
+  FileHandler::workers_atfork(FORK_PARENT);
+  LoggerTree::filters_atfork(FORK_PARENT);
+  logging::logmutex.unlock();
+  logging::fmtmutex.unlock();
+  LoggerTree::tree_atfork(FORK_PARENT);
+  logging::filemutex.unlock();
+}
+
+static void fork_child() {
+  // The asynchronous queue is replaced last, its writer delivers records
+  //
+  ThreadStats::atfork(FORK_CHILD);
+  each_handler(FORK_CHILD);
+  regmutex.unlock();
+  FileHandler::workers_atfork(FORK_CHILD);
+  LoggerTree::filters_atfork(FORK_CHILD);
+  logging::logmutex.reset();
+  logging::fmtmutex.unlock();
+  LoggerTree::tree_atfork(FORK_CHILD);
+  logging::filemutex.unlock();
+
+  Formatter::atfork(FORK_CHILD);
+  LogConfig::atfork(FORK_CHILD);
+  LogQueue::atfork(FORK_CHILD);
+}
+
+// Registered when the program starts, before any thread of the library
+//
+static struct forkhandlers {
+  forkhandlers() { pthread_atfork(fork_prepare, fork_parent, fork_child); }
+} forkregistration;
+
+///////////////  Flushing and shutdown
+//
+// Wait up to 'timeout' ms for the asynchronous queue to deliver the records
+// queued so far, then flush every handler. Network sinks wait up to
+// NET_TIMEOUT ms for their queues to be sent
+// Return false if the queue did not drain in time
+//
+bool Logger::flush_all(int timeout) {
+  //
+  shared_ptr<LogQueue> queue;
+  {
+    SharedLock lock(logging::logmutex);
+
+    queue = LoggerTree::get_async_queue();
+  }
+
+  bool complete = not queue or queue->drain(timeout);
+
+  lock_guard<mutex> lock(regmutex);
+
+  for (atomic<Handler*>& slot : registry) {
+    Handler* handler = slot.load(memory_order_relaxed);
+    if (handler)
+      handler->flush();
+  }
+
+  return complete;
+}
+
+// Stop asynchronous delivery, giving the writer up to 'timeout' ms for
+// the pending records, and flush every handler. Logging goes on, in
+// synchronous mode, and buffered log files write every record through
+// Asynchronous mode can not be turned on again
+// Return false if records had to be discarded
+//
+bool Logger::shutdown(int timeout) {
+  //
+  logging::finished.store(true);
+
+  shared_ptr<LogQueue> queue;
+  {
+    lock_guard<RWMutex> lock(logging::logmutex);
+
+    LoggerTree::get_async_queue().swap(queue);
+  }
+
+  bool complete = not queue or queue->stop(timeout);
+  queue.reset();
+
+  return flush_all(0) and complete;
+}
+
+///////////////  Emergency drain
+//
+// Write out, with raw write(2) calls and no locks, the output held by
+// the enlisted handlers and then the messages still in the asynchronous
+// queue, to stderr. Meant for a process about to die: the state found
+// may be half updated by the interrupted threads. Async-signal-safe
+//
+void Logger::emergency_drain() {
+  //
+  int saved = errno;
+
+  for (atomic<Handler*>& slot : registry) {
+    Handler* handler = slot.load();
+    if (handler)
+      handler->emergency_drain();
+  }
+  LogQueue::emergency_drain(STDERR_FILENO);
+
+  errno = saved;
+}
+
+static const int crashsignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE,
+                                    SIGABRT };
+static const int ncrashsignals  = sizeof(crashsignals) / sizeof(int);
+
+static struct sigaction previous[ncrashsignals];
+static atomic<bool>     crashhandling(false);
+
+static void crash_handler(int sig) {
+  // Drain once, even if several threads crash. Then restore the previous
+  // disposition and raise the signal again, blocked until we return
+  //
+  static atomic_flag drained = ATOMIC_FLAG_INIT;
+
+  if (not drained.test_and_set())
+    Logger::emergency_drain();
+
+  for (int i = 0; i < ncrashsignals; i++)
+    if (crashsignals[i] == sig)
+      sigaction(sig, &previous[i], nullptr);
+
+  raise(sig);
+}
+
+// Install or remove a handler for SIGSEGV, SIGBUS, SIGILL, SIGFPE and
+// SIGABRT that runs emergency_drain() before the previous disposition of
+// the signal. Return the previous mode
+//
+bool Logger::set_crash_handler(bool mode) {
+  //
+  lock_guard<mutex> lock(logging::filemutex);
+
+  bool curmode = crashhandling.load();
+  if (mode == curmode)
+    return curmode;
+
+  if (mode) {
+    struct sigaction action;
+
+    action.sa_handler = crash_handler;
+    action.sa_flags   = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    for (int i = 0; i < ncrashsignals; i++)
+      sigaction(crashsignals[i], &action, &previous[i]);
+  }
+  else
+    for (int i = 0; i < ncrashsignals; i++)
+      sigaction(crashsignals[i], &previous[i], nullptr);
+
+  crashhandling.store(mode);
+
+  return curmode;
+}
@@ -0,0 +1,663 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Binary log files
+//
+// A binary log file is a sequence of entries, each one starting with its
+// tag byte. Numbers are LEB128 varints, signed ones zigzag encoded first
+//
+//   BIN_SESSION   BINARY_MAGIC, pid, ppid
+//   BIN_NAME      id, length, logger name
+//   BIN_FORMAT    id, length, format, length, argument types
+//   BIN_TEXT      header, length, message
+//   BIN_CAPTURED  header, format id, arguments
+//
+//   header        seconds (delta from the previous record), nanoseconds,
+//                 level << 1 | main thread flag, logger id, thread id
+//
+// Every handler starts a new session, so ids and time deltas only hold
+// within a session. Arguments follow the LogArg tags of the format entry:
+// integers and pointers as varints, float and double as their bytes in
+// the writer's byte order, long double converted to double and strings
+// as length and bytes
+//
+
+static void put_varint(LogBuffer& out, unsigned long long v) {
+  //
+  char*  p = out.tail(10);
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (char) (v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char) v;
+
+  out.commit(n);
+}
+
+static unsigned long long zigzag(long long v) {
+  //
+  return ((unsigned long long) v << 1) ^ (unsigned long long) (v >> 63);
+}
+
+static long long unzigzag(unsigned long long v) {
+  //
+  return (long long) (v >> 1) ^ -(long long) (v & 1);
+}
+
+static void put_bytes(LogBuffer& out, const char* s, size_t n) {
+  //
+  put_varint(out, n);
+  out.append(s, n);
+}
+
+BinaryHandler::BinaryHandler(const string& fname, size_t bufsize,
+                             int flushlevel, int interval) :
+                         FileHandler(fname, bufsize, flushlevel, interval),
+                         scratch(0),
+                         forked(false),
+                         lastsec(0) {
+  //
+  if (not is_open())
+    return;
+
+  lock_guard<mutex> lock(hmutex);
+
+  scratch.append((char) BIN_SESSION);
+  scratch.append(BINARY_MAGIC, strlen(BINARY_MAGIC));
+  put_varint(scratch, getpid());
+  put_varint(scratch, getppid());
+
+  emit_locked(scratch.data(), scratch.size(), NOTSET);
+}
+
+void BinaryHandler::atfork(int stage) {
+  // Records are only decoded in the order of a single writer session.
+  // A fork() child appending to the same file would break the parent's
+  // session, so it writes nothing
+  //
+  if (stage == FORK_CHILD)
+    forked = true;
+
+  FileHandler::atfork(stage);
+}
+
+unsigned long BinaryHandler::intern_name(const string& name) {
+  // Logger id. New names are defined in the output first
+  // Id 0 stands for no name. Caller must hold hmutex
+  //
+  if (name.empty())
+    return 0;
+
+  map<string, unsigned long>::iterator it = names.find(name);
+  if (it != names.end())
+    return it->second;
+
+  unsigned long id = names.size() + 1;
+  names[name] = id;
+
+  scratch.append((char) BIN_NAME);
+  put_varint(scratch, id);
+  put_bytes(scratch, name.data(), name.size());
+
+  return id;
+}
+
+unsigned long BinaryHandler::intern_format(const char* format,
+                                           const char* argtypes) {
+  // Format id. Deferred formats have static storage so their address
+  // identifies them. Caller must hold hmutex
+  //
+  pair<const char*, const char*> key(format, argtypes);
+
+  map<pair<const char*, const char*>, unsigned long>::iterator it =
+                                                         formats.find(key);
+  if (it != formats.end())
+    return it->second;
+
+  unsigned long id = formats.size() + 1;
+  formats[key] = id;
+
+  scratch.append((char) BIN_FORMAT);
+  put_varint(scratch, id);
+  put_bytes(scratch, format, strlen(format));
+  put_bytes(scratch, argtypes, strlen(argtypes));
+
+  return id;
+}
+
+void BinaryHandler::encode_header(int tag, const LogRecord& rec,
+                                  unsigned long nameid) {
+  //
+  long long sec  = rec.stamp.tv_sec;
+  bool mainthread = rec.tid == logging::main_thread_id;
+
+  scratch.append((char) tag);
+  put_varint(scratch, zigzag(sec - lastsec));
+  put_varint(scratch, rec.stamp.tv_nsec);
+  put_varint(scratch, (unsigned) rec.level << 1 | mainthread);
+  put_varint(scratch, nameid);
+  put_varint(scratch, (unsigned int) hash<thread::id>()(rec.tid));
+
+  lastsec = sec;
+}
+
+void BinaryHandler::emit(const char* record, size_t length, int level) {
+  // Text written to the handler directly. Stored as an unnamed record
+  //
+  LogRecord rec(level);
+  rec.message = record;
+  rec.msglen  = length;
+
+  emit_record(rec, string());
+}
+
+void BinaryHandler::emit_record(const LogRecord& rec, const string& name) {
+  //
+  if (not is_open())
+    return;
+
+  lock_guard<mutex> lock(hmutex);
+
+  if (forked)
+    return;
+
+  scratch.clear();
+
+  unsigned long nameid = intern_name(name);
+
+  if (not rec.render) {
+    encode_header(BIN_TEXT, rec, nameid);
+    put_bytes(scratch, rec.message, rec.msglen);
+  }
+  else {
+    unsigned long fmtid = intern_format(rec.format, rec.argtypes);
+
+    encode_header(BIN_CAPTURED, rec, nameid);
+    put_varint(scratch, fmtid);
+
+    // transcode the captured arguments
+    //
+    const char* p = rec.args;
+    for (const char* t = rec.argtypes; *t; t++) {
+      switch (*t) {
+        case 'b': put_varint(scratch, zigzag(LogArg<signed char>::load(p)));
+                  break;
+        case 'h': put_varint(scratch, zigzag(LogArg<short>::load(p)));
+                  break;
+        case 'i': put_varint(scratch, zigzag(LogArg<int>::load(p)));
+                  break;
+        case 'l': put_varint(scratch, zigzag(LogArg<long long>::load(p)));
+                  break;
+        case 'B': put_varint(scratch, LogArg<unsigned char>::load(p));
+                  break;
+        case 'H': put_varint(scratch, LogArg<unsigned short>::load(p));
+                  break;
+        case 'I': put_varint(scratch, LogArg<unsigned int>::load(p));
+                  break;
+        case 'L': put_varint(scratch,
+                             LogArg<unsigned long long>::load(p));
+                  break;
+        case 'p': put_varint(scratch,
+                             (uintptr_t) LogArg<const void*>::load(p));
+                  break;
+        case 'f': {
+                    float f = LogArg<float>::load(p);
+                    scratch.append((const char*) &f, sizeof(f));
+                  }
+                  break;
+        case 'd': {
+                    double d = LogArg<double>::load(p);
+                    scratch.append((const char*) &d, sizeof(d));
+                  }
+                  break;
+        case 'D': {
+                    double d = LogArg<long double>::load(p);
+                    scratch.append((const char*) &d, sizeof(d));
+                  }
+                  break;
+        case 's': {
+                    const char* s = LogArg<const char*>::load(p);
+                    put_bytes(scratch, s, strlen(s));
+                  }
+                  break;
+      }
+    }
+  }
+
+  emit_locked(scratch.data(), scratch.size(), rec.level);
+}
+
+//////////// Binary log decoding
+//
+
+// Sequential reader over the mapped file. Any overrun sets 'failed'
+//
+struct binreader {
+  const char* p;
+  const char* end;
+  bool        failed;
+  //
+  binreader(const char* p, const char* end) : p(p), end(end), failed(false) {}
+  //
+  bool more() {
+    return not failed and p < end;
+  }
+  unsigned long long varint() {
+    unsigned long long v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p >= end)
+        break;
+      unsigned char c = *p++;
+      v |= (unsigned long long) (c & 0x7f) << shift;
+      if (not (c & 0x80))
+        return v;
+    }
+    failed = true;
+    return 0;
+  }
+  const char* bytes(size_t n) {
+    if ((size_t) (end - p) < n) {
+      failed = true;
+      return nullptr;
+    }
+    const char* s = p;
+    p += n;
+    return s;
+  }
+  string str() {
+    size_t n = varint();
+    const char* s = bytes(n);
+    return s ? string(s, n) : string();
+  }
+};
+
+// A decoded argument
+//
+struct binvalue {
+  char          type;      // LogArg tag
+  long long     i;         // integers and pointers
+  double        d;         // floating point
+  std::string   s;         // strings
+};
+
+struct binformat {
+  std::string   format;
+  std::string   argtypes;
+};
+
+static bool read_values(binreader& in, const string& types,
+                        vector<binvalue>& values) {
+  //
+  values.resize(types.size());
+
+  for (size_t k = 0; k < types.size(); k++) {
+    binvalue& v = values[k];
+
+    v.type = types[k];
+    v.i    = 0;
+    v.d    = 0;
+    v.s.clear();
+
+    switch (v.type) {
+      case 'b': case 'h': case 'i': case 'l':
+                v.i = unzigzag(in.varint());
+                break;
+      case 'B': case 'H': case 'I': case 'L': case 'p':
+                v.i = (long long) in.varint();
+                break;
+      case 'f': {
+                  float f = 0;
+                  const char* b = in.bytes(sizeof(f));
+                  if (b)
+                    memcpy(&f, b, sizeof(f));
+                  v.d = f;
+                }
+                break;
+      case 'd': case 'D': {
+                  const char* b = in.bytes(sizeof(v.d));
+                  if (b)
+                    memcpy(&v.d, b, sizeof(v.d));
+                }
+                break;
+      case 's':
+                v.s = in.str();
+                break;
+      default:
+                return false;
+    }
+  }
+
+  return not in.failed;
+}
+
+static void append_printf(LogBuffer& out, const char* spec, ...) {
+  // snprintf() to the end of 'out', growing it as needed
+  //
+  va_list vl, vl2;
+  size_t room = 256;
+
+  va_start(vl, spec);
+  va_copy(vl2, vl);
+
+  int n = vsnprintf(out.tail(room), room, spec, vl);
+  if (n >= (int) room)
+    n = vsnprintf(out.tail(n + 1), n + 1, spec, vl2);
+  if (n > 0)
+    out.commit(n);
+
+  va_end(vl2);
+  va_end(vl);
+}
+
+static long long signed_as(long long v, const string& length) {
+  // integer conversion as done by printf() for the length modifier
+  //
+  if (length == "hh")
+    return (signed char) v;
+  if (length == "h")
+    return (short) v;
+  if (length == "l")
+    return (long) v;
+  if (length == "ll" or length == "q" or length == "j")
+    return v;
+  if (length == "z")
+    return (ssize_t) v;
+  if (length == "t")
+    return (ptrdiff_t) v;
+  return (int) v;
+}
+
+static unsigned long long unsigned_as(long long v, const string& length) {
+  //
+  if (length == "hh")
+    return (unsigned char) v;
+  if (length == "h")
+    return (unsigned short) v;
+  if (length == "l")
+    return (unsigned long) v;
+  if (length == "ll" or length == "q" or length == "j")
+    return v;
+  if (length == "z")
+    return (size_t) v;
+  if (length == "t")
+    return (size_t) (ptrdiff_t) v;
+  return (unsigned int) v;
+}
+
+static void render_values(LogBuffer& out, const string& format,
+                          const vector<binvalue>& values) {
+  // printf() one conversion at a time. Values are converted to the type
+  // the conversion expects. Conversions without a value are copied as is
+  //
+  size_t i      = 0;
+  size_t nvalue = 0;
+  size_t n      = format.size();
+
+  while (i < n) {
+    size_t pct = format.find('%', i);
+    if (pct == string::npos) {
+      out.append(format.data() + i, n - i);
+      break;
+    }
+    out.append(format.data() + i, pct - i);
+
+    if (pct + 1 < n and format[pct + 1] == '%') {
+      out.append('%');
+      i = pct + 2;
+      continue;
+    }
+
+    // flags, width, precision and length
+    //
+    string spec("%");
+    string length;
+    size_t j = pct + 1;
+    bool novalue = false;
+
+    while (j < n and strchr("-+ #0'", format[j]))
+      spec += format[j++];
+    for (int part = 0; part < 2; part++) {
+      if (part == 1) {
+        if (j >= n or format[j] != '.')
+          break;
+        spec += format[j++];
+      }
+      if (j < n and format[j] == '*') {
+        j++;
+        if (nvalue < values.size())
+          spec += to_string(signed_as(values[nvalue++].i, length));
+        else
+          novalue = true;
+      }
+      else
+        while (j < n and format[j] >= '0' and format[j] <= '9')
+          spec += format[j++];
+    }
+    while (j < n and strchr("hlLqjzt", format[j]))
+      length += format[j++];
+
+    if (j >= n) {
+      out.append(format.data() + pct, n - pct);
+      break;
+    }
+
+    char conv = format[j++];
+    i = j;
+
+    if (novalue or nvalue >= values.size() or
+        not strchr("diouxXcseEfFgGaApn", conv)) {
+      out.append(format.data() + pct, j - pct);
+      continue;
+    }
+
+    const binvalue& v = values[nvalue++];
+    long long iv = (v.type == 'f' or v.type == 'd' or v.type == 'D') ?
+                                                    (long long) v.d : v.i;
+    double    dv = (v.type == 'f' or v.type == 'd' or v.type == 'D') ?
+                                                    v.d : (double) v.i;
+
+    switch (conv) {
+      case 'd': case 'i':
+                append_printf(out, (spec + "ll" + conv).c_str(),
+                              signed_as(iv, length));
+                break;
+      case 'o': case 'u': case 'x': case 'X':
+                append_printf(out, (spec + "ll" + conv).c_str(),
+                              unsigned_as(iv, length));
+                break;
+      case 'c':
+                append_printf(out, (spec + conv).c_str(), (int) iv);
+                break;
+      case 's':
+                append_printf(out, (spec + conv).c_str(),
+                              v.type == 's' ? v.s.c_str() : "?");
+                break;
+      case 'p':
+                append_printf(out, (spec + conv).c_str(),
+                              (void*) (uintptr_t) iv);
+                break;
+      case 'n':
+                break;
+      default:
+                if (length == "L")
+                  append_printf(out, (spec + 'L' + conv).c_str(),
+                                (long double) dv);
+                else
+                  append_printf(out, (spec + conv).c_str(), dv);
+                break;
+    }
+  }
+}
+
+static bool write_all(int fd, const char* data, size_t length) {
+  //
+  while (length > 0) {
+    ssize_t n = write(fd, data, length);
+    if (n < 0 and errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data   += n;
+    length -= n;
+  }
+
+  return true;
+}
+
+int BinaryHandler::decode(const string& fname, int outfd,
+                          const string& recfmt, const string& timefmt) {
+  // Render every record in a binary log file with the given formats
+  // Return 0 on success
+  //
+  int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 1;
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 and st.st_size > 0)
+    p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return 1;
+
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+  Formatter  view      = Formatter::get_formatter(recfmt, timefmt);
+  Formatter* formatter = view.fmtptr.get();
+
+  vector<string>    names;
+  vector<binformat> formats;
+  vector<binvalue>  values;
+  Formatter::recorigin origin = { 0, false, 0, 0 };
+  long long         sec    = 0;
+  bool              session = false;
+  int               rc     = 0;
+
+  LogBuffer out;
+  LogBuffer msg;
+  binreader in((const char*) p, (const char*) p + st.st_size);
+
+  while (rc == 0 and in.more()) {
+    int tag = (unsigned char) *in.bytes(1);
+
+    if (not session and tag != BIN_SESSION) {
+      rc = 1;
+      break;
+    }
+
+    switch (tag) {
+      case BIN_SESSION: {
+                 const char* magic = in.bytes(strlen(BINARY_MAGIC));
+                 if (not magic or
+                     memcmp(magic, BINARY_MAGIC, strlen(BINARY_MAGIC))) {
+                   rc = 1;
+                   break;
+                 }
+                 origin.pid  = in.varint();
+                 origin.ppid = in.varint();
+                 // ids start at 1, each new one next to the last
+                 names.assign(1, string());
+                 formats.assign(1, binformat());
+                 sec     = 0;
+                 session = true;
+               }
+               break;
+      case BIN_NAME: {
+                 size_t id = in.varint();
+                 if (id > names.size()) {
+                   rc = 1;
+                   break;
+                 }
+                 if (id == names.size())
+                   names.push_back(string());
+                 names[id] = in.str();
+               }
+               break;
+      case BIN_FORMAT: {
+                 size_t id = in.varint();
+                 if (id > formats.size()) {
+                   rc = 1;
+                   break;
+                 }
+                 if (id == formats.size())
+                   formats.push_back(binformat());
+                 formats[id].format   = in.str();
+                 formats[id].argtypes = in.str();
+               }
+               break;
+      case BIN_TEXT:
+      case BIN_CAPTURED: {
+                 LogRecord rec;
+
+                 sec += unzigzag(in.varint());
+                 rec.stamp.tv_sec  = sec;
+                 rec.stamp.tv_nsec = in.varint();
+                 unsigned long long level = in.varint();
+                 rec.level         = level >> 1;
+                 origin.mainthread = level & 1;
+                 size_t nameid     = in.varint();
+                 origin.tid        = in.varint();
+
+                 msg.clear();
+                 if (tag == BIN_TEXT) {
+                   size_t n = in.varint();
+                   const char* s = in.bytes(n);
+                   if (s)
+                     msg.append(s, n);
+                 }
+                 else {
+                   size_t fmtid = in.varint();
+                   if (fmtid == 0 or fmtid >= formats.size() or
+                       not read_values(in, formats[fmtid].argtypes, values)) {
+                     rc = 1;
+                     break;
+                   }
+                   render_values(msg, formats[fmtid].format, values);
+                 }
+                 rec.message = msg.data();
+                 rec.msglen  = msg.size();
+
+                 static const string noname;
+                 formatter->format_record(out, rec,
+                       nameid < names.size() ? names[nameid] : noname, &origin);
+                 if (formatter->eol)
+                   out.append('\n');
+               }
+               break;
+      default:
+               rc = 1;
+               break;
+    }
+
+    if (in.failed)
+      rc = 1;
+
+    if (out.size() >= 65536 or rc or not in.more()) {
+      if (not write_all(outfd, out.data(), out.size()))
+        rc = 1;
+      out.clear();
+    }
+  }
+
+  munmap(p, st.st_size);
+
+  return rc;
+}
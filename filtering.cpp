@@ -0,0 +1,405 @@
+#include <time.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Sampling, rate limiting and duplicate suppression
+//
+// Sampling is checked right after the level and applies to the records
+// created by the logger itself. It keeps a fraction of the records at or
+// below the sampling level, either at random, from a per-thread generator,
+// or one out of every N, from a per-thread counter: each thread keeps one
+// out of every N records it creates, with no shared write
+//
+// A filter applies to the records created by its logger and by the
+// descendants that have none of their own, up to the first logger that
+// does not propagate. Records discarded by a filter are counted as
+// suppressed and reported by notices: "N records suppressed by rate limit"
+// ahead of the next record admitted, "last message repeated N times" when
+// a run of repeats ends or has lasted 'interval' ms
+//
+// Filters are created on first use and live as long as their logger, so
+// that they can be used once logging::logmutex has been released
+//
+
+LogFilter::LogFilter() : limiting(false),
+                         rate(0),
+                         burst(0),
+                         total(),
+                         siterate(0),
+                         siteburst(0),
+                         limited(0),
+                         suppress(false),
+                         interval(DEFAULT_REPEAT_INTERVAL),
+                         lastlevel(NOTSET),
+                         lastformat(nullptr),
+                         repeats(0),
+                         runstart(0)             {}
+
+double LogFilter::now() {
+  // a coarse clock is good enough for the buckets and much cheaper
+  //
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool LogFilter::take(bucket& b, double rate, double burst, double stamp) {
+  // refill the bucket for the time elapsed and take a token from it
+  //
+  b.tokens = min(burst, b.tokens + (stamp - b.stamp) * rate);
+  b.stamp  = stamp;
+
+  if (b.tokens < 1)
+    return false;
+  b.tokens -= 1;
+
+  return true;
+}
+
+double LogFilter::set_rate(double newrate, double newburst) {
+  //
+  lock_guard<mutex> lock(fmutex);
+
+  double currate = rate;
+  rate  = max(newrate, 0.0);
+  burst = newburst > 0 ? newburst : max(rate, 1.0);
+  total.tokens = burst;
+  total.stamp  = now();
+  limiting.store(rate > 0 or siterate > 0, memory_order_relaxed);
+
+  return currate;
+}
+
+double LogFilter::set_site_rate(double newrate, double newburst) {
+  //
+  lock_guard<mutex> lock(fmutex);
+
+  double currate = siterate;
+  siterate  = max(newrate, 0.0);
+  siteburst = newburst > 0 ? newburst : max(siterate, 1.0);
+  sites.clear();
+  limiting.store(rate > 0 or siterate > 0, memory_order_relaxed);
+
+  return currate;
+}
+
+bool LogFilter::set_suppression(bool mode, int newinterval,
+                                unsigned long& pending, int& level) {
+  // Pending repetitions are handed back to be summarized
+  //
+  lock_guard<mutex> lock(fmutex);
+
+  bool curmode = suppress.load(memory_order_relaxed);
+  suppress.store(mode, memory_order_relaxed);
+  interval = max(newinterval, 0);
+
+  pending = repeats;
+  level   = lastlevel;
+  repeats = 0;
+  lastformat = nullptr;
+
+  return curmode;
+}
+
+bool LogFilter::admit(const char* format, unsigned long& discarded) {
+  //
+  discarded = 0;
+
+  // filters with duplicate suppression only take no lock here
+  //
+  if (not limiting.load(memory_order_relaxed))
+    return true;
+
+  lock_guard<mutex> lock(fmutex);
+
+  if (rate == 0 and siterate == 0)
+    return true;
+
+  double stamp = now();
+  bool   pass  = true;
+
+  if (siterate > 0) {
+    unordered_map<const char*, bucket>::iterator it = sites.find(format);
+    if (it == sites.end()) {
+      // bounded table. Start over rather than track every call site
+      //
+      if (sites.size() >= MAX_RATE_SITES)
+        sites.clear();
+      bucket fresh = { siteburst, stamp };
+      it = sites.insert(make_pair(format, fresh)).first;
+    }
+    pass = take(it->second, siterate, siteburst, stamp);
+  }
+  if (pass and rate > 0)
+    pass = take(total, rate, burst, stamp);
+
+  if (not pass) {
+    ++limited;
+    return false;
+  }
+  discarded = limited;
+  limited   = 0;
+
+  return true;
+}
+
+void LogFilter::atfork(int stage) {
+  // The child finds the filter as the forking thread left it
+  //
+  if (stage == FORK_PREPARE)
+    fmutex.lock();
+  else
+    fmutex.unlock();
+}
+
+bool LogFilter::unique(int level, const char* format, const char* data,
+                       size_t length, unsigned long& pending, int& replevel) {
+  //
+  pending = 0;
+
+  // nor those with rate limits only here
+  //
+  if (not suppress.load(memory_order_relaxed))
+    return true;
+
+  lock_guard<mutex> lock(fmutex);
+
+  if (not suppress.load(memory_order_relaxed))
+    return true;
+
+  if (level == lastlevel and format == lastformat and
+      length == lastdata.size() and
+      memcmp(data, lastdata.data(), length) == 0) {
+    // one more repetition. Report long runs now and then
+    //
+    double stamp = now();
+    if (repeats++ == 0)
+      runstart = stamp;
+    if (interval > 0 and (stamp - runstart) * 1000 >= interval) {
+      pending  = repeats;
+      replevel = lastlevel;
+      repeats  = 0;
+    }
+    return false;
+  }
+
+  // a different record ends the run. Storage is kept across records
+  //
+  pending    = repeats;
+  replevel   = lastlevel;
+  repeats    = 0;
+  lastlevel  = level;
+  lastformat = format;
+  lastdata.assign(data, length);
+
+  return true;
+}
+
+///////////////  LoggerTree filtering (internal)
+//
+static unsigned long long sample_random() {
+  // xorshift64*, one generator per thread. 32 random bits
+  //
+  static thread_local unsigned long long state =
+        (hash<thread::id>()(this_thread::get_id()) ^
+         logging::stats_clock()) | 1;
+
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+
+  return (state * 2685821657736338717ULL) >> 32;
+}
+
+bool LoggerTree::sample() {
+  // The level is being sampled. Return false to discard the record
+  //
+  unsigned long every = sampleevery.load(memory_order_relaxed);
+  bool keep;
+
+  if (every > 0)
+    keep = ThreadStats::get().count_sample(statslot) % every == 0;
+  else
+    keep = sample_random() < samplethreshold.load(memory_order_relaxed);
+
+  if (not keep)
+    ThreadStats::get().add(STAT_SAMPLED, statslot, 1);
+
+  return keep;
+}
+
+LogFilter* LoggerTree::get_filter() {
+  // Filter in charge of the records created here, if any
+  // Takes logmutex shared only when some logger has a filter
+  //
+  if (logging::filters.load(memory_order_acquire) == 0)
+    return nullptr;
+
+  SharedLock lock(logging::logmutex);
+
+  for (LoggerTree* node = this; node; node = node->parent.get()) {
+    if (node->filter)
+      return node->filter;
+    if (not node->propagate)
+      break;
+  }
+
+  return nullptr;
+}
+
+LogFilter* LoggerTree::make_filter() {
+  // Filter of this logger, created on first use
+  // Caller must hold logging::logmutex exclusive
+  //
+  if (not filter) {
+    filter = new LogFilter;
+    logging::filters.fetch_add(1, memory_order_release);
+  }
+
+  return filter;
+}
+
+bool LoggerTree::rate_limited(LogFilter* filter, int level,
+                              const char* format) {
+  // Return true if the record must be discarded
+  //
+  unsigned long discarded;
+
+  if (not filter->admit(format, discarded)) {
+    count_suppressed();
+    return true;
+  }
+  if (discarded > 0)
+    notice(level, "%lu records suppressed by rate limit", discarded);
+
+  return false;
+}
+
+bool LoggerTree::repeated(LogFilter* filter, int level, const char* format,
+                          const char* data, size_t length) {
+  // Return true if the record must be discarded
+  //
+  unsigned long pending;
+  int           replevel;
+
+  bool keep = filter->unique(level, format, data, length, pending, replevel);
+
+  if (pending > 0)
+    notice(replevel, "last message repeated %lu times", pending);
+  if (not keep)
+    count_suppressed();
+
+  return not keep;
+}
+
+void LoggerTree::notice(int level, const char* format, ...) {
+  // A record generated by the library, delivered like any other
+  //
+  char text[128];
+  va_list vl;
+
+  va_start(vl, format);
+  int n = vsnprintf(text, sizeof(text), format, vl);
+  va_end(vl);
+
+  LogRecord record(level);
+  record.message = text;
+  record.msglen  = min((size_t) max(n, 0), sizeof(text) - 1);
+  record.format  = format;
+
+  dispatch(record);
+}
+
+void LoggerTree::count_suppressed() {
+  //
+  ThreadStats::get().add(STAT_SUPPRESSED, statslot, 1);
+}
+
+///////////////  Logger filter settings
+//
+// Keep a fraction 'rate' (0 to 1) of the records at or below 'level'.
+// SAMPLE_RANDOM keeps each one with that probability, SAMPLE_EVERY one
+// out of every 1/rate. NOTSET, or a rate of 1, turns sampling off
+// Return the previous sampling level
+//
+int Logger::set_sampling(int level, double rate, int mode) {
+  //
+  lock_guard<RWMutex> lock(logging::logmutex);
+
+  logref_t tree = *treeptr;
+  int curlevel = tree.samplelevel.load(memory_order_relaxed);
+
+  rate = min(max(rate, 0.0), 1.0);
+  if (rate == 1)
+    level = NOTSET;
+
+  // disable while the parameters change
+  //
+  tree.samplelevel.store(NOTSET, memory_order_relaxed);
+  tree.samplethreshold.store((unsigned long long) (rate * 4294967296.0),
+                             memory_order_relaxed);
+  tree.sampleevery.store(mode == SAMPLE_EVERY and rate > 0 ?
+                         (unsigned long) (1 / rate + 0.5) : 0,
+                         memory_order_relaxed);
+  tree.samplelevel.store(min(max(level, (int) NOTSET), (int) MAXLOG),
+                         memory_order_release);
+
+  return curlevel;
+}
+
+// Set a limit of 'rate' records per second for this logger, with bursts
+// of up to 'burst' records (default: one second worth). Zero removes the
+// limit. Return the previous rate
+//
+double Logger::set_rate_limit(double rate, double burst) {
+  //
+  lock_guard<RWMutex> lock(logging::logmutex);
+
+  return treeptr->make_filter()->set_rate(rate, burst);
+}
+
+// Same limit, applied to each call site (format string) separately
+//
+double Logger::set_site_rate_limit(double rate, double burst) {
+  //
+  lock_guard<RWMutex> lock(logging::logmutex);
+
+  return treeptr->make_filter()->set_site_rate(rate, burst);
+}
+
+// Collapse runs of identical records. Long runs are summarized every
+// 'interval' ms (zero: only when they end). Return the previous mode
+//
+bool Logger::set_suppression(bool mode, int interval) {
+  //
+  unsigned long pending;
+  int           level;
+  bool          curmode;
+
+  {
+    lock_guard<RWMutex> lock(logging::logmutex);
+
+    curmode = treeptr->make_filter()->set_suppression(mode, interval,
+                                                      pending, level);
+  }
+  // delivery takes logmutex again
+  //
+  if (pending > 0)
+    treeptr->notice(level, "last message repeated %lu times", pending);
+
+  return curmode;
+}
@@ -5,16 +5,33 @@
 #include <thread>
 #include <ctime>
 #include <cstdarg>
+#include <atomic>
+#include <new>
+#include <algorithm>
 
 #include "logging.h"
 
 using namespace std;
 
-Formatter::Formatter(const string& recfmt, const string& timefmt, bool eol) :
+// Time format identifiers. Every time format set gets a new one, so that
+// cached timestamps are never reused across formats. Zero is never issued
+//
+static unsigned long next_timeid() {
+  static atomic<unsigned long> timeids(0);
+
+  return ++timeids;
+}
+
+Formatter::Formatter(const string& recfmt, const string& timefmt, bool eol,
+                     int mode) :
                          recordformat(recfmt),
                          timeformat(timefmt),
                          eol(eol),
-                         fmtptr(nullptr) {}
+                         mode(mode),
+                         fmtptr(nullptr),
+                         timeid(next_timeid()) {
+  compile_recfmt();
+}
 
 Formatter::~Formatter() {}
 
@@ -22,12 +39,12 @@ Formatter::~Formatter() {}
 //
 Formatter Formatter::get_formatter(const string& recfmt,
                                    const string& timefmt,
-                                   bool eol) {
+                                   bool eol, int mode) {
   // Formatters are anonymous abjects
   //
   Formatter fmt;
   //
-  fmtptr_t formatter(new Formatter(recfmt, timefmt, eol));
+  fmtptr_t formatter(new Formatter(recfmt, timefmt, eol, mode));
 
   fmt = *(formatter.get());
   fmt.fmtptr = formatter;
@@ -38,7 +55,7 @@ Formatter Formatter::get_formatter(const string& recfmt,
 string Formatter::get_timefmt() {
   // get the time format for this logger (safe)
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  SharedLock lock(logging::logmutex);
 
   return timeformat;
 }
@@ -46,15 +63,16 @@ string Formatter::get_timefmt() {
 void Formatter::set_timefmt(const string& timefmt) {
   // set the time format for this logger (safe)
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
 
   timeformat = string(timefmt);
+  timeid     = next_timeid();
 }
   
 string Formatter::get_recfmt() {
   // get the time format for ths logger (safe)
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  SharedLock lock(logging::logmutex);
 
   return recordformat;
 }
@@ -62,22 +80,203 @@ string Formatter::get_recfmt() {
 void Formatter::set_recfmt(const string& recfmt) {
   // set the time format for ths logger (safe)
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
 
   recordformat = string(recfmt);
+  compile_recfmt();
 }
   
 void Formatter::set_eol(const bool new_eol) {
   // end of line setting (safe)
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
 
   eol = new_eol;
 }
+
+int Formatter::get_mode() {
+  // output mode (safe)
+  //
+  SharedLock lock(logging::logmutex);
+
+  return mode;
+}
+
+void Formatter::set_mode(int new_mode) {
+  // output mode: FORMAT_TEXT, FORMAT_JSON or FORMAT_LOGFMT (safe)
+  //
+  lock_guard<RWMutex> lock(logging::logmutex);
+
+  mode = new_mode;
+}
   
+///////////// Record format compilation
+//
+// The record format is parsed once, when set, into a list of operations
+// format_record() then just runs the list for every record
+//
+void Formatter::add_op(fmtop_t op, size_t offset, size_t length) {
+  // append an operation. Adjacent literal spans are merged
+  //
+  if (op == FMT_LITERAL and not program.empty()) {
+    fmtop& last = program.back();
+    if (last.op == FMT_LITERAL and last.offset + last.length == offset) {
+      last.length += length;
+      return;
+    }
+  }
+
+  fmtop newop = { op, offset, length };
+  program.push_back(newop);
+}
+
+void Formatter::compile_recfmt() {
+  //
+  program.clear();
+
+  size_t i = 0;
+  while(i < recordformat.size()) {
+    char c = recordformat[i++];
+
+    if (i >= recordformat.size() or c != '%') {
+      add_op(FMT_LITERAL, i-1, 1);
+      continue;
+    }
+
+    c = recordformat[i++];
+
+    switch(c) {
+      case 't':
+      case 'T':  add_op(FMT_TIME);
+                 break;
+      case 'f':  add_op(FMT_MSEC);
+                 break;
+      case 'u':  add_op(FMT_USEC);
+                 break;
+      case 'F':  add_op(FMT_NSEC);
+                 break;
+      case 'N':  add_op(FMT_NAME_COLON);
+                 break;
+      case 'n':  add_op(FMT_NAME);
+                 break;
+      case 'I':  add_op(FMT_TID_NOTMAIN);
+                 break;
+      case 'i':  add_op(FMT_TID);
+                 break;
+      case 'q':  add_op(FMT_THREAD_NAME);
+                 break;
+      case 'X':  {
+                   // %X{key} renders one context field, %X all of them
+                   //
+                   size_t close = recordformat.find('}', i);
+                   if (i < recordformat.size() and recordformat[i] == '{' and
+                       close != string::npos) {
+                     add_op(FMT_CONTEXT, i + 1, close - i - 1);
+                     i = close + 1;
+                   }
+                   else
+                     add_op(FMT_CONTEXT_ALL);
+                 }
+                 break;
+      case 'P':  add_op(FMT_PPID);
+                 break;
+      case 'p':  add_op(FMT_PID);
+                 break;
+      case 'L':  add_op(FMT_LEVEL_UPPER);
+                 break;
+      case 'l':  add_op(FMT_LEVEL);
+                 break;
+      case 'M':
+      case 'm':  add_op(FMT_MESSAGE);
+                 break;
+      case '%':  add_op(FMT_LITERAL, i-1, 1);        // single '%'
+                 break;                 
+      default:   add_op(FMT_LITERAL, i-2, 2);        // unknown. Verbatim
+                 break;
+    }
+  }
+}
+
+///////////// LogBuffer
+//
+// Growable byte buffer. Storage is kept across clear() calls so that a
+// buffer reused for every record stops allocating once warmed up
+//
+LogBuffer::LogBuffer(size_t capacity) : buf(nullptr), len(0), cap(0) {
+  reserve(capacity);
+}
+
+LogBuffer::~LogBuffer() {
+  free(buf);
+}
+
+void LogBuffer::reserve(size_t n) {
+  // grow storage to at least n bytes. Contents are preserved
+  //
+  if (n <= cap)
+    return;
+
+  size_t newcap = max(n, 2 * cap);
+  char* newbuf  = (char*) realloc(buf, newcap);
+  if (not newbuf)
+    throw bad_alloc();
+
+  buf = newbuf;
+  cap = newcap;
+}
+
+void LogBuffer::trim(size_t limit) {
+  // empty the buffer. Storage grown past 'limit' by a large record is
+  // given back, so that thread buffers do not keep it for good
+  //
+  len = 0;
+  if (cap <= limit)
+    return;
+
+  char* newbuf = (char*) realloc(buf, LOGBUFFER_CAPACITY);
+  if (newbuf) {
+    buf = newbuf;
+    cap = LOGBUFFER_CAPACITY;
+  }
+}
+
+char* LogBuffer::tail(size_t room) {
+  // make room for 'room' more bytes and return the write position
+  // use commit() to account for the bytes actually written
+  //
+  reserve(len + room);
+
+  return buf + len;
+}
+
+void LogBuffer::append(const char* s, size_t n) {
+  //
+  reserve(len + n);
+  memcpy(buf + len, s, n);
+  len += n;
+}
+
+void LogBuffer::append(const char* s) {
+  //
+  append(s, strlen(s));
+}
+
+void LogBuffer::append(const string& s) {
+  //
+  append(s.data(), s.size());
+}
+
+void LogBuffer::append(char c) {
+  //
+  reserve(len + 1);
+  buf[len++] = c;
+}
+
 // Log record formatting functions
 //
-string Formatter::level_to_string(int level, bool uppercase) {
+// These append to a caller supplied buffer and never build temporaries
+//
+const char* Formatter::level_to_string(int level, bool uppercase) {
   switch (level) {
     case NOTSET:   return uppercase ? "UNSET"    : "unset";
     case DEBUG:    return uppercase ? "DEBUG"    : "debug";
@@ -89,145 +288,308 @@ string Formatter::level_to_string(int level, bool uppercase) {
   }
 }
 
-string Formatter::format_tid() {
-  // Thread id formatting
+// Thread and process ids are rendered once. Thread ids for the last few
+// threads seen by each formatting thread, since the writer thread of
+// asynchronous mode formats records from many. Process ids for the whole
+// process, and again in the child after fork()
+//
+struct processids {
+  char    pid[24];
+  size_t  pidlen;
+  char    ppid[24];
+  size_t  ppidlen;
+};
+
+static processids procids;
+
+static void render_process_ids() {
+  // also in the fork() child, single threaded, before its asynchronous
+  // writer starts
   //
-  char tids[64];
-  tids[0] = '\0';
+  procids.pidlen  = max(snprintf(procids.pid, sizeof(procids.pid), "%i",
+                                 getpid()), 0);
+  procids.ppidlen = max(snprintf(procids.ppid, sizeof(procids.ppid), "%i",
+                                 getppid()), 0);
+}
+
+static const processids& process_ids() {
+  // rendered on first use
   //
-  snprintf(tids, sizeof(tids), "%x",
-         (unsigned int) hash<thread::id>()(this_thread::get_id()));
+  static bool ready = [] {
+    render_process_ids();
+    return true;
+  }();
+  (void) ready;
 
-  return string(tids);
+  return procids;
 }
 
-string Formatter::format_pid() {
-  // pid formatting
+void Formatter::atfork(int stage) {
   //
-  char pids[64];
-  pids[0] = '\0';
+  if (stage == FORK_CHILD)
+    render_process_ids();
+}
+
+static size_t render_hex(char* text, unsigned int value) {
+  // lowercase hex digits, no leading zeroes. Return the length
+  //
+  static const char hex[] = "0123456789abcdef";
+
+  char  digits[8];
+  char* p = digits + sizeof(digits);
+
+  do {
+    *--p = hex[value & 0xf];
+    value >>= 4;
+  } while (value);
 
-  snprintf(pids, sizeof(pids), "%i", getpid());
+  size_t n = digits + sizeof(digits) - p;
+  memcpy(text, p, n);
 
-  return string(pids);
+  return n;
 }
 
-string Formatter::format_ppid() {
-  // Parent pid formatting
+void Formatter::format_tid(LogBuffer& out, thread::id tid) {
+  // Thread id formatting. The hash value, in hex
   //
-  char ppids[64];
-  ppids[0] = '\0';
+  struct tidcache {
+    thread::id    tid;           // default id: unused entry
+    size_t        length;
+    char          text[8];
+  };
+  static thread_local tidcache cache[TIDCACHE_SIZE];
+  static thread_local size_t   next;
+
+  for (const tidcache& entry : cache)
+    if (entry.tid == tid) {
+      out.append(entry.text, entry.length);
+      return;
+    }
+
+  tidcache& entry = cache[next++ % TIDCACHE_SIZE];
+  entry.tid    = tid;
+  entry.length = render_hex(entry.text,
+                            (unsigned int) hash<thread::id>()(tid));
+
+  out.append(entry.text, entry.length);
+}
 
-  snprintf(ppids, sizeof(ppids), "%i", getppid());
+void Formatter::format_tid(LogBuffer& out, unsigned int tid) {
+  //
+  char tids[8];
 
-  return string(ppids);
+  out.append(tids, render_hex(tids, tid));
 }
 
-string Formatter::format_time() {
-  //   Get current timestamp
+void Formatter::format_pid(LogBuffer& out) {
+  // pid formatting
   //
-  char timestamp[64];
-  time_t now = time(0);
+  const processids& ids = process_ids();
+
+  out.append(ids.pid, ids.pidlen);
+}
 
-  if (strftime(timestamp, sizeof(timestamp),
-               timeformat.c_str(), localtime(&now)) == 0)
-    strncpy(timestamp, "time fmt error", sizeof(timestamp));
+void Formatter::format_ppid(LogBuffer& out) {
+  // Parent pid formatting
+  //
+  const processids& ids = process_ids();
 
-  return string(timestamp);
+  out.append(ids.ppid, ids.ppidlen);
 }
 
-string Formatter::format_message(const char* msgfmt, va_list vl) {
-  // Message formatting
-  // note that long messages get truncated to 1023 one-byte characters
-  // (less if UTF-8 multi-byte characters are present)
+void Formatter::format_time(LogBuffer& out, const struct timespec& stamp) {
+  //   Render the record timestamp
   //
-  char msg[1024];
-  if (vsnprintf(msg, sizeof(msg), msgfmt, vl) < 0)
-    snprintf(msg, sizeof(msg), "logging error: %s", strerror(errno));
+  // strftime() output only changes once a second. Keep the last rendering
+  // per thread for a few formatters and reuse it within the same second
+  //
+  struct timecache {
+    unsigned long   timeid;        // format the text was rendered with
+    time_t          seconds;       // time the text was rendered for
+    size_t          length;
+    char            text[64];
+  };
+  static thread_local timecache cache[TIMECACHE_SIZE];
+
+  timecache& entry = cache[timeid % TIMECACHE_SIZE];
+
+  if (entry.timeid != timeid or entry.seconds != stamp.tv_sec) {
+    struct tm tmstamp;
+
+    entry.length = strftime(entry.text, sizeof(entry.text), timeformat.c_str(),
+                            localtime_r(&stamp.tv_sec, &tmstamp));
+    if (entry.length == 0)
+      entry.length = strlen(strncpy(entry.text, "time fmt error",
+                                    sizeof(entry.text)));
+    entry.timeid  = timeid;
+    entry.seconds = stamp.tv_sec;
+  }
 
-  return string(msg);
+  out.append(entry.text, entry.length);
 }
 
-string Formatter::format_record(string& message, string& name, int level) {
+void Formatter::format_fraction(LogBuffer& out,
+                                const struct timespec& stamp, int digits) {
+  // Sub-second part of the timestamp, zero padded to 'digits' (3, 6 or 9)
   //
-  string record;
-  string timestamp;
-  timestamp = format_time();
+  unsigned long value = stamp.tv_nsec;
+  for (int i = digits; i < 9; i++)
+    value /= 10;
+
+  char* p = out.tail(digits);
+  for (int i = digits - 1; i >= 0; i--) {
+    p[i]   = '0' + value % 10;
+    value /= 10;
+  }
+  out.commit(digits);
+}
 
-  // the final record formatting
+void Formatter::format_message(LogBuffer& out,
+                               const char* msgfmt, va_list vl) {
+  // Message formatting, in two passes at most. The spare room of the
+  // buffer, which fits common messages, is tried first. Longer messages
+  // are formatted again once the buffer has grown to their size
+  // Messages are cut at MAX_MESSAGE_LENGTH bytes
   //
-  auto s_append = [](string& r, const string& s, size_t max) {
-                                if (r.size() > max)
-                                  r.resize(max);
-                                else if (r.size() < max)
-                                  r += s.substr(0, max - r.size()); };
-  auto c_append = [](string& r, const char c) { if (r.size() < 4)
-                                                  r += c; };
-  string pending;
+  va_list again;
+  va_copy(again, vl);
+
+  size_t room = max(out.capacity() - out.size(), (size_t) 256);
+  char*  msg  = out.tail(room);
+  int n = vsnprintf(msg, room, msgfmt, vl);
+  if (n < 0)
+    n = snprintf(msg, room, "logging error: %s", strerror(errno));
+
+  if ((size_t) max(n, 0) < room)
+    out.commit(max(n, 0));
+  else {
+    size_t length = min((size_t) n, (size_t) MAX_MESSAGE_LENGTH);
+
+    msg = out.tail(length + 1);
+    vsnprintf(msg, length + 1, msgfmt, again);
+    out.commit(length);
+    if (length < (size_t) n)
+      out.append(TRUNCATION_MARKER);
+  }
 
-  size_t i = 0;
-  while(i < recordformat.size()) {
-    char c = recordformat[i++];
-    c_append(pending, c);
+  va_end(again);
+}
 
-    if (i >= recordformat.size() or c != '%') {
-      s_append(record, pending, MAX_RECORD_LENGTH);
-      pending.clear();
-      continue;
-    }
+void LogCapture::format(LogBuffer& out, const char* format, ...) {
+  // final step of deferred rendering
+  //
+  va_list vl;
 
-    c = recordformat[i++];
-    c_append(pending, c);
+  va_start(vl, format);
+  Formatter::format_message(out, format, vl);
+  va_end(vl);
+}
 
-    bool append_colon = false;
-    bool uppercase    = false;
+void Formatter::format_record(LogBuffer& out,
+                              const LogRecord& rec, const string& name,
+                              const recorigin* origin) {
+  // Append the final record to 'out' running the compiled record format
+  // 'origin', if given, replaces the thread and process ids of the caller
+  //
+  if (mode == FORMAT_JSON or mode == FORMAT_LOGFMT) {
+    format_structured(out, rec, name, origin);
+    return;
+  }
 
-    switch(c) {
-      case 't':
-      case 'T':
-                 s_append(record, timestamp, MAX_RECORD_LENGTH);
+  char ids[32];
+
+  for (const fmtop& op : program) {
+    switch(op.op) {
+      case FMT_LITERAL:
+                 out.append(recordformat.data() + op.offset, op.length);
+                 break;
+      case FMT_TIME:
+                 format_time(out, rec.stamp);
+                 break;
+      case FMT_MSEC:
+                 format_fraction(out, rec.stamp, 3);
+                 break;
+      case FMT_USEC:
+                 format_fraction(out, rec.stamp, 6);
+                 break;
+      case FMT_NSEC:
+                 format_fraction(out, rec.stamp, 9);
                  break;
-      case 'N':  
+      case FMT_NAME_COLON:
+                 out.append(name);
                  if (name.size() > 0)
-                   append_colon = true; 
-      case 'n':
-                 s_append(record, name, MAX_RECORD_LENGTH);
-                 if (append_colon)
-                   record += ": ";
+                   out.append(": ", 2);
                  break;
-      case 'I':
-                 if (this_thread::get_id() != logging::main_thread_id)
-                   s_append(record, "(" + format_tid() + ") ", MAX_RECORD_LENGTH);
+      case FMT_NAME:
+                 out.append(name);
                  break;
-      case 'i':
-                 s_append(record, format_tid(), MAX_RECORD_LENGTH);
+      case FMT_TID_NOTMAIN:
+                 if (origin ? not origin->mainthread
+                            : rec.tid != logging::main_thread_id) {
+                   out.append('(');
+                   if (origin)
+                     format_tid(out, origin->tid);
+                   else
+                     format_tid(out, rec.tid);
+                   out.append(") ", 2);
+                 }
                  break;
-      case 'P':
-                 s_append(record, format_ppid(), MAX_RECORD_LENGTH);
+      case FMT_TID:
+                 if (origin)
+                   format_tid(out, origin->tid);
+                 else
+                   format_tid(out, rec.tid);
                  break;
-      case 'p':
-                 s_append(record, format_pid(), MAX_RECORD_LENGTH);
+      case FMT_THREAD_NAME:
+                 // the thread id when the thread has no name
+                 //
+                 if (origin)
+                   format_tid(out, origin->tid);
+                 else if (rec.threadname)
+                   out.append(rec.threadname);
+                 else
+                   format_tid(out, rec.tid);
                  break;
-      case 'L':
-                 uppercase = true;
-      case 'l':
-                 s_append(record, level_to_string(level, uppercase), MAX_RECORD_LENGTH);
+      case FMT_CONTEXT:
+                 // innermost field with the key
+                 //
+                 for (const LogContext* c = rec.context; c;
+                      c = c->parent.get())
+                   if (c->key.size() == op.length and
+                       memcmp(c->key.data(), recordformat.data() + op.offset,
+                              op.length) == 0) {
+                     out.append(c->value);
+                     break;
+                   }
                  break;
-      case 'M':
-      case 'm':
-                 s_append(record, message, MAX_RECORD_LENGTH);
+      case FMT_CONTEXT_ALL:
+                 if (rec.context)
+                   out.append(rec.context->logfmt);
                  break;
-      case '%':
-                 s_append(record, "%", MAX_RECORD_LENGTH);
-                 break;                 
-      default:
-                 s_append(record, pending, MAX_RECORD_LENGTH);
+      case FMT_PPID:
+                 if (origin)
+                   out.append(ids, max(snprintf(ids, sizeof(ids), "%li",
+                                                origin->ppid), 0));
+                 else
+                   format_ppid(out);
+                 break;
+      case FMT_PID:
+                 if (origin)
+                   out.append(ids, max(snprintf(ids, sizeof(ids), "%li",
+                                                origin->pid), 0));
+                 else
+                   format_pid(out);
+                 break;
+      case FMT_LEVEL_UPPER:
+                 out.append(level_to_string(rec.level, true));
+                 break;
+      case FMT_LEVEL:
+                 out.append(level_to_string(rec.level, false));
+                 break;
+      case FMT_MESSAGE:
+                 out.append(rec.message, rec.msglen);
+                 format_fields(out, rec.fields, rec.nfields, FORMAT_TEXT);
                  break;
     }
-    pending.clear();
   }
-  s_append(record, pending, MAX_RECORD_LENGTH);
-
-  return record;
 }    
-
@@ -1,6 +1,24 @@
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <deque>
+#include <atomic>
+#include <algorithm>
 #include <cstdarg>
 #include <fstream>
 #include <iostream>
@@ -10,74 +28,1037 @@
 
 using namespace std;
 
-//////////// File and stream handling functions
+//////////// Handler statistics
 //
-// Configure the log file for a logger (safe)
+void Handler::count_bytes(size_t n) {
+  // Caller serializes updates to this handler
+  //
+  nbytes.store(nbytes.load(memory_order_relaxed) + n, memory_order_relaxed);
+  ThreadStats::get().add(STAT_BYTES, n);
+}
+
+//////////// Stream output
+//
+// Several loggers may share a stream (e.g. cerr). Writers to the same
+// stream serialize on one of STREAM_LOCKS mutexes picked by its address
+//
+void Handler::stream_write(ostream* os, const char* record, size_t length) {
+  //
+  static mutex streamlocks[STREAM_LOCKS];
+
+  size_t slot = (hash<ostream*>()(os) / sizeof(void*)) % STREAM_LOCKS;
+
+  lock_guard<mutex> lock(streamlocks[slot]);
+
+  os->write(record, length);
+  os->flush();
+}
+
+void Handler::fd_write(int fd, struct iovec* iov, int iovcnt) {
+  // Descriptors get locks of their own: a stream and its descriptor only
+  // interleave whole records. Partial writes resume where they stopped,
+  // updating 'iov'. Output is lost on any other error
+  //
+  static mutex fdlocks[STREAM_LOCKS];
+
+  lock_guard<mutex> lock(fdlocks[fd % STREAM_LOCKS]);
+
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    while (iovcnt > 0 and (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void StreamHandler::emit(const char* record, size_t length, int level) {
+  //
+  stream_write(os, record, length);
+
+  lock_guard<mutex> lock(hmutex);
+  count_bytes(length);
+}
+
+size_t Handler::clip(const char*& record, size_t length, size_t limit,
+                     LogBuffer& out) {
+  // Records longer than 'limit' bytes are cut and end in TRUNCATION_MARKER
+  // and the final LF, if any. UTF-8 characters are not split
+  // Return the new length. 'record' then points into 'out'
+  //
+  if (limit == 0 or length <= limit)
+    return length;
+
+  const size_t marker = sizeof(TRUNCATION_MARKER) - 1;
+  bool   eol  = record[length - 1] == '\n';
+  size_t keep = limit > marker + eol ? limit - marker - eol : limit;
+
+  while (keep > 0 and (record[keep] & 0xc0) == 0x80)
+    keep--;
+
+  out.clear();
+  out.append(record, keep);
+  if (limit > marker + eol) {
+    out.append(TRUNCATION_MARKER, marker);
+    if (eol)
+      out.append('\n');
+  }
+  record = out.data();
+
+  return out.size();
+}
+
+//////////// File flushing
+//
+// Buffered file handlers with a flush interval register with a single
+// flusher thread that wakes up every FLUSH_TICK ms and flushes those due
+// Handlers unregister before being destroyed, so holding the flusher
+// mutex keeps them alive. Lock order: flusher mutex, then handler mutex
+//
+// It is a non-local object so that it outlives the logger tree, whose
+// handlers unregister on destruction
+//
+class FileFlusher {
+  private:
+    mutex                   flmutex;     // protect members
+    condition_variable      wake;        // shutdown signal
+    set<FileHandler*>       handlers;    // registered handlers
+    thread                  worker;      // flusher thread, started lazily
+    bool                    running;     // cleared on shutdown
+    //
+    void run();
+  public:
+    FileFlusher() : running(true) {}
+    ~FileFlusher();
+    //
+    void add(FileHandler* handler);
+    void remove(FileHandler* handler);
+    void atfork(int stage);
+};
+
+static FileFlusher flusher;
+
+FileFlusher::~FileFlusher() {
+  //
+  {
+    lock_guard<mutex> lock(flmutex);
+    running = false;
+  }
+  wake.notify_all();
+
+  if (worker.joinable())
+    worker.join();
+}
+
+void FileFlusher::add(FileHandler* handler) {
+  //
+  lock_guard<mutex> lock(flmutex);
+
+  handlers.insert(handler);
+  if (not worker.joinable())
+    worker = thread(&FileFlusher::run, this);
+}
+
+void FileFlusher::remove(FileHandler* handler) {
+  //
+  lock_guard<mutex> lock(flmutex);
+
+  handlers.erase(handler);
+}
+
+void FileFlusher::atfork(int stage) {
+  // The child restarts the thread if there is still work for it
+  //
+  if (stage == FORK_PREPARE) {
+    flmutex.lock();
+    return;
+  }
+  if (stage == FORK_CHILD) {
+    logging::forget_thread(worker);
+    if (not handlers.empty())
+      worker = thread(&FileFlusher::run, this);
+  }
+  flmutex.unlock();
+}
+
+void FileFlusher::run() {
+  //
+  unique_lock<mutex> lock(flmutex);
+
+  while (running) {
+    wake.wait_for(lock, chrono::milliseconds(FLUSH_TICK));
+    if (not running)
+      break;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (FileHandler* handler : handlers)
+      handler->flush_if_due(now);
+  }
+}
+
+//////////// Rotated segments
+//
+// Log files renamed by rotation are handed over to a single worker thread
+// that closes them, compresses them and removes the oldest ones, so that
+// none of that happens on a logging thread. Compression runs the gzip or
+// zstd command. Started lazily. Pending work is completed on shutdown
 //
+class SegmentWorker {
+  private:
+    struct job {
+      int          fd;          // segment descriptor, still open
+      string       segment;     // segment file name
+      string       base;        // log file name
+      LogRotation  rotation;    // policy in force when rotated
+    };
+    mutex                   smutex;      // protect members
+    condition_variable      wake;        // work or shutdown
+    deque<job>              jobs;        // pending segments
+    thread                  worker;      // worker thread, started lazily
+    bool                    running;     // cleared on shutdown
+    //
+    void run();
+    static void compress(const job& segment);
+    static void prune(const job& segment);
+  public:
+    SegmentWorker() : running(true) {}
+    ~SegmentWorker();
+    //
+    void submit(int fd, const string& segment, const string& base,
+                const LogRotation& rotation);
+    void atfork(int stage);
+};
+
+static SegmentWorker segments;
+
+SegmentWorker::~SegmentWorker() {
+  //
+  {
+    lock_guard<mutex> lock(smutex);
+    running = false;
+  }
+  wake.notify_all();
+
+  if (worker.joinable())
+    worker.join();
+}
+
+void SegmentWorker::submit(int fd, const string& segment, const string& base,
+                           const LogRotation& rotation) {
+  //
+  job work = { fd, segment, base, rotation };
+  {
+    lock_guard<mutex> lock(smutex);
+
+    jobs.push_back(work);
+    if (not worker.joinable())
+      worker = thread(&SegmentWorker::run, this);
+  }
+  wake.notify_one();
+}
+
+void SegmentWorker::atfork(int stage) {
+  // Pending segments are the parent's to compress and prune. The child
+  // only closes its copy of their descriptors
+  //
+  if (stage == FORK_PREPARE) {
+    smutex.lock();
+    return;
+  }
+  if (stage == FORK_CHILD) {
+    for (const job& work : jobs)
+      close(work.fd);
+    jobs.clear();
+    logging::forget_thread(worker);
+  }
+  smutex.unlock();
+}
+
+void SegmentWorker::run() {
+  // Exit only when stopped and with no work left
+  //
+  unique_lock<mutex> lock(smutex);
+
+  while (true) {
+    wake.wait(lock, [this] { return not jobs.empty() or not running; });
+    if (jobs.empty())
+      break;
+
+    job work = jobs.front();
+    jobs.pop_front();
+
+    lock.unlock();
+    close(work.fd);
+    compress(work);
+    prune(work);
+    lock.lock();
+  }
+}
+
+void SegmentWorker::compress(const job& work) {
+  // Run the compressor on the segment and wait for it. It replaces the
+  // segment with 'segment.gz' or 'segment.zst'
+  //
+  const char* gzip[] = { "gzip", "-q", "-f", work.segment.c_str(), nullptr };
+  const char* zstd[] = { "zstd", "-q", "-f", "--rm", work.segment.c_str(),
+                         nullptr };
+  const char** argv;
+
+  if (work.rotation.compress == COMPRESS_GZIP)
+    argv = gzip;
+  else if (work.rotation.compress == COMPRESS_ZSTD)
+    argv = zstd;
+  else
+    return;
+
+  // pruned while queued, after later rotations
+  //
+  if (access(work.segment.c_str(), F_OK) != 0)
+    return;
+
+  pid_t pid;
+  if (posix_spawnp(&pid, argv[0], nullptr, nullptr,
+                   const_cast<char* const*>(argv), environ) != 0)
+    return;
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0 and errno == EINTR)
+    ;
+}
+
+static bool is_segment(const char* suffix) {
+  // A segment name past "<base>.", as rotate_locked makes it:
+  // "YYYYmmdd-HHMMSS.uuuuuu", then ".gz" or ".zst" once compressed. Shard
+  // files, "<base>.<n>", and their segments are not the base's segments
+  //
+  static const char shape[] = "dddddddd-dddddd.dddddd";
+
+  for (size_t i = 0; i < sizeof(shape) - 1; i++)
+    if (shape[i] == 'd' ? not isdigit((unsigned char) suffix[i])
+                        : suffix[i] != shape[i])
+      return false;
 
-/*
-Handler::Handler(const string& name, int type, const string& filename, ...
+  struct tm tm;
+  if (strptime(suffix, "%Y%m%d-%H%M%S", &tm) != suffix + 15)
+    return false;
 
-Handler::~Handler() {}
-*/
+  const char* rest = suffix + sizeof(shape) - 1;
+  return *rest == '\0' or strcmp(rest, ".gz") == 0 or strcmp(rest, ".zst") == 0;
+}
+
+void SegmentWorker::prune(const job& work) {
+  // Keep the latest 'keep' segments of the log file. Segment names carry
+  // the rotation time, so that they sort in rotation order
+  //
+  if (work.rotation.keep <= 0)
+    return;
+
+  size_t slash  = work.base.rfind('/');
+  string dir    = slash == string::npos ? "." : work.base.substr(0, slash);
+  string prefix = work.base.substr(slash == string::npos ? 0 : slash + 1) + ".";
+
+  DIR* dp = opendir(dir.c_str());
+  if (not dp)
+    return;
+
+  vector<string> found;
+  while (struct dirent* entry = readdir(dp)) {
+    const char* name = entry->d_name;
+    if (strncmp(name, prefix.c_str(), prefix.size()) == 0 and
+        is_segment(name + prefix.size()))
+      found.push_back(name);
+  }
+  closedir(dp);
+
+  sort(found.begin(), found.end());
+  for (size_t i = 0; i + work.rotation.keep < found.size(); i++)
+    unlink((dir + "/" + found[i]).c_str());
+}
+
+//////////// File handler
+//
+FileHandler::FileHandler(const string& fname, size_t bufsize,
+                         int flushlevel, int interval) :
+                         path(fname),
+                         fd(-1),
+                         openerr(0),
+                         buffer(0),
+                         bufsize(0),
+                         flushlevel(flushlevel),
+                         interval(0),
+                         rotation(),
+                         written(0),
+                         opened(time(nullptr)) {
+  //
+  clock_gettime(CLOCK_MONOTONIC, &lastflush);
+
+  fd = open(fname.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    openerr = errno;
+
+  struct stat st;
+  if (fd >= 0 and fstat(fd, &st) == 0)
+    written = st.st_size;
+
+  set_policy(bufsize, flushlevel, interval);
+
+  if (fd >= 0)
+    Handler::enlist(this);
+}
+
+FileHandler::~FileHandler() {
+  //
+  Handler::delist(this);
+  flusher.remove(this);
+
+  if (fd >= 0) {
+    flush_locked();
+    close(fd);
+  }
+}
+
+void FileHandler::set_policy(size_t new_bufsize, int new_flushlevel,
+                             int new_interval) {
+  // Change buffering. Pending output is written with the old settings
+  //
+  {
+    lock_guard<mutex> lock(hmutex);
+
+    flush_locked();
+
+    bufsize    = new_bufsize;
+    flushlevel = new_flushlevel;
+    interval   = max(new_interval, 0);
+    buffer.reserve(bufsize);
+  }
+
+  // not under hmutex. The flusher locks handlers while holding its mutex
+  //
+  if (bufsize > 0 and interval > 0)
+    flusher.add(this);
+  else
+    flusher.remove(this);
+}
+
+void FileHandler::write_out(const char* data, size_t length) {
+  // write(2) everything, retrying after interrupts and partial writes
+  // Output is lost on any other error
+  //
+  while (length > 0) {
+    ssize_t n = write(fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    count_bytes(n);
+    written += n;
+    data    += n;
+    length  -= n;
+  }
+}
+
+void FileHandler::emit(const char* record, size_t length, int level) {
+  // The descriptor changes on rotation
+  //
+  lock_guard<mutex> lock(hmutex);
+
+  if (fd < 0)
+    return;
+
+  emit_locked(record, length, level);
+}
+
+void FileHandler::emit_locked(const char* record, size_t length, int level) {
+  // Buffer or write through according to the policy
+  // Caller must hold hmutex
+  //
+  if ((rotation.maxsize > 0 or rotation.maxage > 0) and rotation_due(length))
+    rotate_locked();
+
+  if (buffer.size() + length > bufsize)
+    flush_locked();
+
+  if (length > bufsize)
+    write_out(record, length);        // would not fit. Write through
+  else
+    buffer.append(record, length);
+
+  // write through once the library has been shut down
+  //
+  if (level >= flushlevel or logging::finished.load(memory_order_relaxed))
+    flush_locked();
+}
+
+void FileHandler::flush() {
+  //
+  lock_guard<mutex> lock(hmutex);
+
+  flush_locked();
+}
+
+void FileHandler::flush_locked() {
+  // Caller must hold hmutex
+  //
+  if (fd >= 0 and buffer.size() > 0) {
+    write_out(buffer.data(), buffer.size());
+    nflushes.store(nflushes.load(memory_order_relaxed) + 1,
+                   memory_order_relaxed);
+    ThreadStats::get().add(STAT_FLUSHES, 1);
+  }
+
+  buffer.clear();
+  clock_gettime(CLOCK_MONOTONIC, &lastflush);
+}
+
+void FileHandler::atfork(int stage) {
+  // Buffered output is the parent's to write. The child starts empty
+  //
+  if (stage == FORK_PREPARE) {
+    hmutex.lock();
+    return;
+  }
+  if (stage == FORK_CHILD)
+    buffer.clear();
+  hmutex.unlock();
+}
+
+void FileHandler::emergency_drain() {
+  // Called from a signal handler, possibly interrupting a writer of this
+  // handler. Whatever the buffer holds is written out, with write(2) only
+  //
+  emergency_write(buffer.data(), buffer.size());
+  buffer.clear();
+}
+
+void FileHandler::emergency_write(const char* data, size_t length) {
+  // write(2) straight to the file, no locks. Async-signal-safe
+  //
+  int file = fd.load();
+  if (file < 0)
+    return;
+
+  while (length > 0) {
+    ssize_t n = write(file, data, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    data   += n;
+    length -= n;
+  }
+}
+
+void FileHandler::workers_atfork(int stage) {
+  // the flusher thread goes first, it locks handlers
+  //
+  if (stage == FORK_PREPARE) {
+    flusher.atfork(stage);
+    segments.atfork(stage);
+  }
+  else {
+    segments.atfork(stage);
+    flusher.atfork(stage);
+  }
+}
+
+void FileHandler::set_rotation(const LogRotation& new_rotation) {
+  //
+  lock_guard<mutex> lock(hmutex);
+
+  rotation = new_rotation;
+}
+
+bool FileHandler::rotation_due(size_t length) {
+  // Would the record take the file past its size limit, or is it too old
+  // An empty file is not rotated for size
+  // Caller must hold hmutex
+  //
+  size_t pending = written + buffer.size();
+
+  if (rotation.maxsize > 0 and pending > 0 and
+      pending + length > rotation.maxsize)
+    return true;
+
+  return rotation.maxage > 0 and time(nullptr) - opened >= rotation.maxage;
+}
+
+void FileHandler::rotate_locked() {
+  // Rename the file to 'path.YYYYmmdd-HHMMSS.uuuuuu' and start a new one
+  // The segment is closed by the segment worker. If the rename or the
+  // reopen fail, writing goes on to the current file until the next limit
+  // Caller must hold hmutex
+  //
+  flush_locked();
+
+  struct timespec now;
+  struct tm       tm;
+  char            stamp[32];
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  localtime_r(&now.tv_sec, &tm);
+  size_t n = strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+  snprintf(stamp + n, sizeof(stamp) - n, ".%06ld", now.tv_nsec / 1000);
+
+  string segment = path + "." + stamp;
+
+  written = 0;
+  opened  = now.tv_sec;
+
+  if (rename(path.c_str(), segment.c_str()) != 0)
+    return;
+
+  int newfd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                   0644);
+  if (newfd < 0)
+    return;
+
+  int oldfd = fd;
+  fd = newfd;
+
+  segments.submit(oldfd, segment, path, rotation);
+}
+
+void FileHandler::flush_if_due(const struct timespec& now) {
+  //
+  lock_guard<mutex> lock(hmutex);
+
+  long elapsed = (now.tv_sec - lastflush.tv_sec) * 1000 +
+                 (now.tv_nsec - lastflush.tv_nsec) / 1000000;
+
+  if (elapsed >= interval)
+    flush_locked();
+}
 
-int Logger::set_logfile(const string& fname) {
+//////////// Ring file handler
+//
+// File layout: a RING_HEADER_SIZE header followed by the ring data
+// Cursors are byte counts since the ring was created and never wrap;
+// a record written at cursor c lives at offset c % size in the data area
+//
+struct RingHandler::ringheader {
+  char                            magic[8];    // RING_MAGIC
+  unsigned long long              size;        // data area size
+  atomic<unsigned long long>      reserved;    // end of reserved space
+  atomic<unsigned long long>      committed;   // end of valid data
+};
+
+RingHandler::RingHandler(const string& fname, size_t size) :
+                         fd(-1),
+                         openerr(0),
+                         header(nullptr),
+                         data(nullptr),
+                         size(size) {
+  //
+  static_assert(sizeof(ringheader) <= RING_HEADER_SIZE,
+                "ring header does not fit");
+
+  size_t mapsize = RING_HEADER_SIZE + size;
+
+  // what failed is kept in 'openerr', before close() can change errno
+  //
+  if (size == 0) {
+    openerr = EINVAL;
+    return;
+  }
+
+  fd = open(fname.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    openerr = errno;
+    return;
+  }
+
+  struct stat st;
+  bool reuse = fstat(fd, &st) == 0 and (size_t) st.st_size == mapsize;
+
+  if (not reuse and ftruncate(fd, mapsize) != 0) {
+    openerr = errno;
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  void* p = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    openerr = errno;
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  header = (ringheader*) p;
+  data   = (char*) p + RING_HEADER_SIZE;
+
+  // continue an existing ring of the same size. Start over otherwise
+  // Space reserved but never committed (a writer died) is given back
+  //
+  if (not reuse or memcmp(header->magic, RING_MAGIC, sizeof(header->magic))
+      or header->size != size) {
+    header->size = size;
+    header->reserved.store(0);
+    header->committed.store(0);
+    memcpy(header->magic, RING_MAGIC, sizeof(header->magic));
+  }
+  else
+    header->reserved.store(header->committed.load());
+}
+
+RingHandler::~RingHandler() {
+  //
+  if (header)
+    munmap(header, RING_HEADER_SIZE + size);
+  if (fd >= 0)
+    close(fd);
+}
+
+void RingHandler::emit(const char* record, size_t length, int level) {
+  // Reserve, copy and commit. No system calls. Records longer than the
+  // ring keep their tail only
+  //
+  if (not header)
+    return;
+
+  if (length > size) {
+    record += length - size;
+    length  = size;
+  }
+
+  unsigned long long start = header->reserved.fetch_add(length);
+  size_t offset = start % size;
+  size_t first  = min(length, size - offset);
+
+  memcpy(data + offset, record, first);
+  memcpy(data, record + first, length - first);
+
+  // commit in reservation order
+  //
+  unsigned long long expected = start;
+  while (not header->committed.compare_exchange_weak(expected,
+                                      start + length, memory_order_release)) {
+    expected = start;
+    this_thread::yield();
+  }
+  // concurrent writers. No hmutex here
+  //
+  nbytes.fetch_add(length, memory_order_relaxed);
+  ThreadStats::get().add(STAT_BYTES, length);
+}
+
+int RingHandler::dump(const string& fname, int outfd) {
+  // Write the valid contents of a ring file, oldest record first
+  // When the ring has wrapped, the partial record at the start is skipped
+  // Return 0 on success
+  //
+  int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 1;
+
+  struct stat st;
+  void* p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 and st.st_size >= RING_HEADER_SIZE)
+    p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return 1;
+
+  const ringheader* hdr = (const ringheader*) p;
+  const char* ring      = (const char*) p + RING_HEADER_SIZE;
+  size_t ringsize       = hdr->size;
+  int rc                = 0;
+
+  if (memcmp(hdr->magic, RING_MAGIC, sizeof(hdr->magic)) or ringsize == 0 or
+      (size_t) st.st_size != RING_HEADER_SIZE + ringsize)
+    rc = 1;
+  else {
+    unsigned long long end   = hdr->committed.load(memory_order_acquire);
+    unsigned long long begin = end > ringsize ? end - ringsize : 0;
+
+    // collect both halves of the ring in order
+    //
+    const char* part[2];
+    size_t      len[2];
+    size_t      offset = begin % ringsize;
+
+    part[0] = ring + offset;
+    len[0]  = min((size_t) (end - begin), ringsize - offset);
+    part[1] = ring;
+    len[1]  = (end - begin) - len[0];
+
+    if (begin > 0) {
+      // skip the partially overwritten oldest record
+      //
+      for (int i = 0; i < 2 and begin > 0; i++) {
+        const char* nl = (const char*) memchr(part[i], '\n', len[i]);
+        size_t skip = nl ? nl - part[i] + 1 : len[i];
+        part[i] += skip;
+        len[i]  -= skip;
+        if (nl)
+          break;
+      }
+    }
+
+    for (int i = 0; i < 2; i++) {
+      while (len[i] > 0) {
+        ssize_t n = write(outfd, part[i], len[i]);
+        if (n < 0 and errno == EINTR)
+          continue;
+        if (n <= 0) {
+          rc = 1;
+          break;
+        }
+        part[i] += n;
+        len[i]  -= n;
+      }
+    }
+  }
+
+  munmap(p, st.st_size);
+
+  return rc;
+}
+
+//////////// File and stream handling functions
+//
+char* logging::absolute_path(const string& fname, string& path) {
+  // Absolute path name of a log file, created if it does not exist
+  // Return the error message on failure
+  //
+  char* p;
+
+  // Convert file path name to absolute
+  p = realpath(fname.c_str(), nullptr);
+  if (p) {
+    path = string(p);
+    free(p);
+    return nullptr;
+  }
+
+  ofstream ofs;
+
+  // Log file does not exist. Try to create it
+  ofs.open(fname, ios::trunc); 
+  if (not ofs.is_open())
+    return strerror(errno);
+
+  ofs.close();
+  // Try to build the path name again
+  p = realpath(fname.c_str(), nullptr);
+  path = string(p);
+  free(p);
+
+  return nullptr;
+}
+
+// Configure the log file for a logger (safe)
+// 'sharding' selects a sharded file (SHARD_CPU or SHARD_NODE, merged with
+// SHARD_MERGE). Changing it reopens the file
+//
+int Logger::set_logfile(const string& fname, size_t bufsize,
+                        int flushlevel, int interval, int sharding) {
   string newfname;
   char*  errmsg = nullptr;
 
   // If file is provided and is different from current file, open it and
-  // close existing file
+  // close existing file. A file that fails to open closes it as well
   // Use absolute pathnames for file name comparison
+  // Handlers are opened and closed with logmutex free, and swapped under
+  // it since records are being delivered. They only change under
+  // filemutex
 
-  lock_guard<mutex> lock(logging::filemutex);
+  if (not (sharding & (SHARD_CPU | SHARD_NODE)))
+    sharding = SHARD_NONE;
 
-  if (not fname.empty()) {
-    char*    p;
+  TimedLock<mutex> lock(logging::filemutex);
 
-    // Convert file path name to absolute
-    p = realpath(fname.c_str(), nullptr);
-    if (p) {
-      newfname = string(p);
-      free(p);
+  if (not fname.empty())
+    errmsg = logging::absolute_path(fname, newfname);
+
+  if (newfname == treeptr->filename and sharding == treeptr->sharding) {
+    if (treeptr->logfile)
+      treeptr->logfile->set_policy(bufsize, flushlevel, interval);
+    else if (treeptr->shardfile)
+      treeptr->shardfile->set_policy(bufsize, flushlevel, interval);
+  }
+  else {
+    FileHandler*    logfile   = nullptr;
+    ShardedHandler* shardfile = nullptr;
+
+    if (not newfname.empty() and sharding != SHARD_NONE) {
+      // open new sharded log file
+      shardfile = new ShardedHandler(newfname, bufsize, flushlevel,
+                                     interval, sharding);
+      if (shardfile->is_open())
+        shardfile->set_rotation(treeptr->rotation);
+      else {
+        errmsg = strerror(shardfile->open_error());
+        delete shardfile;
+        shardfile = nullptr;
+      }
     }
-    else {
-      ofstream ofs;
-
-      // Log file does not exist. Try to create it
-      ofs.open(fname, ios::trunc); 
-      if (ofs.is_open()) {
-        ofs.close();
-        // Try to build the path name again
-        p = realpath(fname.c_str(), nullptr);
-        newfname = string(p);
-        free(p);
+    else if (not newfname.empty()) {
+      // open new log file
+      logfile = new FileHandler(newfname, bufsize, flushlevel, interval);
+      if (logfile->is_open())
+        logfile->set_rotation(treeptr->rotation);
+      else {
+        errmsg = strerror(logfile->open_error());
+        delete logfile;
+        logfile = nullptr;
       }
-      else
-        errmsg = strerror(errno);
     }
+
+    {
+      TimedLock<RWMutex> loglock(logging::logmutex);
+
+      swap(treeptr->logfile, logfile);
+      swap(treeptr->shardfile, shardfile);
+      treeptr->filename = treeptr->logfile or treeptr->shardfile ?
+                          newfname : string();
+      treeptr->sharding = treeptr->shardfile ? sharding : SHARD_NONE;
+    }
+
+    // close the current log file, flushing it, with logmutex free
+    delete logfile;
+    delete shardfile;
+  }
+
+  if (errmsg) {
+    error("error opening log file '%s': %s", fname.c_str(), errmsg);
+    return 1;
+  }
+
+  return 0;
+}
+
+int Logger::set_rotation(size_t maxsize, int maxage, int keep, int compress) {
+  // Rotate the log file before it grows past 'maxsize' bytes or once it
+  // has been open for 'maxage' seconds (zero: no limit). Keep the latest
+  // 'keep' segments (zero: all), compressed with gzip or zstd
+  // Applies to the current log file and to those set later (safe)
+  //
+  if (compress < COMPRESS_NONE or compress > COMPRESS_ZSTD) {
+    error("invalid compression for log file rotation: %d", compress);
+    return 1;
+  }
+
+  TimedLock<mutex> lock(logging::filemutex);
+  TimedLock<RWMutex> loglock(logging::logmutex);
+
+  LogRotation& rotation = treeptr->rotation;
+  rotation.maxsize  = maxsize;
+  rotation.maxage   = max(maxage, 0);
+  rotation.keep     = max(keep, 0);
+  rotation.compress = compress;
+
+  if (treeptr->logfile)
+    treeptr->logfile->set_rotation(rotation);
+  if (treeptr->shardfile)
+    treeptr->shardfile->set_rotation(rotation);
+  for (LogTarget& target : treeptr->chain)
+    if (target.kind == HANDLER_LOGFILE)
+      static_cast<FileHandler*>(target.handler)->set_rotation(rotation);
+
+  return 0;
+}
+
+int Logger::set_ringfile(const string& fname, size_t size) {
+  // Configure the memory mapped ring for a logger (safe)
+  // An empty file name closes the current ring. Reopening a ring of the
+  // same size continues it
+  //
+  char*        errmsg   = nullptr;
+  RingHandler* ringfile = nullptr;
+
+  TimedLock<mutex> lock(logging::filemutex);
+
+  // opened and closed with logmutex free. Reopening the current ring
+  // closes it first, so that no record is being written to it while the
+  // new mapping takes over
+  if (not fname.empty() and fname == treeptr->ringname) {
+    {
+      TimedLock<RWMutex> loglock(logging::logmutex);
+
+      swap(treeptr->ringfile, ringfile);
+      treeptr->ringname = string();
+    }
+    delete ringfile;
+    ringfile = nullptr;
   }
 
-  if (newfname != treeptr->filename) {
-    // close current log file
-    if (treeptr->logfile and treeptr->logfile->is_open()) {
-      treeptr->logfile->close();
-      delete treeptr->logfile;
+  if (not fname.empty()) {
+    ringfile = new RingHandler(fname, size);
+    if (not ringfile->is_open()) {
+      errmsg = strerror(ringfile->open_error());
+      delete ringfile;
+      ringfile = nullptr;
     }
-    treeptr->filename = string();
+  }
 
-    if (not newfname.empty()) {
-      // open new log file
-      treeptr->logfile = new ofstream();
-      treeptr->logfile->open(newfname, ios::app);
-      if (treeptr->logfile->is_open())
-        treeptr->filename = newfname;
-      else
-        errmsg = strerror(errno);
+  {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    swap(treeptr->ringfile, ringfile);
+    treeptr->ringname = treeptr->ringfile ? fname : string();
+  }
+
+  // unmap the current ring
+  delete ringfile;
+
+  if (errmsg) {
+    error("error opening ring file '%s': %s", fname.c_str(), errmsg);
+    return 1;
+  }
+
+  return 0;
+}
+
+int Logger::set_binfile(const string& fname, size_t bufsize,
+                        int flushlevel, int interval) {
+  // Configure the binary log file for a logger (safe)
+  // An empty file name closes the current file. Records are appended to an
+  // existing file in a new session
+  //
+  char*          errmsg  = nullptr;
+  BinaryHandler* binfile = nullptr;
+
+  TimedLock<mutex> lock(logging::filemutex);
+
+  // opened and closed with logmutex free
+  if (not fname.empty()) {
+    binfile = new BinaryHandler(fname, bufsize, flushlevel, interval);
+    if (not binfile->is_open()) {
+      errmsg = strerror(binfile->open_error());
+      delete binfile;
+      binfile = nullptr;
     }
   }
 
+  {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    swap(treeptr->binfile, binfile);
+    treeptr->binname = treeptr->binfile ? fname : string();
+  }
+
+  // close the current file, flushing it
+  delete binfile;
+
   if (errmsg) {
-    error("error opening log file '%s': %s", fname.c_str(), errmsg);
+    error("error opening binary log file '%s': %s", fname.c_str(), errmsg);
     return 1;
   }
 
@@ -87,25 +1068,38 @@ int Logger::set_logfile(const string& fname) {
 ostream* Logger::get_streamer() {
   // check whether an output stream is enabled (safe)
   //
-  lock_guard<mutex> lock(logging::filemutex);
+  TimedLock<mutex> lock(logging::filemutex);
 
   return treeptr->outstream;
 }
 
 ostream* Logger::set_streamer(int streamval) {
   // select an output stream (safe)
+  // FD_STDOUT and FD_STDERR select a descriptor instead. The current
+  // stream is then returned as null
   //
-  lock_guard<mutex> lock(logging::filemutex);
+  TimedLock<mutex> lock(logging::filemutex);
+  TimedLock<RWMutex> loglock(logging::logmutex);
 
   ostream* curos = treeptr->outstream;
   switch(streamval) {
     case STDOUT:     treeptr->outstream = &cout;
+                     treeptr->outfd     = -1;
                      break;
     case STDERR:     treeptr->outstream = &cerr;
+                     treeptr->outfd     = -1;
                      break;
     case STDLOG:     treeptr->outstream = &clog;
+                     treeptr->outfd     = -1;
+                     break;
+    case FD_STDOUT:  treeptr->outstream = nullptr;
+                     treeptr->outfd     = STDOUT_FILENO;
+                     break;
+    case FD_STDERR:  treeptr->outstream = nullptr;
+                     treeptr->outfd     = STDERR_FILENO;
                      break;
     case DEVNULL:    treeptr->outstream = nullptr;
+                     treeptr->outfd     = -1;
                      break;
     case UNCHANGED:
     default:         break;
@@ -117,10 +1111,234 @@ ostream* Logger::set_streamer(int streamval) {
 ostream* Logger::set_streamer(ostream* stream) {
   // set the output stream (safe)
   //
-  lock_guard<mutex> lock(logging::filemutex);
+  TimedLock<mutex> lock(logging::filemutex);
+  TimedLock<RWMutex> loglock(logging::logmutex);
 
   ostream* curos = treeptr->outstream;
   treeptr->outstream = stream;
+  treeptr->outfd     = -1;
 
   return curos;
 }
+
+size_t Logger::set_max_record(size_t length, int handlers) {
+  // Records longer than 'length' bytes are cut by the selected handlers
+  // (HANDLER_STREAM, HANDLER_LOGFILE, ...). Zero: no limit. Binary files
+  // and structured (JSON, logfmt) records are never cut (safe)
+  // Return the previous limit of the first handler selected
+  //
+  TimedLock<RWMutex> lock(logging::logmutex);
+
+  size_t curlength = 0;
+  bool   found     = false;
+
+  for (int kind = 0; kind < HANDLER_KINDS; kind++) {
+    if (not (handlers & (1 << kind)))
+      continue;
+    if (not found)
+      curlength = treeptr->recordmax[kind];
+    found = true;
+    treeptr->recordmax[kind] = length;
+  }
+
+  return curlength;
+}
+
+int Logger::set_handler_level(int level, int handlers) {
+  // Records below 'level' are skipped by the selected handlers
+  // (HANDLER_STREAM, HANDLER_LOGFILE, ...) before they are rendered.
+  // NOTSET: every record that passes the logger level (safe)
+  // Return the previous level of the first handler selected
+  //
+  if (level < MINLOG or level > MAXLOG)
+    return UNCHANGED;
+
+  TimedLock<RWMutex> lock(logging::logmutex);
+
+  int  curlevel = NOTSET;
+  bool found    = false;
+
+  for (int kind = 0; kind < HANDLER_KINDS; kind++) {
+    if (not (handlers & (1 << kind)))
+      continue;
+    if (not found)
+      curlevel = treeptr->handlerlevel[kind];
+    found = true;
+    treeptr->handlerlevel[kind] = level;
+  }
+
+  return curlevel;
+}
+
+//////////// Handler chain
+//
+// Handlers added to a logger next to the ones set by set_streamer(),
+// set_logfile(), etc. Each has its own level and, for text handlers, its
+// own formatter. 'target' is a file name, a network address (UDP, with
+// the default syslog facility) or one of "stdout", "stderr", "stdlog".
+// Files and rings take the default buffering and size. Adding a handler
+// already in the chain changes its level and formatter (safe)
+//
+int Logger::add_handler(int kind, const string& target, int level) {
+  //
+  return attach_handler(kind, target, level, nullptr);
+}
+
+int Logger::add_handler(int kind, const string& target, int level,
+                        const Formatter& formatter) {
+  // the formatter is copied
+  //
+  fmtptr_t fmt(new Formatter(formatter));
+  fmt->fmtptr = nullptr;
+
+  return attach_handler(kind, target, level, fmt);
+}
+
+int Logger::attach_handler(int kind, const string& target, int level,
+                           fmtptr_t formatter) {
+  //
+  if (level < MINLOG or level > MAXLOG) {
+    error("invalid level for handler '%s': %d", target.c_str(), level);
+    return 1;
+  }
+
+  string   name    = target;
+  char*    errmsg  = nullptr;
+  Handler* handler = nullptr;
+
+  TimedLock<mutex> lock(logging::filemutex);
+
+  switch (kind) {
+    case HANDLER_STREAM:
+             if (target != "stdout" and target != "stderr" and
+                 target != "stdlog")
+               errmsg = strerror(EINVAL);
+             break;
+    case HANDLER_LOGFILE:
+    case HANDLER_BINFILE:
+             errmsg = target.empty() ? strerror(ENOENT) :
+                               logging::absolute_path(target, name);
+             break;
+    case HANDLER_RINGFILE:
+    case HANDLER_NETSINK:
+             break;
+    default:
+             errmsg = strerror(EINVAL);
+             break;
+  }
+
+  if (not errmsg) {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    for (LogTarget& entry : treeptr->chain)
+      if (entry.kind == kind and entry.name == name) {
+        entry.level     = level;
+        entry.formatter = formatter;
+        return 0;
+      }
+  }
+
+  if (not errmsg and treeptr->chain.size() >= MAX_CHAIN_HANDLERS)
+    errmsg = strerror(ENOSPC);
+
+  // open the handler before taking logmutex. Network sinks resolve their
+  // address
+  //
+  if (not errmsg) {
+    switch (kind) {
+      case HANDLER_STREAM:
+               handler = new StreamHandler(name == "stdout" ? &cout :
+                                           name == "stderr" ? &cerr : &clog);
+               break;
+      case HANDLER_LOGFILE: {
+               FileHandler* file = new FileHandler(name, DEFAULT_FILE_BUFSIZE,
+                                                   DEFAULT_FLUSH_LEVEL,
+                                                   DEFAULT_FLUSH_INTERVAL);
+               if (file->is_open())
+                 file->set_rotation(treeptr->rotation);
+               else
+                 errmsg = strerror(file->open_error());
+               handler = file;
+               break;
+             }
+      case HANDLER_BINFILE: {
+               BinaryHandler* file = new BinaryHandler(name,
+                                                   DEFAULT_FILE_BUFSIZE,
+                                                   DEFAULT_FLUSH_LEVEL,
+                                                   DEFAULT_FLUSH_INTERVAL);
+               if (not file->is_open())
+                 errmsg = strerror(file->open_error());
+               handler = file;
+               break;
+             }
+      case HANDLER_RINGFILE: {
+               RingHandler* ring = new RingHandler(name, DEFAULT_RING_SIZE);
+               if (not ring->is_open())
+                 errmsg = strerror(ring->open_error());
+               handler = ring;
+               break;
+             }
+      case HANDLER_NETSINK: {
+               NetworkHandler* sink = new NetworkHandler(name, NET_UDP,
+                                                  DEFAULT_NET_FACILITY,
+                                                  DEFAULT_NET_QUEUE);
+               if (not sink->is_open())
+                 errmsg = strerror(EINVAL);
+               handler = sink;
+               break;
+             }
+    }
+  }
+
+  if (errmsg) {
+    delete handler;
+    error("error adding handler '%s': %s", target.c_str(), errmsg);
+    return 1;
+  }
+
+  LogTarget entry = { handler, kind, name, level, formatter };
+  {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    treeptr->chain.push_back(entry);
+  }
+
+  return 0;
+}
+
+int Logger::remove_handler(int kind, const string& target) {
+  // Close a handler of the chain. As with set_netsink(), the handler is
+  // closed with logmutex released (safe)
+  //
+  string   name    = target;
+  Handler* handler = nullptr;
+
+  TimedLock<mutex> lock(logging::filemutex);
+
+  if (kind == HANDLER_LOGFILE or kind == HANDLER_BINFILE) {
+    char* p = realpath(target.c_str(), nullptr);
+    if (p) {
+      name = string(p);
+      free(p);
+    }
+  }
+
+  {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    vector<LogTarget>& chain = treeptr->chain;
+    for (size_t i = 0; i < chain.size(); i++)
+      if (chain[i].kind == kind and chain[i].name == name) {
+        handler = chain[i].handler;
+        chain.erase(chain.begin() + i);
+        break;
+      }
+  }
+
+  if (not handler)
+    return 1;
+
+  delete handler;
+
+  return 0;
+}
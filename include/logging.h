@@ -2,23 +2,38 @@
 #define INC_LOGGING
 
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 
+#include <string.h>
+
+#include <new>
 #include <memory>
+#include <atomic>
+#include <type_traits>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <initializer_list>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 
 #define UNCHANGED  (-1)
 
 /* used for stream selection
-   have nothing to do with known file descriptors
+   have nothing to do with known file descriptors, but for FD_STDOUT and
+   FD_STDERR: those write to descriptors 1 and 2 with no iostream between
 */
 
 #define DEVNULL    0
 #define STDOUT     1
 #define STDERR     2
 #define STDLOG     3
+#define FD_STDOUT  4
+#define FD_STDERR  5
 
 #define NOTSET   0
 #define DEBUG    1
@@ -34,28 +49,399 @@
 #define MAX_MODULE_NAME_SIZE 256
 #define MAX_MODULE_SUBFIELDS  24 
 
-#define MAX_RECORD_LENGTH    512
+/* record sizes. Messages are formatted whole, up to MAX_MESSAGE_LENGTH
+   bytes. Each handler cuts longer records at its own limit, marking the cut
+*/
+
+#define MAX_MESSAGE_LENGTH (1024 * 1024)
+#define DEFAULT_MAX_RECORD       65536    // per handler. Zero: no limit
+#define TRUNCATION_MARKER  "...[truncated]"
+#define LOGBUFFER_RETAIN   (64 * 1024)    // thread buffers shrink past this
+
+/* handlers, as selected by Logger::set_max_record(), set_handler_level()
+   and add_handler()
+*/
+
+#define HANDLER_STREAM   1
+#define HANDLER_LOGFILE  2
+#define HANDLER_RINGFILE 4
+#define HANDLER_NETSINK  8
+#define HANDLER_BINFILE 16
+#define HANDLER_ALL     31
+#define HANDLER_KINDS    5
+#define MAX_CHAIN_HANDLERS 8   // handlers added to a logger (add_handler)
+
+#define TIMECACHE_SIZE         4    // cached timestamps per thread
+#define TIDCACHE_SIZE          4    // cached thread ids per thread
+#define MAX_THREAD_NAME       64    // thread name storage, with the NUL
+#define RENDER_CACHE_SIZE      4    // distinct formatters memoized per record
 
 #define DEFAULT_TIMEFMT   "%Y/%m/%d:%H:%M:%S"
 #define DEFAULT_RECORDFMT "%t %I[%l] %N%m"
 
+/* record output modes. Structured modes ignore the record format
+*/
+
+#define FORMAT_TEXT   0     // record format, then fields as key=value
+#define FORMAT_JSON   1     // one JSON object per record
+#define FORMAT_LOGFMT 2     // key=value pairs
+
+/* queue overflow policies for asynchronous mode
+*/
+
+#define OVERFLOW_BLOCK     0
+#define OVERFLOW_DROP      1
+#define OVERFLOW_DROPLEVEL 2
+
+#define DEFAULT_QUEUE_CAPACITY 8192
+#define QUEUE_BATCH_SIZE         64
+
+/* log file buffering. A zero buffer size writes every record through
+*/
+
+#define DEFAULT_FILE_BUFSIZE      0
+#define DEFAULT_FLUSH_LEVEL   ERROR
+#define DEFAULT_FLUSH_INTERVAL 1000     // milliseconds. Zero disables
+#define FLUSH_TICK              100     // flusher thread period (ms)
+
+/* log file rotation. Rotated segments are compressed by a background
+   thread running the gzip or zstd command
+*/
+
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+
+#define DEFAULT_ROTATE_KEEP 7       // rotated segments kept. Zero: all
+
+/* sharded log files (set_logfile). Records are staged per CPU or per
+   NUMA node and written by a background thread, to a file per shard or
+   merged in time order into a single file
+*/
+
+#define SHARD_NONE  0
+#define SHARD_CPU   1
+#define SHARD_NODE  2
+#define SHARD_MERGE 4               // with SHARD_CPU or SHARD_NODE
+
+#define MAX_SHARDS            256
+#define CACHE_LINE_SIZE        64
+#define SHARD_STAGE_SIZE  (64 * 1024)       // wake the writer past this
+#define SHARD_STAGE_MAX   (4 * 1024 * 1024) // the caller writes past this
+#define DEFAULT_SHARD_INTERVAL 100          // ms. Writer period if none
+
+/* memory mapped ring files
+*/
+
+#define RING_MAGIC        "LOGRING1"
+#define RING_HEADER_SIZE  64                // data starts at this offset
+#define DEFAULT_RING_SIZE (4 * 1024 * 1024)
+
+/* binary log files
+*/
+
+#define BINARY_MAGIC      "LOGBIN01"        // starts every writer session
+
+/* network sinks. RFC 5424 syslog messages over UDP (a datagram each) or
+   TCP (octet counting framing, RFC 6587)
+*/
+
+#define NET_UDP 0
+#define NET_TCP 1
+
+#define DEFAULT_NET_FACILITY       1        // user-level messages
+#define DEFAULT_NET_QUEUE  (1024 * 1024)    // bytes waiting to be sent
+#define NET_BATCH_SIZE            64        // datagrams per sendmmsg()
+#define NET_MAX_DATAGRAM        2048        // longer UDP messages are cut
+#define NET_TIMEOUT             1000        // connect and send timeout (ms)
+#define NET_RETRY_MAX           5000        // reconnect backoff ceiling (ms)
+
+#define STREAM_LOCKS 16        // striped locks for writing to ostreams
+
+/* lifecycle: flushing, shutdown, fork() and fatal signals
+*/
+
+#define DEFAULT_DRAIN_TIMEOUT    5000   // ms to deliver pending records
+#define MAX_HANDLERS              256   // reached by flush_all(). Others are
+                                        // still flushed when closed
+#define FORK_PREPARE 0                  // pthread_atfork() stages
+#define FORK_PARENT  1
+#define FORK_CHILD   2
+
+/* logger tree maintenance
+*/
+
+#define INDEX_SHARDS        16  // partitions of the logger name index
+#define RECLAIM_MIN_ORPHANS 64  // expired entries tolerated before a sweep
+#define LOGGER_STATS_BLOCK  128 // loggers per block of per-thread counters
+#define LOGGER_STATS_BLOCKS 512 // blocks per thread. Loggers past them are
+                                // not counted by Logger::stats()
+
+/* rate limiting and duplicate suppression
+*/
+
+#define MAX_RATE_SITES          1024   // call sites tracked per filter
+#define DEFAULT_REPEAT_INTERVAL 30000  // ms. Summarize long runs of repeats
+
+/* sampling modes
+*/
+
+#define SAMPLE_RANDOM 0     // keep each record with probability 'rate'
+#define SAMPLE_EVERY  1     // keep one record out of every 1/rate
+
+/* configuration files (Logger::load_config). Settings given by a logger
+   section, as LoggerConfig::set bits
+*/
+
+#define CONFIG_LEVEL      1
+#define CONFIG_PROPAGATE  2
+#define CONFIG_STREAM     4
+#define CONFIG_FORMAT     8
+#define CONFIG_LOGFILE   16
+#define CONFIG_RINGFILE  32
+#define CONFIG_BINFILE   64
+#define CONFIG_NETSINK  128
+
+// A reader/writer mutex (C++11 has none)
+// lock()/unlock() give exclusive access and work with std::lock_guard
+// lock_shared()/unlock_shared() give shared access through SharedLock
+// Writers are preferred so that configuration changes are not starved
+//
+class RWMutex {
+  private:
+    pthread_rwlock_t rwlock;
+    void init();
+  public:
+    RWMutex();
+    ~RWMutex();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    RWMutex(RWMutex const&)            = delete;
+    RWMutex& operator=(RWMutex const&) = delete;
+    //
+    void lock()          { pthread_rwlock_wrlock(&rwlock); }
+    void unlock()        { pthread_rwlock_unlock(&rwlock); }
+    void lock_shared()   { pthread_rwlock_rdlock(&rwlock); }
+    void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+    void reset();
+};
+
+class SharedLock {
+  private:
+    RWMutex& rwmutex;
+  public:
+    explicit SharedLock(RWMutex& m) : rwmutex(m) { rwmutex.lock_shared(); }
+    ~SharedLock()                                 { rwmutex.unlock_shared(); }
+    // Prevent copying (note: delete functions are a C++11 feature)
+    SharedLock(SharedLock const&)            = delete;
+    SharedLock& operator=(SharedLock const&) = delete;
+};
+
+class LoggerTree;
+struct LogContext;
+struct LogConfig;
+struct iovec;
+
+// Library statistics, as returned by Logger::stats() and global_stats()
+// Timings are only collected with set_stats_timing(true), and globally
+//
+struct LogStats {
+  unsigned long long emitted;     // records past the level filter
+  unsigned long long filtered;    // records discarded by level
+  unsigned long long dropped;     // records discarded by the async queue
+                                  // and the network sink (logger only)
+  unsigned long long suppressed;  // records discarded by rate limits and
+                                  // duplicate suppression
+  unsigned long long sampled;     // records discarded by sampling
+  unsigned long long bytes;       // bytes written by handlers
+  unsigned long long flushes;     // log file buffer flushes
+  unsigned long long format_ns;   // time spent formatting
+  unsigned long long write_ns;    // time spent in handlers
+  unsigned long long lockwait_ns; // time waiting on logmutex and filemutex
+};
+
+// Per-thread counters. Only the owning thread writes them, so updates are
+// plain relaxed stores. Readers sum all threads
+//
+// The first LOGGER_STATS counters are also kept per logger, by the slot
+// the logger holds while it lives, in blocks of LOGGER_STATS_BLOCK slots
+// allocated on first use. So is the SAMPLE_EVERY count of the thread,
+// which only the thread reads
+//
+enum statcounter_t { STAT_EMITTED,
+                     STAT_FILTERED,
+                     STAT_DROPPED,
+                     STAT_SUPPRESSED,
+                     STAT_SAMPLED,
+                     STAT_BYTES,
+                     STAT_FLUSHES,
+                     STAT_FORMAT_NS,
+                     STAT_WRITE_NS,
+                     STAT_LOCKWAIT_NS,
+                     STAT_COUNTERS };
+
+#define LOGGER_STATS (STAT_SAMPLED + 1)
+
+struct LoggerStatsBlock {
+  std::atomic<unsigned long long> counter[LOGGER_STATS_BLOCK][LOGGER_STATS];
+  unsigned long                   samples[LOGGER_STATS_BLOCK];
+};
+
+struct ThreadStats {
+  std::atomic<unsigned long long> counter[STAT_COUNTERS];
+  std::atomic<LoggerStatsBlock*>  loggers[LOGGER_STATS_BLOCKS];
+  unsigned long                   samples;   // loggers without a slot
+  //
+  ThreadStats();
+  ~ThreadStats();
+  // this thread's counters
+  static ThreadStats& get();
+  // logger slots. A new slot starts with the counts left by its previous
+  // holders as 'base'. Return -1 if none is free
+  static int acquire_slot(unsigned long long base[LOGGER_STATS]);
+  static void release_slot(int slot);
+  static void logger_totals(int slot, unsigned long long total[LOGGER_STATS]);
+  // fork() stages of the thread registry
+  static void atfork(int stage);
+  //
+  void add(statcounter_t c, unsigned long long n) {
+    counter[c].store(counter[c].load(std::memory_order_relaxed) + n,
+                     std::memory_order_relaxed);
+  }
+  // and to the counter of the logger in 'slot'
+  void add(statcounter_t c, int slot, unsigned long long n) {
+    add(c, n);
+    if (slot < 0)
+      return;
+    LoggerStatsBlock* block = loggers[slot / LOGGER_STATS_BLOCK].load(
+                                                  std::memory_order_relaxed);
+    if (not block)
+      block = new_block(slot / LOGGER_STATS_BLOCK);
+    std::atomic<unsigned long long>& count =
+                                 block->counter[slot % LOGGER_STATS_BLOCK][c];
+    count.store(count.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+  // records this thread has seen at sampled levels of the logger in
+  // 'slot' before this one
+  unsigned long count_sample(int slot) {
+    if (slot < 0)
+      return samples++;
+    LoggerStatsBlock* block = loggers[slot / LOGGER_STATS_BLOCK].load(
+                                                  std::memory_order_relaxed);
+    if (not block)
+      block = new_block(slot / LOGGER_STATS_BLOCK);
+    return block->samples[slot % LOGGER_STATS_BLOCK]++;
+  }
+  LoggerStatsBlock* new_block(int index);
+};
+
+// A partition of the logger name index
+//
+struct LoggerIndexShard {
+  RWMutex                       mutex;    // shared for lookups
+  std::unordered_map<std::string,
+         std::weak_ptr<LoggerTree> > loggers;
+  std::atomic<size_t>           orphans;  // expired entries, not yet swept
+};
+
+// Non-local variables are defined once in logging.cpp
+//
 namespace logging {
-  static std::thread::id main_thread_id = std::this_thread::get_id();
+  extern std::thread::id main_thread_id;
+  extern thread_local const char* threadname;
+  extern thread_local const LogContext* context;
+  //
+  extern bool autolog;
+  extern int autolevel;
+  extern int autostream;
   //
-  static bool autolog = true;
-  static int autolevel = DEBUG;
-  static int autostream = STDERR;
+  extern std::mutex filemutex;
+  extern RWMutex    logmutex;
+  extern std::mutex fmtmutex;
   //
-  static std::mutex treemutex;
-  static std::mutex filemutex;
-  static std::mutex logmutex;
-  static std::mutex fmtmutex;
+  extern std::atomic<unsigned long> levelgen;
+  //
+  extern std::atomic<bool> stattiming;
+  //
+  extern std::atomic<int> filters;
+  //
+  extern std::atomic<bool> finished;
+  //
+  // a thread object whose thread is gone: no other threads survive fork()
+  // Reset without joining nor detaching
+  inline void forget_thread(std::thread& t) { new (&t) std::thread(); }
+  //
+  extern LoggerIndexShard loggerindex[INDEX_SHARDS];
+  //
+  inline LoggerIndexShard& index_shard(const std::string& name) {
+    return loggerindex[std::hash<std::string>()(name) % INDEX_SHARDS];
+  }
+  //
+  // monotonic time in ns, for timing statistics
+  unsigned long long stats_clock();
+  // absolute path name of a log file, created if missing. Error message
+  // on failure
+  char* absolute_path(const std::string& fname, std::string& path);
 }
 
+// Lock guards that account the wait when timing statistics are on
+//
+template<typename Mutex>
+class TimedLock {
+  private:
+    Mutex& mutex;
+  public:
+    explicit TimedLock(Mutex& m) : mutex(m) {
+      if (not logging::stattiming.load(std::memory_order_relaxed)) {
+        mutex.lock();
+        return;
+      }
+      unsigned long long start = logging::stats_clock();
+      mutex.lock();
+      ThreadStats::get().add(STAT_LOCKWAIT_NS,
+                             logging::stats_clock() - start);
+    }
+    ~TimedLock()                                  { mutex.unlock(); }
+    // Prevent copying (note: delete functions are a C++11 feature)
+    TimedLock(TimedLock const&)            = delete;
+    TimedLock& operator=(TimedLock const&) = delete;
+};
+
+class TimedSharedLock {
+  private:
+    RWMutex& rwmutex;
+  public:
+    explicit TimedSharedLock(RWMutex& m) : rwmutex(m) {
+      if (not logging::stattiming.load(std::memory_order_relaxed)) {
+        rwmutex.lock_shared();
+        return;
+      }
+      unsigned long long start = logging::stats_clock();
+      rwmutex.lock_shared();
+      ThreadStats::get().add(STAT_LOCKWAIT_NS,
+                             logging::stats_clock() - start);
+    }
+    ~TimedSharedLock()                            { rwmutex.unlock_shared(); }
+    // Prevent copying (note: delete functions are a C++11 feature)
+    TimedSharedLock(TimedSharedLock const&)            = delete;
+    TimedSharedLock& operator=(TimedSharedLock const&) = delete;
+};
+
 // The loggerTree and Formatter class
 // 
-class LoggerTree;
 class Formatter;
+class LogQueue;
+class Handler;
+class FileHandler;
+class ShardedHandler;
+class RingHandler;
+class BinaryHandler;
+class NetworkHandler;
+
+// Callables producing a message (Logger::log(level, producer))
+//
+template<typename F, typename Enable = void>
+struct LogProducer;
 
 typedef std::shared_ptr<LoggerTree>     logptr_t;
 typedef LoggerTree&                     logref_t;
@@ -63,6 +449,119 @@ typedef LoggerTree&                     logref_t;
 typedef std::shared_ptr<Formatter>  fmtptr_t;
 typedef Formatter&                  fmtref_t;
 
+// A typed key/value field of a structured record, built by kv()
+// Keys and string values are referenced, not copied: a field must not
+// outlive the call it is passed to
+//
+struct LogField {
+  enum fieldtype_t { FIELD_INT, FIELD_UINT, FIELD_DOUBLE, FIELD_BOOL,
+                     FIELD_STRING };
+  //
+  const char*   key;
+  size_t        keylen;
+  fieldtype_t   type;
+  union {
+    long long           i;
+    unsigned long long  u;
+    double              d;
+    bool                b;
+    struct {
+      const char*       data;
+      size_t            length;
+    } str;
+  } value;
+};
+
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value and
+                               std::is_signed<T>::value, LogField>::type
+kv(const char* key, T value) {
+  LogField f;
+  f.key = key; f.keylen = strlen(key); f.type = LogField::FIELD_INT;
+  f.value.i = value;
+  return f;
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value and
+                               std::is_unsigned<T>::value, LogField>::type
+kv(const char* key, T value) {
+  LogField f;
+  f.key = key; f.keylen = strlen(key); f.type = LogField::FIELD_UINT;
+  f.value.u = value;
+  return f;
+}
+
+inline LogField kv(const char* key, double value) {
+  LogField f;
+  f.key = key; f.keylen = strlen(key); f.type = LogField::FIELD_DOUBLE;
+  f.value.d = value;
+  return f;
+}
+
+inline LogField kv(const char* key, bool value) {
+  LogField f;
+  f.key = key; f.keylen = strlen(key); f.type = LogField::FIELD_BOOL;
+  f.value.b = value;
+  return f;
+}
+
+inline LogField kv(const char* key, const char* value, size_t length) {
+  LogField f;
+  f.key = key; f.keylen = strlen(key); f.type = LogField::FIELD_STRING;
+  f.value.str.data   = value ? value : "(null)";
+  f.value.str.length = value ? length : 6;
+  return f;
+}
+
+inline LogField kv(const char* key, const char* value) {
+  return kv(key, value, value ? strlen(value) : 0);
+}
+
+inline LogField kv(const char* key, const std::string& value) {
+  return kv(key, value.data(), value.size());
+}
+
+// Mapped diagnostic context
+//
+// A thread-local stack of key/value fields. LogScope objects push fields
+// for as long as they live. Records carry the context of the thread that
+// created them, also through the asynchronous queue: '%X{key}' renders a
+// field, '%X' all of them, and JSON and logfmt records add them after
+// the message. Values are encoded when pushed, for every output mode, so
+// that records only copy them
+//
+struct LogContext : std::enable_shared_from_this<LogContext> {
+  std::shared_ptr<const LogContext> parent;  // enclosing fields, if any
+  std::string   key;
+  std::string   value;        // as rendered by %X{key}
+  std::string   jsonpair;     // "key":value
+  std::string   logfmtpair;   // key=value
+  // the whole context, outermost first. Inner fields hide outer fields
+  // with the same key
+  std::string   json;         // ,"key":value,"key":value
+  std::string   logfmt;       // key=value key=value, as rendered by %X
+};
+
+// Pushes fields on the context of the calling thread, popped when the
+// scope ends: LogScope scope { kv("req", id), kv("tenant", name) };
+// Scopes must end in the reverse order of creation, on the same thread
+//
+class LogScope {
+  private:
+    std::shared_ptr<const LogContext> top;  // innermost field pushed
+    const LogContext* saved;                // context on entry
+    //
+    void push(const LogField& field);
+  public:
+    LogScope(const LogField& field);
+    LogScope(std::initializer_list<LogField> fields);
+    ~LogScope();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    LogScope(LogScope const&)            = delete;
+    LogScope& operator=(LogScope const&) = delete;
+};
+
 class Logger {
   private:
     // members
@@ -70,6 +569,11 @@ class Logger {
     // Constructor
     Logger();
     Logger(const std::string& module);
+    // add_handler() with the formatter ready (internal)
+    int attach_handler(int kind, const std::string& target, int level,
+                       fmtptr_t formatter);
+    // swap in the settings of a configuration file (internal)
+    static int apply_config(const std::shared_ptr<LogConfig>& config);
   public:
     // destructor
     ~Logger();
@@ -91,25 +595,310 @@ class Logger {
     void warning(const char* format, ...);
     void info(const char* format, ...);
     void debug(const char* format, ...);
+    // Structured records. A plain message, not a format, and one or more
+    // fields: logger.info("login", kv("user", id), kv("ms", elapsed))
+    template<typename... Fields>
+    void log(int level, const char* message,
+             const LogField& field, const Fields&... fields);
+    template<typename... Fields>
+    void critical(const char* message,
+                  const LogField& field, const Fields&... fields);
+    template<typename... Fields>
+    void error(const char* message,
+               const LogField& field, const Fields&... fields);
+    template<typename... Fields>
+    void warning(const char* message,
+                 const LogField& field, const Fields&... fields);
+    template<typename... Fields>
+    void info(const char* message,
+              const LogField& field, const Fields&... fields);
+    template<typename... Fields>
+    void debug(const char* message,
+               const LogField& field, const Fields&... fields);
+    // Lazy messages. 'message' is called, and returns a string or a C
+    // string, only for records that pass the level, sampling and rate
+    // limit checks: logger.debug([&] { return dump(state); })
+    template<typename Producer>
+    typename LogProducer<Producer>::type log(int level,
+                                             const Producer& message);
+    template<typename Producer>
+    typename LogProducer<Producer>::type critical(const Producer& message);
+    template<typename Producer>
+    typename LogProducer<Producer>::type error(const Producer& message);
+    template<typename Producer>
+    typename LogProducer<Producer>::type warning(const Producer& message);
+    template<typename Producer>
+    typename LogProducer<Producer>::type info(const Producer& message);
+    template<typename Producer>
+    typename LogProducer<Producer>::type debug(const Producer& message);
+    // Deferred formatting. Arguments are captured, rendered in async mode
+    // by the writer thread. 'format' must have static storage duration
+    template<typename... Args>
+    void deferred(int level, const char* format, const Args&... args);
     // Get/set current log level
     int get_loglevel();
     int set_loglevel(int level);
     int get_effective_loglevel();
+    bool is_enabled_for(int level);
     // Select log file and streamer
-    int set_logfile(const std::string& fname);
+    int set_logfile(const std::string& fname,
+                    size_t bufsize=DEFAULT_FILE_BUFSIZE,
+                    int flushlevel=DEFAULT_FLUSH_LEVEL,
+                    int interval=DEFAULT_FLUSH_INTERVAL,
+                    int sharding=SHARD_NONE);
+    int set_rotation(size_t maxsize, int maxage=0,
+                     int keep=DEFAULT_ROTATE_KEEP, int compress=COMPRESS_NONE);
+    int set_ringfile(const std::string& fname,
+                     size_t size=DEFAULT_RING_SIZE);
+    int set_binfile(const std::string& fname,
+                    size_t bufsize=DEFAULT_FILE_BUFSIZE,
+                    int flushlevel=DEFAULT_FLUSH_LEVEL,
+                    int interval=DEFAULT_FLUSH_INTERVAL);
+    int set_netsink(const std::string& address, int protocol=NET_UDP,
+                    int facility=DEFAULT_NET_FACILITY,
+                    size_t queuesize=DEFAULT_NET_QUEUE);
     std::ostream* get_streamer();
     std::ostream* set_streamer(int streamval);
     std::ostream* set_streamer(std::ostream* streamer);
+    // Longest record written by the selected handlers
+    size_t set_max_record(size_t length, int handlers=HANDLER_ALL);
+    // Lowest level written by the selected handlers
+    int set_handler_level(int level, int handlers=HANDLER_ALL);
+    // Handler chain. More handlers, each with a level and formatter of
+    // its own. 'kind' is one of HANDLER_*
+    int add_handler(int kind, const std::string& target, int level=NOTSET);
+    int add_handler(int kind, const std::string& target, int level,
+                    const Formatter& formatter);
+    int remove_handler(int kind, const std::string& target);
     // Control tree navigation
     bool set_propagation(bool mode);
+    // Rate limiting and duplicate suppression
+    double set_rate_limit(double rate, double burst=0);
+    double set_site_rate_limit(double rate, double burst=0);
+    bool set_suppression(bool mode, int interval=DEFAULT_REPEAT_INTERVAL);
+    // Sampling of records at or below 'level'
+    int set_sampling(int level, double rate, int mode=SAMPLE_RANDOM);
+    // Asynchronous delivery
+    static bool get_async();
+    static bool set_async(bool mode,
+                          size_t capacity=DEFAULT_QUEUE_CAPACITY,
+                          int overflow=OVERFLOW_BLOCK, int droplevel=WARNING);
     // Auto log
     static bool get_autolog();
     static bool set_autolog(bool mode);
     static bool set_autolog_level(int level);
     static bool set_autolog_streamer(int stream);
+    // Name of the calling thread, for '%q'
+    static std::string get_thread_name();
+    static std::string set_thread_name(const std::string& name);
+    // Statistics
+    LogStats stats();
+    static LogStats global_stats();
+    static bool set_stats_timing(bool mode);
+    // Lifecycle
+    static bool flush_all(int timeout=DEFAULT_DRAIN_TIMEOUT);
+    static bool shutdown(int timeout=DEFAULT_DRAIN_TIMEOUT);
+    static bool set_crash_handler(bool mode);
+    static void emergency_drain();
+    // Configuration files. The settings of a file are applied at once.
+    // Reloading returns those the file no longer gives to their defaults
+    static int load_config(const std::string& path);
+    static int reload_config();
+    static std::shared_ptr<const LogConfig> get_config();
+    static bool set_config_reload(bool mode);
 };
     
-class LoggerTree {
+// A growable byte buffer reused across records
+//
+// Records are formatted into per-thread buffers and handed to the
+// handlers as (data, size) slices. Capacity is kept on clear()
+//
+#define LOGBUFFER_CAPACITY 1024
+
+class LogBuffer {
+  private:
+    char*   buf;        // storage
+    size_t  len;        // bytes in use
+    size_t  cap;        // allocated bytes
+  public:
+    LogBuffer(size_t capacity=LOGBUFFER_CAPACITY);
+    ~LogBuffer();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    LogBuffer(LogBuffer const&)            = delete;
+    LogBuffer& operator=(LogBuffer const&) = delete;
+    //
+    const char* data() const { return buf; }
+    size_t size() const      { return len; }
+    size_t capacity() const  { return cap; }
+    void clear()             { len = 0; }
+    void swap(LogBuffer& other) {
+      std::swap(buf, other.buf);
+      std::swap(len, other.len);
+      std::swap(cap, other.cap);
+    }
+    void truncate(size_t n)  { if (n < len) len = n; }
+    void commit(size_t n)    { len += n; }
+    //
+    void reserve(size_t n);
+    void trim(size_t limit);
+    char* tail(size_t room);
+    void append(const char* s, size_t n);
+    void append(const char* s);
+    void append(const std::string& s);
+    void append(char c);
+};
+
+// Renders a message from a format and its captured arguments
+//
+typedef void (*logrender_t)(LogBuffer& out,
+                            const char* format, const char* args);
+
+// Appends the message of a lazy record (Logger::log(level, producer))
+//
+typedef void (*logproduce_t)(LogBuffer& out, const void* producer);
+
+// A log record as it travels from the caller to the handlers
+// Neither the message nor the arguments are owned by the record. When
+// 'render' is set the message is still to be rendered from 'args'
+//
+struct LogRecord {
+  int              level;        // record level
+  const char*      message;      // user message, already formatted
+  size_t           msglen;       // message length
+  struct timespec  stamp;        // creation time (CLOCK_REALTIME)
+  std::thread::id  tid;          // thread that created the record
+  const char*      threadname;   // its name (set_thread_name), null if none
+  const LogContext* context;     // its diagnostic context, null if none
+  const char*      format;       // message format
+  const char*      args;         // captured arguments, null if none
+  size_t           argslen;      // captured arguments length
+  const char*      argtypes;     // captured argument types (LogArg tags)
+  logrender_t      render;       // deferred rendering, if not null
+  const LogField*  fields;       // structured record fields, if any
+  size_t           nfields;
+  //
+  LogRecord(int level=NOTSET);
+};
+
+// A handler added to a logger with Logger::add_handler(). Records below
+// 'level' are skipped before they are rendered
+//
+struct LogTarget {
+  Handler*     handler;        // owned by the logger
+  int          kind;           // HANDLER_*
+  std::string  name;           // file name, network address or stream
+  int          level;          // lowest level written
+  fmtptr_t     formatter;      // null: the logger formatter
+};
+
+// Log file rotation settings (Logger::set_rotation)
+//
+struct LogRotation {
+  size_t  maxsize;      // rotate before growing past this size. Zero: none
+  int     maxage;       // rotate files open longer than this (s). Zero: none
+  int     keep;         // rotated segments kept. Zero: all
+  int     compress;     // COMPRESS_NONE, COMPRESS_GZIP or COMPRESS_ZSTD
+};
+
+// A logger as described by a configuration file. 'set' tells the settings
+// given by the file (CONFIG_*) and 'handlerset' the handler levels
+// (HANDLER_*). The others are left alone
+//
+struct LoggerConfig {
+  std::string  name;            // full name, empty for the root logger
+  unsigned     set;
+  int          level;
+  bool         propagate;
+  int          stream;          // STDOUT, STDERR, STDLOG, FD_* or DEVNULL
+  std::string  recfmt;          // formatter
+  std::string  timefmt;
+  int          mode;
+  std::string  logfile;         // as in set_logfile(). Empty: none
+  size_t       bufsize;
+  int          flushlevel;
+  int          interval;
+  int          sharding;
+  std::string  ringfile;        // as in set_ringfile()
+  size_t       ringsize;
+  std::string  binfile;         // as in set_binfile()
+  size_t       binbufsize;
+  int          binflushlevel;
+  int          bininterval;
+  std::string  netsink;         // as in set_netsink()
+  int          protocol;
+  int          facility;
+  int          handlerset;
+  int          handlerlevel[HANDLER_KINDS];
+  //
+  LoggerConfig();
+};
+
+// A configuration file, parsed. Immutable once applied: reloading builds
+// a new snapshot, which replaces the current one whole
+//
+struct LogConfig {
+  std::string                path;      // file loaded
+  std::vector<LoggerConfig>  loggers;
+  std::vector<logptr_t>      held;      // loggers configured, kept alive
+  // fork() stages of the SIGHUP reloader (internal)
+  static void atfork(int stage);
+};
+
+// Rate limiting and duplicate suppression
+//
+// Rate limits are token buckets, one for the logger and one per call site
+// (the address of the format string), checked before the message is
+// formatted. A run of identical consecutive records is reduced to its
+// first record and a "last message repeated N times" summary
+//
+class LogFilter {
+  private:
+    struct bucket {
+      double tokens;             // records that may pass right now
+      double stamp;              // last refill (seconds)
+    };
+    std::mutex     fmutex;       // protect filter state
+    std::atomic<bool> limiting;  // a rate is set. Checked before fmutex
+    double         rate;         // records per second. Zero: no limit
+    double         burst;        // bucket size
+    bucket         total;        // logger bucket
+    double         siterate;     // same, per call site
+    double         siteburst;
+    std::unordered_map<const char*, bucket> sites;
+    unsigned long  limited;      // discarded since the last admitted record
+    std::atomic<bool> suppress;  // collapse repeated records. Checked
+                                 // before fmutex
+    int            interval;     // summarize runs longer than this (ms)
+    int            lastlevel;    // last record seen
+    const char*    lastformat;
+    std::string    lastdata;     // its message or captured arguments
+    unsigned long  repeats;      // repetitions not yet summarized
+    double         runstart;     // start of the repetitions (seconds)
+    //
+    static double now();
+    static bool take(bucket& b, double rate, double burst, double stamp);
+  public:
+    LogFilter();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    LogFilter(LogFilter const&)            = delete;
+    LogFilter& operator=(LogFilter const&) = delete;
+    // settings. Return the previous rate or mode
+    double set_rate(double rate, double burst);
+    double set_site_rate(double rate, double burst);
+    bool set_suppression(bool mode, int interval,
+                         unsigned long& repeats, int& level);
+    // Rate limits. Return false to discard the record. 'discarded' gets
+    // the records discarded since the last one admitted
+    bool admit(const char* format, unsigned long& discarded);
+    // Duplicate suppression. Return false to discard the record. A
+    // non-zero 'repeats' calls for a summary at 'level' before anything
+    // else
+    bool unique(int level, const char* format, const char* data,
+                size_t length, unsigned long& repeats, int& replevel);
+    void atfork(int stage);
+};
+
+class LoggerTree : public std::enable_shared_from_this<LoggerTree> {
   private:
     // local typedefs
     //
@@ -121,13 +910,43 @@ class LoggerTree {
     std::string    modname;      // Module name
     bool           isroot;       // Identifies root logger
     int            loglevel;     // Current log level
-    std::ofstream* logfile;      // File stream for the log file
+    std::atomic<unsigned long> levelcache; // Effective level and generation
+    FileHandler*   logfile;      // Handler for the log file
+    ShardedHandler* shardfile;   // Or for the sharded log file
+    int            sharding;     // Its SHARD_* mode
     std::string    filename;     // Active log file
+    LogRotation    rotation;     // Log file rotation settings
+    RingHandler*   ringfile;     // Handler for the memory mapped ring
+    std::string    ringname;     // Active ring file
+    BinaryHandler* binfile;      // Handler for the binary log file
+    std::string    binname;      // Active binary log file
+    NetworkHandler* netsink;     // Handler for the network sink
+    std::string    netaddr;      // Active network sink address
     std::ostream*  outstream;    // Pointer to output stream
+    int            outfd;        // Or descriptor (FD_STDOUT, FD_STDERR), -1
+    size_t         recordmax[HANDLER_KINDS]; // Record size limits, by handler
+                                 // bit position (HANDLER_*). Zero: none
+    int            handlerlevel[HANDLER_KINDS]; // Lowest level written, by
+                                 // handler bit position. NOTSET: all
+    std::vector<LogTarget> chain; // Added handlers (add_handler)
     fmtptr_t       formatter;    // Pointer to formatter 
     bool           propagate;    // Continue the search upwards to the root
+    LogFilter*     filter;       // Rate limits and duplicate suppression
     logptr_t       parent;       // logger's ancestor
     std::map<std::string, logwptr_t> dict;      // Loggers Dictionary
+    std::mutex     dictmutex;    // protect 'dict'
+    std::atomic<size_t> orphans; // expired entries in 'dict', not yet swept
+    // statistics. Record counts are kept per thread, by 'statslot', and
+    // start from 'statbase'. Bytes written to 'outstream' are kept here
+    int            statslot;
+    unsigned long long statbase[LOGGER_STATS];
+    // sampling. Records at or below 'samplelevel' are kept when a per-thread
+    // random number is below 'samplethreshold' or, if 'sampleevery' is set,
+    // one out of every 'sampleevery' a thread creates
+    std::atomic<int>                samplelevel;
+    std::atomic<unsigned long long> samplethreshold;
+    std::atomic<unsigned long>      sampleevery;
+    std::atomic<unsigned long long> streambytes;
     // Constructor
     LoggerTree();
     LoggerTree(const std::string& module);
@@ -137,19 +956,766 @@ class LoggerTree {
                                         const std::string& module);
     // Formatter manipulation using pointers (internal)
     static fmtptr_t get_def_formatter();
+    // Asynchronous queue. Null in synchronous mode (internal)
+    static std::shared_ptr<LogQueue>& get_async_queue();
+    // Configuration file in effect. Null if none (internal)
+    static std::shared_ptr<const LogConfig>& get_config();
     // logging record creation
     int get_effective_loglevel();
+    int update_effective_loglevel();
+    static void invalidate_loglevels();
     void autolog(int level, const char* format, ...);
     void logaux(int level, const char* format, va_list args);
+    void logcaptured(int level, const char* format, const char* argtypes,
+                     logrender_t render, const LogBuffer& args);
+    void logfields(int level, const char* message,
+                   const LogField* fields, size_t nfields);
+    void loglazy(int level, const char* site, logproduce_t produce,
+                 const void* producer);
+    void dispatch(LogRecord& record);
+    void count_filtered();
+    // rate limits and duplicate suppression (internal)
+    LogFilter* get_filter();
+    LogFilter* make_filter();
+    bool rate_limited(LogFilter* filter, int level, const char* format);
+    bool repeated(LogFilter* filter, int level, const char* format,
+                  const char* data, size_t length);
+    void notice(int level, const char* format, ...);
+    void count_suppressed();
+    // sampling (internal). Return false to discard the record
+    bool sampled(int level) {
+      return level > samplelevel.load(std::memory_order_relaxed) or sample();
+    }
+    bool sample();
+    void deliver(const LogRecord& record);
+    // Records to descriptors are gathered between these and written at
+    // once, by the asynchronous writer (internal)
+    static void begin_batch();
+    static void end_batch();
+    static LogBuffer& capture_buffer();
   public:
     //
     ~LoggerTree();
-    // Default copy constructor required for Logger creation and passing
-    LoggerTree(LoggerTree const&) = default;
-    // Prevent assignment (note: delete functions are a C++11 feature)
-    LoggerTree& operator=(LoggerTree const&) = default;
+    // Prevent copying (note: delete functions are a C++11 feature)
+    LoggerTree(LoggerTree const&)            = delete;
+    LoggerTree& operator=(LoggerTree const&) = delete;
     //
     friend class Logger;
+    friend class LogQueue;
+    //
+    // fork() stages of the logger tree, its dictionaries top down and the
+    // name index, and of the filters of its loggers, under logmutex
+    static void tree_atfork(int stage);
+    static void filters_atfork(int stage);
+};
+
+// Handlers
+//
+// A handler is the final destination of rendered records
+// Handlers are called concurrently, with logging::logmutex held shared,
+// and serialize their own output
+//
+class Handler {
+  protected:
+    std::mutex hmutex;               // protect handler output
+    std::atomic<unsigned long long> nbytes;    // bytes written
+    std::atomic<unsigned long long> nflushes;  // buffer flushes
+    // account output. Caller serializes updates (hmutex)
+    void count_bytes(size_t n);
+  public:
+    Handler() : nbytes(0), nflushes(0) {}
+    virtual ~Handler() {}
+    //
+    unsigned long long bytes()   { return nbytes.load(std::memory_order_relaxed); }
+    unsigned long long flushes() { return nflushes.load(std::memory_order_relaxed); }
+    //
+    virtual void emit(const char* record, size_t length, int level) = 0;
+    virtual void flush() {}
+    // fork() stages (FORK_*). Lock at FORK_PREPARE, unlock in the parent,
+    // reset and unlock in the child
+    virtual void atfork(int stage) {}
+    // write out pending output taking no locks. Async-signal-safe
+    virtual void emergency_drain() {}
+    // handlers reached by Logger::flush_all(), fork() and emergency_drain()
+    // Enlisted when ready, delisted first thing on destruction
+    static void enlist(Handler* handler);
+    static void delist(Handler* handler);
+    // cut a record to 'limit' bytes, marking the cut
+    static size_t clip(const char*& record, size_t length, size_t limit,
+                       LogBuffer& out);
+    // write to a stream shared with other loggers
+    static void stream_write(std::ostream* os,
+                             const char* record, size_t length);
+    // same for a descriptor, in one writev(2) if possible. At most
+    // IOV_MAX pieces, which are updated as they get written
+    static void fd_write(int fd, struct iovec* iov, int iovcnt);
+};
+
+// Output stream in a handler chain (Logger::add_handler)
+//
+class StreamHandler : public Handler {
+  private:
+    std::ostream*   os;           // cout, cerr or clog
+  public:
+    StreamHandler(std::ostream* os) : os(os) {}
+    // Prevent copying (note: delete functions are a C++11 feature)
+    StreamHandler(StreamHandler const&)            = delete;
+    StreamHandler& operator=(StreamHandler const&) = delete;
+    //
+    void emit(const char* record, size_t length, int level);
+};
+
+// Buffered log file
+//
+// Records are collected in a buffer of 'bufsize' bytes and written out
+// when the buffer fills up, when a record at 'flushlevel' or above
+// arrives, every 'interval' milliseconds and when the handler is closed
+//
+// With a rotation policy the file is renamed to a timestamped segment and
+// reopened before it grows past 'maxsize' or gets older than 'maxage'.
+// Writers only wait for the rename and reopen; closing, compressing and
+// pruning old segments is left to a background thread
+//
+class FileHandler : public Handler {
+  private:
+    std::string     path;         // file name
+    std::atomic<int> fd;          // file descriptor, -1 if not open. Only
+                                  // changes on rotation, under hmutex
+    int             openerr;      // errno of a failed open(2), else zero
+    LogBuffer       buffer;       // pending output
+    size_t          bufsize;      // flush threshold. Zero: write through
+    int             flushlevel;   // flush at this record level or above
+    int             interval;     // flush period (ms). Zero: disabled
+    struct timespec lastflush;    // time of last flush (CLOCK_MONOTONIC)
+    LogRotation     rotation;     // rotation policy
+    size_t          written;      // bytes in the current file
+    time_t          opened;       // when the current file was started
+    //
+    bool rotation_due(size_t length);
+    void rotate_locked();
+  protected:
+    void write_out(const char* data, size_t length);
+    void flush_locked();
+    void emit_locked(const char* record, size_t length, int level);
+  public:
+    FileHandler(const std::string& fname, size_t bufsize,
+                int flushlevel, int interval);
+    ~FileHandler();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    FileHandler(FileHandler const&)            = delete;
+    FileHandler& operator=(FileHandler const&) = delete;
+    //
+    bool is_open() { return fd >= 0; }
+    int open_error() { return openerr; }
+    void set_policy(size_t bufsize, int flushlevel, int interval);
+    void set_rotation(const LogRotation& rotation);
+    void emit(const char* record, size_t length, int level);
+    void flush();
+    void flush_if_due(const struct timespec& now);
+    void atfork(int stage);
+    void emergency_drain();
+    void emergency_write(const char* data, size_t length);
+    // background threads shared by file handlers, at fork() stages
+    static void workers_atfork(int stage);
+};
+
+// Sharded log file
+//
+// Callers append records to the stage of the CPU, or NUMA node, they run
+// on: a buffer behind a mutex of its own, on cache lines of its own, so
+// that threads on different shards share no state. A writer thread hands
+// the stages over every 'interval' ms, as soon as a stage grows past
+// SHARD_STAGE_SIZE or takes a record at 'flushlevel' or above, to
+// 'fname' for shard 0 and 'fname.N' for the others or, with SHARD_MERGE,
+// to 'fname' alone, in time stamp order. Callers finding their stage at
+// SHARD_STAGE_MAX hand the stages over themselves
+//
+// The files are FileHandler objects, buffered and rotated as usual.
+// They are reached through the sharded handler only, which locks them
+// after its own mutexes at fork()
+//
+class ShardedHandler : public Handler {
+  private:
+    struct staged {
+      struct timespec stamp;      // record creation time
+      size_t          offset;     // position in the stage
+      size_t          length;
+    };
+    struct mergeitem {
+      struct timespec stamp;
+      const char*     data;
+      size_t          length;
+    };
+    struct shard;
+    //
+    int             sharding;     // SHARD_* mode
+    int             flushlevel;   // wake the writer at this level
+    int             interval;     // writer period (ms)
+    std::vector<int> shardof;     // shard of every CPU
+    size_t          nshards;
+    shard*          shards;       // cache line aligned array
+    std::vector<FileHandler*> files; // one per shard, or one if merged
+    std::mutex      cyclemutex;   // serialize hand-overs
+    std::vector<mergeitem> merged; // records in merge order (cyclemutex)
+    LogBuffer       mergebuf;     // and their text
+    std::mutex      wmutex;       // protect 'running'
+    std::condition_variable wake; // records waiting
+    std::atomic<bool> pending;    // a stage asked for the writer
+    bool            running;
+    std::thread     writer;
+    //
+    size_t current_shard();
+    void cycle();
+    void run();
+  public:
+    ShardedHandler(const std::string& fname, size_t bufsize,
+                   int flushlevel, int interval, int sharding);
+    ~ShardedHandler();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    ShardedHandler(ShardedHandler const&)            = delete;
+    ShardedHandler& operator=(ShardedHandler const&) = delete;
+    //
+    bool is_open();
+    int open_error();
+    size_t shard_count() { return nshards; }
+    unsigned long long file_bytes();
+    unsigned long long file_flushes();
+    void set_policy(size_t bufsize, int flushlevel, int interval);
+    void set_rotation(const LogRotation& rotation);
+    void emit(const char* record, size_t length, int level);
+    void emit(const char* record, size_t length, int level,
+              const struct timespec& stamp);
+    void flush();
+    void atfork(int stage);
+    void emergency_drain();
+};
+
+// Memory mapped ring file
+//
+// A preallocated file of RING_HEADER_SIZE + 'size' bytes mapped in memory
+// Records are copied in with no system call and wrap around when the ring
+// is full, so the file always holds the latest 'size' bytes of output
+// Writers reserve space with an atomic add on the header cursor and
+// commit in reservation order; the committed cursor marks the end of
+// valid data for readers. An existing ring of the same size is continued
+//
+class RingHandler : public Handler {
+  private:
+    struct ringheader;
+    //
+    int             fd;           // file descriptor, -1 if not open
+    int             openerr;      // errno of a failed open, else zero
+    ringheader*     header;       // mapping of the whole file
+    char*           data;         // ring data area
+    size_t          size;         // ring data size
+  public:
+    RingHandler(const std::string& fname, size_t size);
+    ~RingHandler();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    RingHandler(RingHandler const&)            = delete;
+    RingHandler& operator=(RingHandler const&) = delete;
+    //
+    bool is_open() { return header != nullptr; }
+    int open_error() { return openerr; }
+    size_t get_size() { return size; }
+    void emit(const char* record, size_t length, int level);
+    // write the ring contents, oldest first, to a file descriptor
+    static int dump(const std::string& fname, int outfd);
+};
+
+// Binary log file
+//
+// Records are written unrendered: varint encoded timestamp, level, logger
+// and thread ids, then the message text or, for deferred records, the
+// format id and the captured arguments. Logger names and formats are
+// written once per session and referred to by id afterwards. Buffering
+// and flushing work as in FileHandler. 'logdecode' renders the records
+// with any record format
+//
+class BinaryHandler : public FileHandler {
+  private:
+    enum bintag_t { BIN_SESSION,        // magic, pid, ppid
+                    BIN_NAME,           // id, logger name
+                    BIN_FORMAT,         // id, format, argument types
+                    BIN_TEXT,           // record header, message
+                    BIN_CAPTURED };     // record header, format id, arguments
+    //
+    LogBuffer       scratch;      // record being encoded
+    bool            forked;       // in a fork() child. Left to the parent
+    long long       lastsec;      // previous record time (seconds)
+    std::map<std::string, unsigned long> names;           // interned names
+    std::map<std::pair<const char*, const char*>,
+             unsigned long> formats;                       // interned formats
+    //
+    unsigned long intern_name(const std::string& name);
+    unsigned long intern_format(const char* format, const char* argtypes);
+    void encode_header(int tag, const LogRecord& rec, unsigned long nameid);
+  public:
+    BinaryHandler(const std::string& fname, size_t bufsize,
+                  int flushlevel, int interval);
+    // Prevent copying (note: delete functions are a C++11 feature)
+    BinaryHandler(BinaryHandler const&)            = delete;
+    BinaryHandler& operator=(BinaryHandler const&) = delete;
+    //
+    void emit(const char* record, size_t length, int level);
+    void emit_record(const LogRecord& rec, const std::string& name);
+    void atfork(int stage);
+    // render the records in a binary log file to a file descriptor
+    static int decode(const std::string& fname, int outfd,
+                      const std::string& recfmt  = DEFAULT_RECORDFMT,
+                      const std::string& timefmt = DEFAULT_TIMEFMT);
+};
+
+// Network sink
+//
+// Records are framed as RFC 5424 syslog messages, timestamp, host, program,
+// pid and logger name in the header, and appended to a bounded queue
+// Callers never wait on the network: records that do not fit in the queue
+// are dropped. A sender thread per handler takes the whole queue at once
+// and writes it with a single send() over TCP, or sendmmsg() calls of up to
+// NET_BATCH_SIZE datagrams over UDP, reconnecting with backoff on errors
+//
+class NetworkHandler : public Handler {
+  private:
+    std::string     host;         // collector address
+    std::string     port;
+    int             protocol;     // NET_UDP or NET_TCP
+    int             facility;     // syslog facility
+    size_t          queuesize;    // bytes waiting to be sent, at most
+    std::string     hostname;     // header fields
+    std::string     appname;
+    long            pid;
+    int             sock;         // sender thread only. -1 if not connected
+    LogBuffer       queue[2];     // records being queued and being sent
+    std::vector<size_t> ends[2];  // end offset of every record in the queue
+    int             filling;      // queue the callers append to
+    bool            running;      // cleared on shutdown
+    bool            busy;         // sender has a queue out
+    std::condition_variable wake; // records queued or shutdown (hmutex)
+    std::condition_variable idle; // a queue has been sent (hmutex)
+    std::atomic<unsigned long long> ndrops;   // records dropped
+    std::thread     sender;       // sender thread
+    //
+    void run();
+    bool connect_socket();
+    size_t send_queue(const LogBuffer& data, const std::vector<size_t>& bounds);
+    void frame(LogBuffer& out, int level, const struct timespec& stamp,
+               const std::string& name, const char* message, size_t length);
+    void enqueue(const LogBuffer& framed);
+  public:
+    NetworkHandler(const std::string& address, int protocol, int facility,
+                   size_t queuesize);
+    ~NetworkHandler();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    NetworkHandler(NetworkHandler const&)            = delete;
+    NetworkHandler& operator=(NetworkHandler const&) = delete;
+    //
+    bool is_open() { return not port.empty(); }
+    int get_protocol() { return protocol; }
+    int get_facility() { return facility; }
+    unsigned long long drops() { return ndrops.load(std::memory_order_relaxed); }
+    void emit(const char* record, size_t length, int level);
+    void emit_record(const LogRecord& rec, const std::string& name);
+    void flush();
+    void atfork(int stage);
+};
+
+// Effective level fast path
+//
+// levelcache packs the effective level in the low LEVELCACHE_BITS and the
+// value of logging::levelgen it was computed at in the rest. Any change in
+// levels or in the tree bumps levelgen and so invalidates every cache
+// A cache hit costs two relaxed loads and takes no lock
+//
+#define LEVELCACHE_BITS 8
+
+inline int LoggerTree::get_effective_loglevel() {
+  //
+  unsigned long cached = levelcache.load(std::memory_order_relaxed);
+
+  if ((cached >> LEVELCACHE_BITS) ==
+                         logging::levelgen.load(std::memory_order_relaxed))
+    return cached & ((1UL << LEVELCACHE_BITS) - 1);
+
+  return update_effective_loglevel();
+}
+
+inline bool Logger::is_enabled_for(int level) {
+  // true if a record at 'level' would get past the level filter
+  //
+  return level >= treeptr->get_effective_loglevel();
+}
+
+// Logging macros
+//
+// Arguments are not evaluated unless the level is enabled. Levels below
+// LOGGING_MIN_LEVEL (set at compile time) produce no code at all
+// Note that 'logger' may be evaluated more than once
+//
+//     LOG_DEBUG(logger, "value is %d", expensive());
+//
+#ifndef LOGGING_MIN_LEVEL
+#define LOGGING_MIN_LEVEL NOTSET
+#endif
+
+#define LOG_AT(logger, level, ...)                                        \
+  do {                                                                    \
+    if ((level) >= LOGGING_MIN_LEVEL and (logger).is_enabled_for(level))  \
+      (logger).log((level), __VA_ARGS__);                                 \
+  } while (0)
+
+// compiled out calls keep their arguments type checked and 'used'
+//
+#define LOG_NOTHING(logger, level, ...)                                   \
+  do {                                                                    \
+    if (false)                                                            \
+      (logger).log((level), __VA_ARGS__);                                 \
+  } while (0)
+
+#if LOGGING_MIN_LEVEL <= DEBUG
+#define LOG_DEBUG(logger, ...)    LOG_AT(logger, DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(logger, ...)    LOG_NOTHING(logger, DEBUG, __VA_ARGS__)
+#endif
+
+#if LOGGING_MIN_LEVEL <= INFO
+#define LOG_INFO(logger, ...)     LOG_AT(logger, INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(logger, ...)     LOG_NOTHING(logger, INFO, __VA_ARGS__)
+#endif
+
+#if LOGGING_MIN_LEVEL <= WARNING
+#define LOG_WARNING(logger, ...)  LOG_AT(logger, WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(logger, ...)  LOG_NOTHING(logger, WARNING, __VA_ARGS__)
+#endif
+
+#if LOGGING_MIN_LEVEL <= ERROR
+#define LOG_ERROR(logger, ...)    LOG_AT(logger, ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(logger, ...)    LOG_NOTHING(logger, ERROR, __VA_ARGS__)
+#endif
+
+#define LOG_CRITICAL(logger, ...) LOG_AT(logger, CRITICAL, __VA_ARGS__)
+
+// Deferred argument capture
+//
+// Logger::deferred() copies its arguments into a compact blob: values
+// of arithmetic, enum and pointer types bit by bit, C strings and
+// std::string as their bytes. LogCapture::render<Args...> later reads
+// them back in order and runs the printf-style formatting on them
+//
+template<typename T>
+struct LogArg {
+  static_assert(std::is_arithmetic<T>::value or std::is_enum<T>::value or
+                std::is_pointer<T>::value,
+                "unsupported argument type for deferred logging");
+  typedef T type;
+  // type tag for binary output: pointer, floating point or integer
+  // by size and signedness
+  static constexpr char tag = std::is_pointer<T>::value ? 'p' :
+          std::is_floating_point<T>::value ?
+                 (sizeof(T) == sizeof(float)  ? 'f' :
+                  sizeof(T) == sizeof(double) ? 'd' : 'D') :
+          (std::is_signed<T>::value ? "bh?i???l" : "BH?I???L")[sizeof(T) - 1];
+  //
+  static size_t size(const T&)          { return sizeof(T); }
+  static void store(char*& p, const T& v) {
+    memcpy(p, &v, sizeof(T));
+    p += sizeof(T);
+  }
+  static T load(const char*& p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
+  }
+};
+
+template<>
+struct LogArg<const char*> {
+  typedef const char* type;
+  static constexpr char tag = 's';
+  //
+  static size_t size(const char* s)     { return strlen(s ? s : "(null)") + 1; }
+  static void store(char*& p, const char* s) {
+    size_t n = size(s);
+    memcpy(p, s ? s : "(null)", n);
+    p += n;
+  }
+  static const char* load(const char*& p) {
+    const char* s = p;
+    p += strlen(s) + 1;
+    return s;
+  }
+};
+
+template<>
+struct LogArg<char*> : LogArg<const char*> {};
+
+template<>
+struct LogArg<std::string> : LogArg<const char*> {
+  static size_t size(const std::string& s)      { return s.size() + 1; }
+  static void store(char*& p, const std::string& s) {
+    memcpy(p, s.c_str(), s.size() + 1);
+    p += s.size() + 1;
+  }
+};
+
+class LogCapture {
+  private:
+    // read the arguments back one at a time, in order
+    //
+    template<typename... Rest>
+    struct unpack;
+  public:
+    template<typename... Args>
+    static size_t size(const Args&... args);
+    template<typename... Args>
+    static void store(char* p, const Args&... args);
+    template<typename... Args>
+    static void render(LogBuffer& out, const char* format, const char* args);
+    template<typename... Args>
+    static const char* argtypes();
+    // printf-style formatting of the unpacked arguments
+    static void format(LogBuffer& out, const char* format, ...);
+};
+
+template<>
+struct LogCapture::unpack<> {
+  template<typename... Loaded>
+  static void render(LogBuffer& out, const char* format, const char*,
+                     Loaded... loaded) {
+    LogCapture::format(out, format, loaded...);
+  }
+};
+
+template<typename T, typename... Rest>
+struct LogCapture::unpack<T, Rest...> {
+  template<typename... Loaded>
+  static void render(LogBuffer& out, const char* format, const char* p,
+                     Loaded... loaded) {
+    typename LogArg<T>::type value = LogArg<T>::load(p);
+    unpack<Rest...>::render(out, format, p, loaded..., value);
+  }
+};
+
+template<typename... Args>
+inline size_t LogCapture::size(const Args&... args) {
+  size_t sizes[] = { 0, LogArg<typename std::decay<Args>::type>::size(args)... };
+  size_t total = 0;
+  for (size_t n : sizes)
+    total += n;
+  return total;
+}
+
+template<typename... Args>
+inline void LogCapture::store(char* p, const Args&... args) {
+  int stored[] = { 0, (LogArg<typename std::decay<Args>::type>::store(p, args), 0)... };
+  (void) stored;
+}
+
+template<typename... Args>
+inline void LogCapture::render(LogBuffer& out,
+                               const char* format, const char* args) {
+  unpack<Args...>::render(out, format, args);
+}
+
+template<typename... Args>
+inline const char* LogCapture::argtypes() {
+  //
+  static const char tags[] = { LogArg<Args>::tag..., '\0' };
+
+  return tags;
+}
+
+template<typename... Args>
+inline void Logger::deferred(int level, const char* format,
+                             const Args&... args) {
+  //
+  if (not is_enabled_for(level)) {
+    treeptr->count_filtered();
+    return;
+  }
+  if (not treeptr->sampled(level))
+    return;
+
+  LogBuffer& blob = LoggerTree::capture_buffer();
+  size_t n = LogCapture::size(args...);
+
+  blob.clear();
+  LogCapture::store(blob.tail(n), args...);
+  blob.commit(n);
+
+  treeptr->logcaptured(level, format,
+                 LogCapture::argtypes<typename std::decay<Args>::type...>(),
+                 &LogCapture::render<typename std::decay<Args>::type...>, blob);
+}
+
+// Lazy messages
+//
+// Callables taking no arguments and returning something convertible to
+// std::string are message producers. Anything else, string literals
+// included, leaves LogProducer without 'type' and the overloads out
+// Each producer type (every lambda has its own) is a call site for rate
+// limits and duplicate suppression
+//
+template<typename F, typename Enable>
+struct LogProducer {};
+
+template<typename F>
+struct LogProducer<F, typename std::enable_if<std::is_convertible<
+                      decltype(std::declval<const F&>()()),
+                      std::string>::value>::type> {
+  typedef void type;
+  //
+  static void produce(LogBuffer& out, const void* producer) {
+    put(out, (*static_cast<const F*>(producer))());
+  }
+  static const char* site() {
+    static const char id = 0;
+    return &id;
+  }
+  static void put(LogBuffer& out, const char* message) {
+    out.append(message ? message : "(null)");
+  }
+  static void put(LogBuffer& out, const std::string& message) {
+    out.append(message);
+  }
+};
+
+template<typename Producer>
+inline typename LogProducer<Producer>::type
+Logger::log(int level, const Producer& message) {
+  //
+  treeptr->loglazy(level, LogProducer<Producer>::site(),
+                   &LogProducer<Producer>::produce, &message);
+}
+
+template<typename Producer>
+inline typename LogProducer<Producer>::type
+Logger::critical(const Producer& message) {
+  log(CRITICAL, message);
+}
+
+template<typename Producer>
+inline typename LogProducer<Producer>::type
+Logger::error(const Producer& message) {
+  log(ERROR, message);
+}
+
+template<typename Producer>
+inline typename LogProducer<Producer>::type
+Logger::warning(const Producer& message) {
+  log(WARNING, message);
+}
+
+template<typename Producer>
+inline typename LogProducer<Producer>::type
+Logger::info(const Producer& message) {
+  log(INFO, message);
+}
+
+template<typename Producer>
+inline typename LogProducer<Producer>::type
+Logger::debug(const Producer& message) {
+  log(DEBUG, message);
+}
+
+// Structured records. The fields are packed in an array on the stack
+//
+template<typename... Fields>
+inline void Logger::log(int level, const char* message,
+                        const LogField& field, const Fields&... fields) {
+  //
+  const LogField packed[] = { field, fields... };
+
+  treeptr->logfields(level, message, packed, 1 + sizeof...(Fields));
+}
+
+template<typename... Fields>
+inline void Logger::critical(const char* message,
+                             const LogField& field, const Fields&... fields) {
+  log(CRITICAL, message, field, fields...);
+}
+
+template<typename... Fields>
+inline void Logger::error(const char* message,
+                          const LogField& field, const Fields&... fields) {
+  log(ERROR, message, field, fields...);
+}
+
+template<typename... Fields>
+inline void Logger::warning(const char* message,
+                            const LogField& field, const Fields&... fields) {
+  log(WARNING, message, field, fields...);
+}
+
+template<typename... Fields>
+inline void Logger::info(const char* message,
+                         const LogField& field, const Fields&... fields) {
+  log(INFO, message, field, fields...);
+}
+
+template<typename... Fields>
+inline void Logger::debug(const char* message,
+                          const LogField& field, const Fields&... fields) {
+  log(DEBUG, message, field, fields...);
+}
+
+// The asynchronous queue
+//
+// A bounded multi-producer, single-consumer ring of records. Callers push
+// records and a dedicated writer thread pops them in batches and hands them
+// over to the logger tree under logging::logmutex
+//
+class LogQueue {
+  private:
+    // an enqueued record and the logger that created it
+    //
+    struct entry {
+      logptr_t    origin;
+      LogRecord   record;
+      std::string text;         // message storage, reused across records
+      std::vector<LogField> fields;     // structured record fields
+      std::string threadname;   // name of the thread, if any
+      std::shared_ptr<const LogContext> context; // diagnostic context
+      std::string fieldtext;    // their keys and strings, one after another
+    };
+    // members
+    std::vector<entry>      ring;        // record slots
+    size_t                  head;        // next slot to pop
+    size_t                  count;       // slots in use
+    int                     overflow;    // overflow policy
+    int                     droplevel;   // threshold for OVERFLOW_DROPLEVEL
+    bool                    running;     // cleared on shutdown
+    unsigned long           dropped;     // records discarded on overflow
+    unsigned long long      pushed;      // records queued so far
+    unsigned long long      delivered;   // records delivered or discarded
+    std::mutex              qmutex;      // protect the ring
+    std::condition_variable notempty;    // signal the writer
+    std::condition_variable notfull;     // signal blocked producers
+    std::condition_variable progress;    // signal a batch delivered
+    std::thread             writer;      // background writer thread
+    // queue reached by the crash handler, the latest created
+    static std::atomic<LogQueue*> active;
+    //
+    void run();
+  public:
+    LogQueue(size_t capacity, int overflow, int droplevel);
+    ~LogQueue();
+    // Prevent copying (note: delete functions are a C++11 feature)
+    LogQueue(LogQueue const&)            = delete;
+    LogQueue& operator=(LogQueue const&) = delete;
+    //
+    bool push(const logptr_t& origin, const LogRecord& record);
+    // wait for the records queued so far. Return false on timeout (ms)
+    bool drain(int timeout);
+    // stop, delivering pending records for up to 'timeout' ms
+    bool stop(int timeout);
+    static void atfork(int stage);
+    // write the messages still queued to 'fd'. Async-signal-safe
+    static void emergency_drain(int fd);
 };
 
 // The Formatter class
@@ -160,28 +1726,92 @@ class Formatter {
     // local typedefs
     //
     typedef std::weak_ptr<Formatter> fmtwptr_t;
+    //
+    // Compiled record format. One operation per expansion or literal run
+    // Literals are (offset, length) spans into 'recordformat'
+    //
+    enum fmtop_t {  FMT_LITERAL,
+                    FMT_TIME,
+                    FMT_MSEC,
+                    FMT_USEC,
+                    FMT_NSEC,
+                    FMT_NAME,
+                    FMT_NAME_COLON,
+                    FMT_TID,
+                    FMT_TID_NOTMAIN,
+                    FMT_THREAD_NAME,
+                    FMT_CONTEXT,
+                    FMT_CONTEXT_ALL,
+                    FMT_PID,
+                    FMT_PPID,
+                    FMT_LEVEL,
+                    FMT_LEVEL_UPPER,
+                    FMT_MESSAGE };
+    struct fmtop {
+      fmtop_t     op;
+      size_t      offset;
+      size_t      length;
+    };
   protected:
+    // Record origin when not the running process (binary log decoding)
+    //
+    struct recorigin {
+      unsigned int  tid;        // thread id as formatted by format_tid()
+      bool          mainthread; // record created by the main thread
+      long          pid;
+      long          ppid;
+    };
     // Private constructors prevent instantiation from outside the class
     //
     Formatter(const std::string& format  = DEFAULT_RECORDFMT,
               const std::string& timefmt = DEFAULT_TIMEFMT,
-              bool eol = true);
+              bool eol = true, int mode = FORMAT_TEXT);
     //
     std::string   recordformat; // Output log record format
     std::string   timeformat;   // Output Time format
     bool          eol;          // Append LF to record
+    int           mode;         // FORMAT_TEXT, FORMAT_JSON or FORMAT_LOGFMT
     fmtptr_t      fmtptr;       // internal pointer used by external view
+    std::vector<fmtop> program; // 'recordformat' compiled
+    unsigned long timeid;       // identifies 'timeformat' in time caches
+    //
+    // Record format compilation
+    //
+    void compile_recfmt();
+    void add_op(fmtop_t op, size_t offset=0, size_t length=0);
     //
     // Formatting
     //
-    static std::string level_to_string(int level, bool uppercase=false);
-    static std::string format_tid();
-    static std::string format_pid();
-    static std::string format_ppid();
-    static std::string format_message(const char* msgfmt, va_list vl);
-    std::string format_time();
-    std::string format_record(std::string& message,
-                              std::string& name, int level);
+    static const char* level_to_string(int level, bool uppercase=false);
+    static void format_tid(LogBuffer& out, std::thread::id tid);
+    static void format_tid(LogBuffer& out, unsigned int tid);
+    static void format_pid(LogBuffer& out);
+    static void format_ppid(LogBuffer& out);
+    static void format_message(LogBuffer& out,
+                               const char* msgfmt, va_list vl);
+    void format_time(LogBuffer& out, const struct timespec& stamp);
+    static void format_fraction(LogBuffer& out,
+                                const struct timespec& stamp, int digits);
+    void format_record(LogBuffer& out,
+                       const LogRecord& record, const std::string& name,
+                       const recorigin* origin=nullptr);
+    //
+    // Structured output (JSON and logfmt). Values are encoded straight
+    // into the output buffer
+    //
+    void format_structured(LogBuffer& out,
+                           const LogRecord& record, const std::string& name,
+                           const recorigin* origin);
+    static void format_fields(LogBuffer& out, const LogField* fields,
+                              size_t nfields, int mode);
+    static void format_key(LogBuffer& out, const char* key, size_t length,
+                           int mode);
+    static void format_value(LogBuffer& out, const LogField& field, int mode);
+    static void format_string(LogBuffer& out, const char* s, size_t length,
+                              int mode);
+    static void format_integer(LogBuffer& out, unsigned long long value,
+                               bool negative=false);
+    static void format_double(LogBuffer& out, double value, int mode);
   public:
     //
     ~Formatter();
@@ -190,13 +1820,18 @@ class Formatter {
     Formatter& operator=(Formatter const&) = default;   // assignment
     //
     friend class LoggerTree;
+    friend class LogQueue;
     friend class Logger;
+    friend class LogCapture;
+    friend class LogScope;
+    friend class BinaryHandler;
+    friend class NetworkHandler;
     //
     // Factory functions for instantiating the class
     static Formatter get_formatter(
                             const std::string& recfmt = DEFAULT_RECORDFMT,
                             const std::string& timefmt = DEFAULT_TIMEFMT,
-                            bool eol = true);
+                            bool eol = true, int mode = FORMAT_TEXT);
     //
     // Formatter settings
     std::string get_timefmt();
@@ -204,6 +1839,10 @@ class Formatter {
     std::string get_recfmt();
     void set_recfmt(const std::string& recfmt);
     void set_eol(const bool eol);
+    int get_mode();
+    void set_mode(int mode);
+    // fork() stages. The child renders its own process ids (internal)
+    static void atfork(int stage);
 };
 
 #endif
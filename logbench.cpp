@@ -0,0 +1,538 @@
+/*
+Logging benchmarks
+
+    usage: logbench [-c] [-o results.csv] [max threads] [records per thread]
+
+Measures the hot paths: filtered out calls, formatting to a null sink,
+stderr as a stream and as a descriptor, file sinks, propagation depth,
+multithreaded scaling and sharded files, with the threads on one socket
+or spread over two. For every run it reports records per second, mean
+and p50/p99/p999 latency in ns and heap allocations per record. '-o'
+also writes the results as CSV. '-c' fails, with exit status 1, if a run
+allocates once warmed up. Sharded runs are left out: their stages grow
+with the lag of the writer thread
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <new>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logging.h"
+
+using namespace std;
+
+// One call out of LATENCY_STRIDE is timed for the latency figures, so
+// that reading the clock does not distort throughput
+//
+#define LATENCY_STRIDE 8
+
+// Calls each thread makes before a run is measured, enough to fill the
+// async queue and a worker batch, so that the figures are for the steady
+// state once buffers have grown
+//
+#define WARMUP_RECORDS (DEFAULT_QUEUE_CAPACITY + QUEUE_BATCH_SIZE)
+
+typedef chrono::steady_clock benchclock;
+
+// CPUs the threads of a run are pinned to, round robin. None if empty
+//
+static vector<int> pinning;
+
+// '-c'. Whether runs must not allocate, and how many did
+//
+static bool checkallocs   = false;
+static int  allocfailures = 0;
+
+// Heap allocation counter. The Makefile links logbench with malloc, calloc,
+// realloc and posix_memalign wrapped, so that the library calls land here.
+// operator new is replaced to go through the wrapped malloc, as the one in
+// the C++ runtime would call the real one
+//
+static atomic<unsigned long long> allocations(0);
+
+extern "C" {
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+int   __real_posix_memalign(void** p, size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  return __real_realloc(p, size);
+}
+
+int __wrap_posix_memalign(void** p, size_t alignment, size_t size) {
+  allocations.fetch_add(1, memory_order_relaxed);
+  return __real_posix_memalign(p, alignment, size);
+}
+
+}
+
+void* operator new(size_t size) {
+  void* p = malloc(size ? size : 1);
+  if (not p)
+    throw bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  free(p);
+}
+
+// Null sink. Records are formatted and written to a stream discarding them
+//
+class NullBuffer : public streambuf {
+  protected:
+    int overflow(int c)                            { return c; }
+    streamsize xsputn(const char*, streamsize n)   { return n; }
+};
+
+static NullBuffer nullbuffer;
+static ostream    nullstream(&nullbuffer);
+
+struct result {
+  string             name;
+  int                threads;
+  long               records;       // total, all threads
+  double             rate;          // records per second
+  double             mean;          // ns per record
+  double             p50, p99, p999;
+  double             allocs;        // per record
+};
+
+static double clock_overhead() {
+  // cost of a pair of clock readings, subtracted from latency samples
+  //
+  vector<double> samples;
+
+  for (int i = 0; i < 1001; i++) {
+    benchclock::time_point t0 = benchclock::now();
+    benchclock::time_point t1 = benchclock::now();
+    samples.push_back(chrono::duration<double, nano>(t1 - t0).count());
+  }
+  nth_element(samples.begin(), samples.begin() + 500, samples.end());
+
+  return samples[500];
+}
+
+static double percentile(vector<float>& samples, double p) {
+  //
+  if (samples.empty())
+    return 0;
+
+  size_t k = min(samples.size() - 1, (size_t) (p * samples.size()));
+  nth_element(samples.begin(), samples.begin() + k, samples.end());
+
+  return samples[k];
+}
+
+// Run 'call' 'nrecords' times in each of 'nthreads' threads
+// call(thread index, record index). A template so that the call inlines
+//
+template<typename Call>
+static result measure(const string& name, int nthreads, long nrecords,
+                      Call call) {
+  static double overhead = clock_overhead();
+
+  vector<vector<float> > samples(nthreads);
+  vector<thread>         threads;
+  atomic<int>            ready(0);
+  atomic<bool>           go(false);
+
+  for (int t = 0; t < nthreads; t++) {
+    samples[t].reserve(nrecords / LATENCY_STRIDE + 1);
+    threads.push_back(thread([&, t] {
+      vector<float>& mine = samples[t];
+      if (not pinning.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(pinning[t % pinning.size()], &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+      }
+      for (long i = 0; i < WARMUP_RECORDS; i++)
+        call(t, i);
+      ready.fetch_add(1);
+      while (not go.load())
+        this_thread::yield();
+      for (long i = 0; i < nrecords; i++) {
+        if (i % LATENCY_STRIDE) {
+          call(t, i);
+          continue;
+        }
+        benchclock::time_point t0 = benchclock::now();
+        call(t, i);
+        benchclock::time_point t1 = benchclock::now();
+        double ns = chrono::duration<double, nano>(t1 - t0).count();
+        mine.push_back(max(ns - overhead, 0.0));
+      }
+    }));
+  }
+
+  while (ready.load() < nthreads)
+    this_thread::yield();
+
+  unsigned long long allocs0 = allocations.load();
+  benchclock::time_point start = benchclock::now();
+  go.store(true);
+
+  for (thread& t : threads)
+    t.join();
+
+  chrono::duration<double> elapsed = benchclock::now() - start;
+  unsigned long long allocs1 = allocations.load();
+
+  vector<float> all;
+  for (vector<float>& s : samples)
+    all.insert(all.end(), s.begin(), s.end());
+
+  result r;
+  r.name    = name;
+  r.threads = nthreads;
+  r.records = nthreads * nrecords;
+  r.rate    = r.records / elapsed.count();
+  r.mean    = elapsed.count() * 1e9 * nthreads / r.records;
+  r.p50     = percentile(all, 0.50);
+  r.p99     = percentile(all, 0.99);
+  r.p999    = percentile(all, 0.999);
+  r.allocs  = (double) (allocs1 - allocs0) / r.records;
+
+  return r;
+}
+
+static void report(const result& r, FILE* csv) {
+  //
+  printf("%-24s %7d %12.0f %9.1f %9.1f %9.1f %9.1f %8.3f\n",
+         r.name.c_str(), r.threads, r.rate, r.mean,
+         r.p50, r.p99, r.p999, r.allocs);
+  fflush(stdout);
+
+  if (csv)
+    fprintf(csv, "%s,%d,%ld,%.0f,%.1f,%.1f,%.1f,%.1f,%.3f\n",
+            r.name.c_str(), r.threads, r.records, r.rate, r.mean,
+            r.p50, r.p99, r.p999, r.allocs);
+
+  if (checkallocs and r.allocs > 0) {
+    fprintf(stderr, "%s, %d threads: %.0f heap allocations in steady "
+                    "state\n", r.name.c_str(), r.threads,
+                    r.allocs * r.records);
+    allocfailures++;
+  }
+}
+
+static vector<int> node_cpus(int node) {
+  // CPUs of a NUMA node, from a sysfs list such as "0-3,8-11"
+  //
+  ifstream    in("/sys/devices/system/node/node" + to_string(node) +
+                 "/cpulist");
+  string      list;
+  vector<int> cpus;
+
+  if (not getline(in, list))
+    return cpus;
+
+  const char* p = list.c_str();
+  while (*p) {
+    char* end;
+    long  first = strtol(p, &end, 10);
+    if (end == p)
+      break;
+
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+
+    if (*p != ',')
+      break;
+    p++;
+  }
+
+  return cpus;
+}
+
+static Logger bench_logger(const string& name, int level) {
+  // a logger with no handlers and no propagation
+  //
+  Logger logger = Logger::get_logger(name, level, DEVNULL);
+  logger.set_propagation(false);
+
+  return logger;
+}
+
+int main(int argc, char* argv[]) {
+  FILE* csv = nullptr;
+  int   opt;
+
+  while ((opt = getopt(argc, argv, "co:")) != -1) {
+    if (opt == 'c')
+      checkallocs = true;
+    if (opt == 'o' and not (csv = fopen(optarg, "w"))) {
+      perror(optarg);
+      return 1;
+    }
+    if (opt == '?') {
+      fprintf(stderr, "usage: %s [-c] [-o results.csv] [max threads] "
+                      "[records per thread]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  int  maxthreads = optind < argc ? atoi(argv[optind]) : 64;
+  long nrecords   = optind + 1 < argc ? atol(argv[optind + 1]) : 100000;
+
+  Logger::set_autolog(false);
+  Logger::get_logger(UNCHANGED, DEVNULL);
+
+  char tmpname[] = "/tmp/logbenchXXXXXX";
+  int tmpfd = mkstemp(tmpname);
+  if (tmpfd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(tmpfd);
+
+  printf("%-24s %7s %12s %9s %9s %9s %9s %8s\n", "benchmark", "threads",
+         "records/sec", "mean ns", "p50 ns", "p99 ns", "p999 ns", "allocs");
+  if (csv)
+    fprintf(csv, "benchmark,threads,records,records_per_sec,mean_ns,"
+                 "p50_ns,p99_ns,p999_ns,allocs_per_record\n");
+
+  // calls filtered out by level
+  //
+  {
+    Logger logger = bench_logger("bench.filtered", ERROR);
+
+    report(measure("filtered call", 1, 10 * nrecords, [&](int, long i) {
+      logger.debug("filtered record %ld", i);
+    }), csv);
+    report(measure("filtered macro", 1, 10 * nrecords, [&](int, long i) {
+      LOG_DEBUG(logger, "filtered record %ld", i);
+    }), csv);
+  }
+
+  // formatted records to a null sink
+  //
+  {
+    Logger logger = bench_logger("bench.null", INFO);
+    logger.set_streamer(&nullstream);
+
+    report(measure("null sink", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+    report(measure("null sink deferred", 1, nrecords, [&](int, long i) {
+      logger.deferred(INFO, "benchmark record %ld", i);
+    }), csv);
+
+    Logger::set_async(true);
+    report(measure("null sink async", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+    Logger::set_async(false);
+
+    logger.set_streamer(DEVNULL);
+  }
+
+  // stderr through cerr and straight to the descriptor, redirected to
+  // /dev/null meanwhile
+  //
+  {
+    Logger logger  = bench_logger("bench.stderr", INFO);
+    int    saved   = dup(STDERR_FILENO);
+    int    devnull = open("/dev/null", O_WRONLY);
+
+    dup2(devnull, STDERR_FILENO);
+
+    logger.set_streamer(STDERR);
+    report(measure("stderr stream", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+
+    logger.set_streamer(FD_STDERR);
+    report(measure("stderr descriptor", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+
+    Logger::set_async(true);
+    report(measure("stderr descriptor async", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+    Logger::set_async(false);
+
+    logger.set_streamer(DEVNULL);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    close(devnull);
+  }
+
+  // file sinks
+  //
+  {
+    Logger logger = bench_logger("bench.file", INFO);
+
+    logger.set_logfile(tmpname, 0);
+    report(measure("file unbuffered", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+
+    logger.set_logfile(tmpname, 65536, CRITICAL, 0);
+    report(measure("file 64K buffer", 1, nrecords, [&](int, long i) {
+      logger.info("benchmark record %ld", i);
+    }), csv);
+    logger.set_logfile("");
+
+    logger.set_binfile(tmpname, 65536, CRITICAL, 0);
+    report(measure("binary file deferred", 1, nrecords, [&](int, long i) {
+      logger.deferred(INFO, "benchmark record %ld", i);
+    }), csv);
+    logger.set_binfile("");
+  }
+
+  // propagation. A null sink at every level of a five level chain
+  //
+  {
+    vector<Logger> chain;
+    string name;
+
+    for (int depth = 1; depth <= 5; depth++) {
+      name += (depth > 1 ? ".d" : "bench.d") + to_string(depth);
+      chain.push_back(Logger::get_logger(name, INFO, DEVNULL));
+      chain.back().set_streamer(&nullstream);
+    }
+    chain.front().set_propagation(false);
+
+    for (int depth = 1; depth <= 5; depth++) {
+      Logger& logger = chain[depth - 1];
+      report(measure("propagation depth " + to_string(depth), 1, nrecords,
+                     [&](int, long i) {
+        logger.info("benchmark record %ld", i);
+      }), csv);
+    }
+
+    for (Logger& logger : chain)
+      logger.set_streamer(DEVNULL);
+  }
+
+  // multithreaded scaling. All threads on one logger and file, or each
+  // thread on its own
+  //
+  for (int shared = 1; shared >= 0; shared--) {
+    for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+      vector<Logger> loggers;
+
+      for (int i = 0; i < nthreads; i++) {
+        string name = shared ? string("bench.shared")
+                             : "bench.thread" + to_string(i);
+        loggers.push_back(bench_logger(name, INFO));
+        if (i == 0 or not shared)
+          loggers.back().set_logfile("/dev/null", 65536, CRITICAL, 0);
+      }
+
+      report(measure(shared ? "threads shared" : "threads private",
+                     nthreads, nrecords, [&](int t, long i) {
+        loggers[t].info("benchmark record %ld from thread %d", i, t);
+      }), csv);
+
+      for (Logger& logger : loggers)
+        logger.set_logfile("");
+    }
+  }
+
+  // Sharded files against a single buffered file, all threads on one
+  // logger. The threads run on the CPUs of the first node, then take
+  // turns between the first two nodes. The second set needs two sockets
+  // Stages grow to new sizes whenever the writer falls further behind,
+  // so '-c' does not hold these runs to zero allocations
+  //
+  {
+    Logger logger  = bench_logger("bench.sharded", INFO);
+    bool   checked = checkallocs;
+
+    checkallocs = false;
+
+    vector<int> socket0 = node_cpus(0);
+    vector<int> socket1 = node_cpus(1);
+    vector<int> spread;
+
+    for (size_t i = 0; i < max(socket0.size(), socket1.size()); i++) {
+      if (i < socket0.size())
+        spread.push_back(socket0[i]);
+      if (i < socket1.size())
+        spread.push_back(socket1[i]);
+    }
+
+    const struct {
+      const char* name;
+      int         sharding;
+    } modes[] = { { "single file",   SHARD_NONE },
+                  { "sharded cpu",   SHARD_CPU },
+                  { "sharded node",  SHARD_NODE },
+                  { "sharded merge", SHARD_CPU | SHARD_MERGE } };
+
+    for (int sockets = 1; sockets <= 2; sockets++) {
+      if (sockets == 2 and socket1.empty())
+        break;
+      pinning = sockets == 1 ? socket0 : spread;
+
+      for (const auto& mode : modes)
+        for (int nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+          logger.set_logfile(tmpname, 65536, CRITICAL, 0, mode.sharding);
+          report(measure(string(mode.name) +
+                         (sockets == 1 ? " 1 socket" : " 2 sockets"),
+                         nthreads, nrecords, [&](int t, long i) {
+            logger.info("benchmark record %ld from thread %d", i, t);
+          }), csv);
+          logger.set_logfile("");
+        }
+    }
+    pinning.clear();
+    checkallocs = checked;
+
+    for (int i = 1; i < MAX_SHARDS; i++)
+      unlink((string(tmpname) + "." + to_string(i)).c_str());
+  }
+
+  unlink(tmpname);
+  if (csv)
+    fclose(csv);
+
+  return allocfailures > 0 ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+/*
+Render a binary log file as text
+
+    usage: logdecode <binary log file> [record format [time format]]
+
+*/
+
+#include <unistd.h>
+
+#include <iostream>
+
+#include "logging.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+
+  if (argc < 2 or argc > 4) {
+    cerr << "usage: " << argv[0]
+         << " <binary log file> [record format [time format]]" << endl;
+    return 2;
+  }
+
+  string recfmt  = argc > 2 ? argv[2] : DEFAULT_RECORDFMT;
+  string timefmt = argc > 3 ? argv[3] : DEFAULT_TIMEFMT;
+
+  if (BinaryHandler::decode(argv[1], STDOUT_FILENO, recfmt, timefmt) != 0) {
+    cerr << argv[0] << ": cannot decode binary log file " << argv[1] << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -7,8 +7,11 @@ A basic logging interface
 */
 
 #include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include <thread>
+#include <functional>
 #include <cstdarg>
 #include <fstream>
 #include <iostream>
@@ -29,6 +32,16 @@ using namespace std;
 //
 //     logging::main_thread_id = this_thread::get_id()
 //
+//   Name of the running thread (Logger::set_thread_name), null if none
+//   Points into storage of the thread itself
+//
+//     logging::threadname
+//
+//   Diagnostic context of the running thread (LogScope), null if none
+//   Owned by the scopes of the thread
+//
+//     logging::context
+//
 //   These permit debugging of internal operations using regular loggers
 //
 //     logging::autolog      (default: true)
@@ -38,10 +51,117 @@ using namespace std;
 //   Mutexes are placed in a separate namespace
 //   Must last until other dynamic objects are destroyed
 //
-//     logging::treemutex   protect logger tree operations
 //     logging::filemutex   protect file and stream operations
-//     logging::logmutex    protect message creation and delivery
-//     logging::fmtmutex    protect formatter creation and manipulation
+//     logging::logmutex    protect logger and formatter settings. Held
+//                          shared while delivering messages, exclusive
+//                          while changing them
+//     logging::fmtmutex    protect formatter manipulation. Taken before
+//                          logmutex
+//
+//   Handlers serialize their own output. Records are formatted and
+//   written concurrently
+//
+//   Generation counter for the cached effective log levels
+//
+//     logging::levelgen    bumped on every level or logger tree change
+//
+//   Collect timing statistics (Logger::set_stats_timing)
+//
+//     logging::stattiming
+//
+//   Loggers with rate limits or duplicate suppression. While there are
+//   none, records skip the filter lookup
+//
+//     logging::filters
+//
+//   Set by Logger::shutdown(). Buffered handlers write through and
+//   asynchronous mode stays off from then on
+//
+//     logging::finished
+//
+//   Flat index of loggers by full name, checked before walking the tree
+//   Split in INDEX_SHARDS partitions picked by name hash, each one with its
+//   own lock. Expired entries are swept when new loggers get indexed
+//
+//     logging::loggerindex
+//
+//   There is no tree wide lock. Each logger protects its dictionary of
+//   children (dictmutex). Lock order: dictmutex, parents first, then
+//   index shard mutex
+namespace logging {
+  thread::id main_thread_id = this_thread::get_id();
+  thread_local const char* threadname = nullptr;
+  thread_local const LogContext* context = nullptr;
+  //
+  bool autolog    = true;
+  int  autolevel  = DEBUG;
+  int  autostream = STDERR;
+  //
+  mutex   filemutex;
+  RWMutex logmutex;
+  mutex   fmtmutex;
+  //
+  atomic<unsigned long> levelgen(1);
+  //
+  atomic<bool> stattiming(false);
+  //
+  atomic<int> filters(0);
+  //
+  atomic<bool> finished(false);
+  //
+  LoggerIndexShard loggerindex[INDEX_SHARDS];
+}
+
+///////////////  RWMutex
+//
+RWMutex::RWMutex() {
+  init();
+}
+
+void RWMutex::init() {
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&rwlock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+RWMutex::~RWMutex() {
+  pthread_rwlock_destroy(&rwlock);
+}
+
+void RWMutex::reset() {
+  // Release a lock held exclusive across fork(), in the child. Unlocking
+  // does not work there: the lock records the owner by its thread id,
+  // which is not the same in the child
+  //
+  init();
+}
+
+///////////////  LogRecord
+//
+// Records are stamped and attributed to a thread when created, so that
+// they render the same wherever they are finally delivered
+//
+LogRecord::LogRecord(int level) : level(level),
+                                  message(""),
+                                  msglen(0),
+                                  tid(this_thread::get_id()),
+                                  threadname(logging::threadname),
+                                  context(logging::context),
+                                  format(""),
+                                  args(nullptr),
+                                  argslen(0),
+                                  argtypes(""),
+                                  render(nullptr),
+                                  fields(nullptr),
+                                  nfields(0) {
+  clock_gettime(CLOCK_REALTIME, &stamp);
+}
 
 ///////////////  LoggerTree class
 //
@@ -52,84 +172,133 @@ using namespace std;
 LoggerTree::LoggerTree() : modname(ROOT_ALIAS),
                            isroot(true),
                            loglevel(WARNING),
+                           levelcache(0),
+                           logfile(nullptr),
+                           shardfile(nullptr),
+                           sharding(SHARD_NONE),
+                           rotation(),
+                           ringfile(nullptr),
+                           binfile(nullptr),
+                           netsink(nullptr),
                            outstream(&cerr),
+                           outfd(-1),
+                           recordmax{DEFAULT_MAX_RECORD, DEFAULT_MAX_RECORD,
+                                     DEFAULT_MAX_RECORD, DEFAULT_MAX_RECORD,
+                                     DEFAULT_MAX_RECORD},
+                           handlerlevel{NOTSET, NOTSET, NOTSET, NOTSET,
+                                        NOTSET},
                            formatter(nullptr),
                            propagate(true),
-                           parent(nullptr)       {}
+                           filter(nullptr),
+                           parent(nullptr),
+                           orphans(0),
+                           samplelevel(NOTSET),
+                           samplethreshold(0),
+                           sampleevery(0),
+                           streambytes(0)        {
+  //
+  statslot = ThreadStats::acquire_slot(statbase);
+}
 
 LoggerTree::LoggerTree(const string& module) : modname(module),
                                                isroot(false),
                                                loglevel(NOTSET),
+                                               levelcache(0),
+                                               logfile(nullptr),
+                                               shardfile(nullptr),
+                                               sharding(SHARD_NONE),
+                                               rotation(),
+                                               ringfile(nullptr),
+                                               binfile(nullptr),
+                                               netsink(nullptr),
                                                outstream(nullptr),
+                                               outfd(-1),
+                                               recordmax{DEFAULT_MAX_RECORD,
+                                                         DEFAULT_MAX_RECORD,
+                                                         DEFAULT_MAX_RECORD,
+                                                         DEFAULT_MAX_RECORD,
+                                                         DEFAULT_MAX_RECORD},
+                                               handlerlevel{NOTSET, NOTSET,
+                                                            NOTSET, NOTSET,
+                                                            NOTSET},
                                                formatter(nullptr),
                                                propagate(true),
-                                               parent(nullptr)      {}
+                                               filter(nullptr),
+                                               parent(nullptr),
+                                               orphans(0),
+                                               samplelevel(NOTSET),
+                                               samplethreshold(0),
+                                               sampleevery(0),
+                                               streambytes(0)       {
+  //
+  statslot = ThreadStats::acquire_slot(statbase);
+}
 
-// Destructor. Update loggers tree
+// Destructor. Takes no tree lock
+//
+// The entries for this logger in the parent dictionary and in the name
+// index have expired. They are left in place and counted as orphans, to
+// be swept by the next logger creation that finds enough of them
 //
 LoggerTree::~LoggerTree() {
-  bool destok  = true;       // check for errors during destruction
-
-  // Object tree is locked. Recursion must be prevented during destruction
-  //
-  lock_guard<mutex> lock(logging::treemutex);
-
-  // logger tree instance
   //
   autolog(DEBUG, "destroying %s logging module", modname.c_str());
-  //
-  if (dict.size() > 0) {
-    // tree cleanup error. Object with active children is being destroyed
-    //
-    autolog(ERROR, "logging module %s destroyed with active leaves", modname.c_str());
-    // don't throw within destructor
-    //
-    destok = false;
+
+  if (parent) {
+    parent->orphans.fetch_add(1, memory_order_relaxed);
+    logging::index_shard(modname).orphans.fetch_add(1, memory_order_relaxed);
   }
-  else if (parent) {
-    // check the pointer to 'this' instance stored in parent's instance dict
-    //
-    if (not parent->dict[modname].expired()) {
-      // pointer should have expired since pointed instance is being destoyed
-      // mutex should prevent this from happening
-      //
-      autolog(ERROR, "a new logger has been created during destruction");
-      // don't throw within destructor
-      //
-      destok = false;
-    }
-    else {
-      // child is now an orphan and parent must be updated
-      //
-      autolog(DEBUG, "module orphaned. update parent's dictionary"); 
-      parent->dict.erase(modname);
-      // close log file
-      //
-      if (logfile and logfile->is_open()) {
-        logfile->close();
-        delete logfile;
-      }
-      autolog(DEBUG, "tree update complete");
-    }
+
+  // close log, ring and binary files and the handler chain. Pending
+  // output is flushed
+  //
+  delete logfile;
+  delete shardfile;
+  delete ringfile;
+  delete binfile;
+  delete netsink;
+  for (LogTarget& target : chain)
+    delete target.handler;
+  if (filter) {
+    delete filter;
+    logging::filters.fetch_sub(1, memory_order_relaxed);
   }
-  if (destok)
-    autolog(DEBUG, "%s logging module destroyed", modname.c_str());
+  autolog(DEBUG, "%s logging module destroyed", modname.c_str());
+
+  ThreadStats::release_slot(statslot);
 }
 
 fmtptr_t LoggerTree::get_def_formatter() {
+  // Created on first use and never replaced. Takes no lock, so that it
+  // can be called holding logmutex (fmtmutex comes first)
   //
-  static fmtptr_t default_formatter = nullptr;
+  static fmtptr_t default_formatter(new Formatter);
 
-  lock_guard<mutex> lock(logging::fmtmutex);
+  return default_formatter;
+}
 
-  if (default_formatter == nullptr) {
-    // create the default formatter
-    //
-    fmtptr_t tmp_formatter(new Formatter);
-    tmp_formatter.swap(default_formatter); 
-  }
+shared_ptr<LogQueue>& LoggerTree::get_async_queue() {
+  // *** Used internally. Shared pointer to the active asynchronous queue ***
+  // Read it holding logging::logmutex shared, replace it holding it
+  // exclusive. Not atomic_load(): its internal locks would not be free
+  // in a fork() child
+  // Callers must initialize the default formatter and the root logger first
+  // so that the queue is destroyed (and drained) before them at exit
+  //
+  static shared_ptr<LogQueue> async_queue = nullptr;
 
-  return default_formatter;
+  return async_queue;
+}
+
+shared_ptr<const LogConfig>& LoggerTree::get_config() {
+  // *** Used internally. The configuration file in effect ***
+  // Read and replaced as the asynchronous queue is. The snapshot is never
+  // changed in place. Callers initialize the default formatter and the
+  // root logger first, the snapshot holds loggers
+  //
+  static shared_ptr<const LogConfig> config = nullptr;
+
+  return config;
 }
 
 logptr_t LoggerTree::get_root_logger() {
@@ -137,18 +306,33 @@ logptr_t LoggerTree::get_root_logger() {
   // Instance gets created and initialized the first time this method is called
   // The root instance is unique. This method always returns the same pointer
   //
-  static logptr_t root_logger = nullptr;
+  // Initialization of a local static is thread safe (C++11)
+  //
+  static logptr_t root_logger(new LoggerTree);
 
-  lock_guard<mutex> lock(logging::treemutex);
+  return root_logger;
+}
 
-  if (root_logger == nullptr) {
-    // create the root logger
-    //
-    logptr_t temp_root_logger(new LoggerTree);
-    temp_root_logger.swap(root_logger);
-  }
+// Sweep expired entries out of a dictionary once orphans are at least
+// RECLAIM_MIN_ORPHANS and half its size. Caller holds the lock protecting
+// 'dict'. Amortized cost is constant per destroyed logger
+//
+template<typename Dict>
+static void reclaim_orphans(Dict& dict, atomic<size_t>& orphans) {
+  //
+  size_t n = orphans.load(memory_order_relaxed);
 
-  return root_logger;
+  if (n < RECLAIM_MIN_ORPHANS or 2 * n < dict.size())
+    return;
+
+  orphans.store(0, memory_order_relaxed);
+
+  for (auto it = dict.begin(); it != dict.end(); ) {
+    if (it->second.expired())
+      it = dict.erase(it);
+    else
+      ++it;
+  }
 }
 
 logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
@@ -161,6 +345,22 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
   const size_t max_submod = MAX_MODULE_SUBFIELDS;
   const size_t max_modlen = MAX_MODULE_NAME_SIZE;
 
+  // Fast path. Existing loggers are found with a single hash probe
+  // Indexed loggers imply both the root and the default formatter exist
+  //
+  LoggerIndexShard& shard = logging::index_shard(module);
+
+  if (not is_root) {
+    SharedLock indexlock(shard.mutex);
+
+    auto entry = shard.loggers.find(module);
+    if (entry != shard.loggers.end()) {
+      logptr_t found = entry->second.lock();
+      if (found)
+        return found;
+    }
+  }
+
   // Always call def_formatter() prior to get_root_logger()
   // Lazy initialization
   //
@@ -175,8 +375,9 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
     exit(1);
   }
 
-  lock_guard<mutex> lock(logging::treemutex);
-
+  // Walk down locking one dictionary at a time. Other threads may be
+  // creating or destroying loggers elsewhere in the tree
+  //
   while(instance and not is_root) {
 
     // find a module name token ('.' separated)
@@ -194,7 +395,10 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
 
     instance->autolog(DEBUG, "looking for module %s in dict", submod.c_str());
 
-    bool exists  = instance->dict.count(submod) > 0;
+    lock_guard<mutex> dictlock(instance->dictmutex);
+
+    auto child   = instance->dict.find(submod);
+    bool exists  = child != instance->dict.end();
     bool expired = false;
 
     // logger already exists. Get current pointer
@@ -205,7 +409,8 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
       instance->autolog(DEBUG, "found existing logging instance for module %s",
                        submod.c_str());
       
-      expired = instance->dict[submod].expired();
+      logptr_t found = child->second.lock();    // weak -> shared
+      expired = not found;
       if (expired) {
         // this thread has completed, pointer is not valid and
         // object instance will be destroyed later
@@ -215,7 +420,7 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
       else {
         // obtain a shared pointer to the logging instance
         //
-        instance = instance->dict[submod].lock();   // weak -> shared
+        instance = found;
         instance->autolog(DEBUG,
                     "created shared pointer to instance %p", instance.get());
       }
@@ -231,8 +436,11 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
                           "created new logging instance for module %s at %p",
                           submod.c_str(), new_instance.get());
 
-      instance->dict[submod]  = new_instance;   // weak pointer
+      // the new logger does not change any existing effective level
+      //
       new_instance->parent    = instance;       // upwards pointer
+      instance->dict[submod]  = new_instance;   // weak pointer
+      reclaim_orphans(instance->dict, instance->orphans);
       instance = new_instance;
     }
 
@@ -245,9 +453,73 @@ logptr_t LoggerTree::get_logger_internal(bool is_root, const string& module) {
   if (not instance)
     throw runtime_error(string("null instance returned for module ") + module);
 
+  if (not is_root) {
+    lock_guard<RWMutex> indexlock(shard.mutex);
+
+    shard.loggers[module] = instance;
+    reclaim_orphans(shard.loggers, shard.orphans);
+  }
+
   return instance;
 }
 
+// fork() stages of the logger tree. The dictionaries are taken top down,
+// as get_logger_internal() takes them one at a time, then the name index
+// The loggers are held until the parent or the child releases them
+//
+static vector<logptr_t>& fork_held() {
+  //
+  static vector<logptr_t>* held = new vector<logptr_t>();
+
+  return *held;
+}
+
+void LoggerTree::tree_atfork(int stage) {
+  //
+  vector<logptr_t>& held = fork_held();
+
+  if (stage == FORK_PREPARE) {
+    get_def_formatter();
+    held.push_back(get_root_logger());
+
+    for (size_t i = 0; i < held.size(); i++) {
+      LoggerTree* node = held[i].get();
+
+      node->dictmutex.lock();
+      for (auto& entry : node->dict) {
+        logptr_t child = entry.second.lock();
+        if (child)
+          held.push_back(child);
+      }
+    }
+    for (LoggerIndexShard& shard : logging::loggerindex)
+      shard.mutex.lock();
+    return;
+  }
+
+  for (LoggerIndexShard& shard : logging::loggerindex)
+    if (stage == FORK_CHILD)
+      shard.mutex.reset();
+    else
+      shard.mutex.unlock();
+  for (size_t i = held.size(); i-- > 0; )
+    held[i]->dictmutex.unlock();
+
+  // loggers no longer used elsewhere are destroyed here
+  //
+  vector<logptr_t> released;
+  released.swap(held);
+}
+
+void LoggerTree::filters_atfork(int stage) {
+  // The loggers held by tree_atfork(). Caller holds logmutex, filters are
+  // created under it exclusive
+  //
+  for (const logptr_t& node : fork_held())
+    if (node->filter)
+      node->filter->atfork(stage);
+}
+
 ///////////////// User interface - logger creation /////////////////////
 //
 Logger::Logger()                {}
@@ -262,8 +534,11 @@ Logger Logger::get_logger(int level, int stream) {
   logptr_t instance = LoggerTree::get_logger_internal(true, "");
 
   logger.treeptr = instance;
-  logger.set_loglevel(level);
-  logger.set_streamer(stream);
+  // settings take logmutex exclusive. Leave them alone if unchanged
+  if (level != UNCHANGED)
+    logger.set_loglevel(level);
+  if (stream != UNCHANGED)
+    logger.set_streamer(stream);
 
   return logger;
 }
@@ -274,8 +549,11 @@ Logger Logger::get_logger(const string& module, int level, int stream) {
   logptr_t instance = LoggerTree::get_logger_internal(false, module);
 
   logger.treeptr = instance;
-  logger.set_loglevel(level);
-  logger.set_streamer(stream);
+  // settings take logmutex exclusive. Leave them alone if unchanged
+  if (level != UNCHANGED)
+    logger.set_loglevel(level);
+  if (stream != UNCHANGED)
+    logger.set_streamer(stream);
 
   return logger;
 }
@@ -288,6 +566,7 @@ void Logger::add_formatter(fmtref_t ref_formatter) {
   // attach a new formatter to this logger
   //
   lock_guard<mutex> lock(logging::fmtmutex);
+  lock_guard<RWMutex> loglock(logging::logmutex);
 
   treeptr->formatter = fmtptr_t(&ref_formatter);
 }
@@ -307,18 +586,20 @@ fmtref_t Logger::get_formatter() {
 int Logger::get_loglevel() {
   // return current log level
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  SharedLock lock(logging::logmutex);
   return treeptr->loglevel;
 }
 
 int Logger::set_loglevel(int level) {
   // set log level to new level and return current level
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
   
   int curlevel = treeptr->loglevel;
-  if (level != UNCHANGED)
+  if (level != UNCHANGED) {
     treeptr->loglevel = min(MAXLOG, max(MINLOG, abs(level)));
+    LoggerTree::invalidate_loglevels();
+  }
 
   return curlevel;
 }
@@ -333,7 +614,7 @@ int Logger::get_effective_loglevel() {
 bool Logger::set_propagation(bool mode) {
   bool curmode;
 
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
 
   curmode = treeptr->propagate;
   treeptr->propagate = mode;
@@ -341,18 +622,83 @@ bool Logger::set_propagation(bool mode) {
   return curmode;
 }
 
+// get/set asynchronous mode
+//
+bool Logger::get_async() {
+  //
+  SharedLock lock(logging::logmutex);
+
+  return LoggerTree::get_async_queue() != nullptr;
+}
+
+bool Logger::set_async(bool mode, size_t capacity, int overflow, int droplevel) {
+  // switch asynchronous delivery on or off and return previous mode
+  // switching on while already in async mode replaces the queue. The
+  // old queue is drained by whoever releases it last
+  // Not after shutdown()
+  //
+  shared_ptr<LogQueue> new_queue = nullptr;
+
+  if (mode and logging::finished.load())
+    return false;
+
+  // make sure statics used by the writer thread outlive the queue
+  //
+  LoggerTree::get_def_formatter();
+  LoggerTree::get_root_logger();
+
+  if (mode)
+    new_queue = make_shared<LogQueue>(max(capacity, (size_t) 1),
+                                      overflow, droplevel);
+
+  // the old queue is released with logmutex free, its writer needs it
+  //
+  shared_ptr<LogQueue> cur_queue = new_queue;
+  {
+    lock_guard<RWMutex> lock(logging::logmutex);
+
+    LoggerTree::get_async_queue().swap(cur_queue);
+  }
+
+  return cur_queue != nullptr;
+}
+
+// get/set the name of the calling thread. Records carry it for '%q'
+// Names are cut to MAX_THREAD_NAME - 1 bytes. An empty name removes it
+// The storage is never destroyed, so that records created while the
+// thread exits still find it
+//
+static thread_local char threadnamebuf[MAX_THREAD_NAME];
+
+string Logger::get_thread_name() {
+  //
+  return logging::threadname ? logging::threadname : "";
+}
+
+string Logger::set_thread_name(const string& name) {
+  //
+  string curname = get_thread_name();
+
+  size_t n = min(name.size(), sizeof(threadnamebuf) - 1);
+  memcpy(threadnamebuf, name.data(), n);
+  threadnamebuf[n] = '\0';
+  logging::threadname = n > 0 ? threadnamebuf : nullptr;
+
+  return curname;
+}
+
 // get/set autolog mode
 //
 bool Logger::get_autolog() {
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  SharedLock lock(logging::logmutex);
   
   return logging::autolog;
 }
 
 bool Logger::set_autolog(bool mode) {
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
   
   bool curdebug = logging::autolog;
   logging::autolog = mode;
@@ -362,7 +708,7 @@ bool Logger::set_autolog(bool mode) {
 
 bool Logger::set_autolog_level(int level) {
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
   
   bool curlevel = logging::autolevel;
   logging::autolevel = level;
@@ -372,7 +718,7 @@ bool Logger::set_autolog_level(int level) {
 
 bool Logger::set_autolog_streamer(int stream) {
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  lock_guard<RWMutex> lock(logging::logmutex);
   
   bool curstream = logging::autostream;
   logging::autostream = stream;
@@ -433,10 +779,17 @@ void Logger::log(int level, const char* format, ...) {
 /////////////////
 //
 /////////////////
-int LoggerTree::get_effective_loglevel() {
+int LoggerTree::update_effective_loglevel() {
+  // Slow path of get_effective_loglevel(). Walk up the tree and refresh
+  // the cached value
+  //
   int level = NOTSET;
 
-  lock_guard<mutex> lock(logging::logmutex);
+  SharedLock lock(logging::logmutex);
+
+  // levels and generation cannot change while logmutex is held
+  //
+  unsigned long generation = logging::levelgen.load(memory_order_relaxed);
 
   LoggerTree* instance = this;
 
@@ -447,87 +800,525 @@ int LoggerTree::get_effective_loglevel() {
     instance = instance->parent.get();
   }
 
+  levelcache.store((generation << LEVELCACHE_BITS) | level,
+                   memory_order_relaxed);
+
   return level;
 }
 
+void LoggerTree::invalidate_loglevels() {
+  // Drop all cached effective levels
+  // Level changes must call this while holding logging::logmutex so that
+  // no cache gets refreshed with the old level at the new generation
+  //
+  logging::levelgen.fetch_add(1, memory_order_relaxed);
+}
+
 void LoggerTree::autolog(int level, const char* format, ...) {
+  // Internal diagnostics. Delivered at once to stderr, at this level only
+  //
   va_list vl;
 
-  if (not Logger::get_autolog())
+  if (not Logger::get_autolog() or level < logging::autolevel)
     return;
 
-  va_start(vl, format);
+  // private buffers. autolog() may run while the thread buffers are in use
+  //
+  LogBuffer msgbuf;
+  LogBuffer recbuf;
 
-  ostream* curos     = outstream;
-  int curlevel       = loglevel;
-  bool curpropagate  = propagate;
+  va_start(vl, format);
+  LogRecord record(level);
+  Formatter::format_message(msgbuf, format, vl);
+  record.message = msgbuf.data();
+  record.msglen  = msgbuf.size();
+  va_end(vl);
 
-  outstream = &cerr;
-  loglevel  = logging::autolevel;
-  propagate = false;
+  SharedLock lock(logging::logmutex);
 
-  logaux(level, format, vl);
+  Formatter* cur_formatter = formatter.get();
+  if (not cur_formatter)
+    cur_formatter = get_def_formatter().get();
 
-  loglevel  = curlevel;
-  outstream = curos;
-  propagate = curpropagate;
+  cur_formatter->format_record(recbuf, record, modname);
+  if (cur_formatter->eol)
+    recbuf.append('\n');
 
-  va_end(vl);
+  cerr.write(recbuf.data(), recbuf.size());
+  cerr.flush();
 }
 
 void LoggerTree::logaux(int level, const char* format, va_list vl) {
   //
   int effective_loglevel = get_effective_loglevel();
 
-  if (level < effective_loglevel)
+  if (level < effective_loglevel) {
+    count_filtered();
+    return;
+  }
+  if (not sampled(level))
     return;
 
-  // lock here to prevent other threads from changing level, stream, etc
+  // rate limits go before formatting, duplicates are found after it
   //
-  lock_guard<mutex> lock(logging::logmutex);
+  LogFilter* filter = get_filter();
+  if (filter and rate_limited(filter, level, format))
+    return;
 
-  // Message formatting
+  // Message formatting does not depend on the formatter settings
+  // The message buffer belongs to this thread and is reused
   //
-  Formatter* def_formatter = get_def_formatter().get();
-  Formatter* cur_formatter = formatter.get();
-  if (not cur_formatter)
-    cur_formatter = def_formatter;
+  static thread_local LogBuffer msgbuf;
 
-  string message = cur_formatter->format_message(format, vl);
+  bool timing = logging::stattiming.load(memory_order_relaxed);
+  unsigned long long start = timing ? logging::stats_clock() : 0;
 
-  LoggerTree* instance = this;
+  LogRecord record(level);
+  msgbuf.clear();
+  Formatter::format_message(msgbuf, format, vl);
+  if (timing)
+    ThreadStats::get().add(STAT_FORMAT_NS, logging::stats_clock() - start);
+  record.message = msgbuf.data();
+  record.msglen  = msgbuf.size();
+  record.format  = format;
 
-  while (instance) {
-    string record;
-    Formatter* lev_formatter;
+  if (filter and repeated(filter, level, format, msgbuf.data(), msgbuf.size()))
+    return;
+
+  dispatch(record);
+
+  msgbuf.trim(LOGBUFFER_RETAIN);
+}
+
+void LoggerTree::loglazy(int level, const char* site, logproduce_t produce,
+                         const void* producer) {
+  // The message is produced once all the checks before formatting have
+  // passed. 'site' identifies the producer for rate limits
+  // A producer may log in turn. Records logged meanwhile by the same
+  // thread get a buffer of their own
+  //
+  if (level < get_effective_loglevel()) {
+    count_filtered();
+    return;
+  }
+  if (not sampled(level))
+    return;
+
+  LogFilter* filter = get_filter();
+  if (filter and rate_limited(filter, level, site))
+    return;
+
+  static thread_local LogBuffer msgbuf;
+  static thread_local bool      producing = false;
+
+  unique_ptr<LogBuffer> nested;
+  LogBuffer*            buf = &msgbuf;
+  if (producing) {
+    nested.reset(new LogBuffer());
+    buf = nested.get();
+  }
+
+  bool timing = logging::stattiming.load(memory_order_relaxed);
+  unsigned long long start = timing ? logging::stats_clock() : 0;
 
-    // check for the existence of stream or file handlers at this level
+  LogRecord record(level);
+  {
+    // restored even if the producer throws
     //
-    if (instance->outstream or 
-         (instance->logfile and instance->logfile->is_open())) {
-      // Record formatting as a log message wrapper
-      // retain original 'level' and 'modname' values across potential loggers
-      //
-      lev_formatter = instance->formatter.get();
-      if (not lev_formatter)
-        lev_formatter = def_formatter;
+    struct restore {
+      bool& flag;
+      bool  saved;
+      ~restore() { flag = saved; }
+    } guard = { producing, producing };
+
+    producing = true;
+    buf->clear();
+    produce(*buf, producer);
+  }
+  if (timing)
+    ThreadStats::get().add(STAT_FORMAT_NS, logging::stats_clock() - start);
+  record.message = buf->data();
+  record.msglen  = buf->size();
+  record.format  = record.message;
+
+  if (filter and repeated(filter, level, site, buf->data(), buf->size()))
+    return;
+
+  dispatch(record);
+
+  buf->trim(LOGBUFFER_RETAIN);
+}
+
+LogBuffer& LoggerTree::capture_buffer() {
+  // per-thread buffer for captured arguments (Logger::deferred)
+  //
+  static thread_local LogBuffer blob;
+
+  return blob;
+}
+
+void LoggerTree::logcaptured(int level, const char* format,
+                             const char* argtypes, logrender_t render,
+                             const LogBuffer& args) {
+  // Record with captured arguments. Level has been checked by the caller
+  // The message is rendered at delivery, by the writer thread in
+  // asynchronous mode
+  // Identical arguments render identical messages, so duplicates are
+  // found on the captured arguments
+  //
+  LogFilter* filter = get_filter();
+  if (filter and (rate_limited(filter, level, format) or
+                  repeated(filter, level, format, args.data(), args.size())))
+    return;
 
-      record = lev_formatter->format_record(message, modname, level);
+  LogRecord record(level);
+  record.format   = format;
+  record.args     = args.data();
+  record.argslen  = args.size();
+  record.argtypes = argtypes;
+  record.render   = render;
 
-      // log to stream if configured
+  dispatch(record);
+
+  capture_buffer().trim(LOGBUFFER_RETAIN);
+}
+
+void LoggerTree::count_filtered() {
+  //
+  ThreadStats::get().add(STAT_FILTERED, statslot, 1);
+}
+
+void LoggerTree::dispatch(LogRecord& record) {
+  //
+  ThreadStats& stats = ThreadStats::get();
+
+  stats.add(STAT_EMITTED, statslot, 1);
+
+  shared_ptr<LogQueue> queue;
+  {
+    // lock here to prevent other threads from changing level, stream, etc
+    // Other threads may be delivering at the same time
+    //
+    TimedSharedLock lock(logging::logmutex);
+
+    queue = get_async_queue();
+    if (not queue) {
+      deliver(record);
+      return;
+    }
+  }
+
+  // Asynchronous mode. Leave delivery to the writer thread. The push may
+  // wait for room, so not under logmutex
+  //
+  if (not queue->push(shared_from_this(), record))
+    stats.add(STAT_DROPPED, statslot, 1);
+}
+
+// Record buffer of deliver(). Records to descriptors are gathered there
+// while the asynchronous writer delivers a batch, as pieces of the
+// buffer, and written with one writev(2) per descriptor when the batch
+// ends. Kept as offsets: the buffer moves as it grows
+//
+struct fdpiece {
+  int     fd;
+  size_t  offset;
+  size_t  length;
+};
+static thread_local LogBuffer       recbuf;
+static thread_local bool            batching = false;
+static thread_local vector<fdpiece> pieces;
+
+void LoggerTree::begin_batch() {
+  //
+  batching = true;
+}
+
+void LoggerTree::end_batch() {
+  // Descriptors in the order they were first written to. Adjacent pieces
+  // are joined
+  //
+  static thread_local vector<struct iovec> iov;
+
+  batching = false;
+
+  for (size_t first = 0; first < pieces.size(); first++) {
+    int fd = pieces[first].fd;
+    if (fd < 0)
+      continue;
+
+    iov.clear();
+    for (size_t i = first; i < pieces.size(); i++) {
+      fdpiece& piece = pieces[i];
+      if (piece.fd != fd)
+        continue;
+
+      char* data = const_cast<char*>(recbuf.data()) + piece.offset;
+      if (not iov.empty() and
+          (char*) iov.back().iov_base + iov.back().iov_len == data)
+        iov.back().iov_len += piece.length;
+      else {
+        struct iovec v = { data, piece.length };
+        iov.push_back(v);
+      }
+      piece.fd = -1;
+    }
+
+    for (size_t i = 0; i < iov.size(); i += IOV_MAX)
+      Handler::fd_write(fd, iov.data() + i,
+                        min(iov.size() - i, (size_t) IOV_MAX));
+  }
+
+  pieces.clear();
+  recbuf.clear();
+  recbuf.trim(LOGBUFFER_RETAIN);
+}
+
+void LoggerTree::deliver(const LogRecord& record) {
+  // Walk up the tree writing the record to every handler found, at or
+  // above its level. Caller must hold logging::logmutex, at least shared
+  //
+  // The record is rendered once per distinct formatter. Renderings are
+  // kept side by side in the thread buffer for the rest of the walk
+  // Captured arguments are rendered into a message the first time a text
+  // handler needs it. Binary files take them as they are
+  // Text records longer than the limit of a handler are cut for it alone
+  //
+  struct rendering {
+    const Formatter* formatter;
+    size_t           offset;
+    size_t           length;
+  };
+  static thread_local LogBuffer msgbuf;
+  static thread_local LogBuffer flatbuf;
+  static thread_local LogBuffer clipbuf;
+
+  LogRecord rendered(record);            // copy, not a new timestamp
+  const LogRecord* rec = &record;
+
+  // structured records as plain text, for binary files and network sinks
+  //
+  LogRecord flat(record);
+  bool      flattened = false;
+
+  auto flatten = [&]() -> const LogRecord& {
+    if (not flattened) {
+      flatbuf.clear();
+      flatbuf.append(record.message, record.msglen);
+      Formatter::format_fields(flatbuf, record.fields, record.nfields,
+                               FORMAT_TEXT);
+      flat.message = flatbuf.data();
+      flat.msglen  = flatbuf.size();
+      flat.fields  = nullptr;
+      flat.nfields = 0;
+      flattened    = true;
+    }
+    return flat;
+  };
+
+  rendering renderings[RENDER_CACHE_SIZE];
+  size_t nrenderings = 0;
+
+  // the default formatter is created once and never replaced
+  //
+  static Formatter* def_formatter = get_def_formatter().get();
+
+  if (not batching)
+    recbuf.clear();
+
+  // time spent formatting and writing, if requested, measured in laps
+  //
+  ThreadStats&       stats  = ThreadStats::get();
+  bool               timing = logging::stattiming.load(memory_order_relaxed);
+  unsigned long long lap    = timing ? logging::stats_clock() : 0;
+
+  auto lap_to = [&](statcounter_t counter) {
+    unsigned long long now = logging::stats_clock();
+    stats.add(counter, now - lap);
+    lap = now;
+  };
+
+  LoggerTree* instance = this;
+
+  // the message, rendered from the captured arguments the first time a
+  // handler needs it
+  //
+  auto message = [&]() -> const LogRecord& {
+    if (rec->render) {
+      msgbuf.clear();
+      record.render(msgbuf, record.format, record.args);
+      rendered.message = msgbuf.data();
+      rendered.msglen  = msgbuf.size();
+      rendered.render  = nullptr;
+      rec = &rendered;
+    }
+    return *rec;
+  };
+
+  // the record as rendered by 'fmt', cut to the limit of handler 'kind'
+  // (bit position). Structured records are kept whole, so that they stay
+  // well formed
+  //
+  auto format = [&](Formatter* fmt, int kind, const char*& text) -> size_t {
+    const LogRecord& r = message();
+
+    size_t offset = 0;
+    size_t length = 0;
+    size_t i      = 0;
+
+    while (i < nrenderings and renderings[i].formatter != fmt)
+      i++;
+
+    if (i < nrenderings) {
+      // already rendered by this formatter
       //
-      if (instance->outstream) {
-        *instance->outstream << record;
-        if (lev_formatter->eol)
-          *instance->outstream << endl;
+      offset = renderings[i].offset;
+      length = renderings[i].length;
+    }
+    else {
+      // retain original 'level' and 'modname' values across loggers
+      //
+      offset = recbuf.size();
+      fmt->format_record(recbuf, r, modname);
+      if (fmt->eol)
+        recbuf.append('\n');
+      length = recbuf.size() - offset;
+
+      if (nrenderings < RENDER_CACHE_SIZE) {
+        rendering rd = { fmt, offset, length };
+        renderings[nrenderings++] = rd;
       }
-      if (instance->logfile and instance->logfile->is_open()) {
-        // log to log file
-        //
-        *instance->logfile << record;
-        if (lev_formatter->eol)
-          *instance->logfile << endl;
-        instance->logfile->flush();
+    }
+    if (timing)
+      lap_to(STAT_FORMAT_NS);
+
+    text = recbuf.data() + offset;
+    if (fmt->mode != FORMAT_TEXT)
+      return length;
+    return Handler::clip(text, length, instance->recordmax[kind], clipbuf);
+  };
+
+  // binary files take the record unrendered, network sinks the message
+  // and a header of their own
+  //
+  auto emit_binary = [&](BinaryHandler* handler) {
+    handler->emit_record(record.nfields ? flatten() : record, modname);
+    if (timing)
+      lap_to(STAT_WRITE_NS);
+  };
+
+  auto emit_network = [&](NetworkHandler* handler) {
+    LogRecord clipped(message().nfields ? flatten() : *rec);
+    clipped.msglen = Handler::clip(clipped.message, clipped.msglen,
+                                   instance->recordmax[3], clipbuf);
+    handler->emit_record(clipped, modname);
+    if (timing)
+      lap_to(STAT_WRITE_NS);
+  };
+
+  while (instance) {
+    // Handler levels are checked before anything gets rendered
+    //
+    const int* minlevel = instance->handlerlevel;
+    int        level    = record.level;
+
+    Formatter* lev_formatter = instance->formatter.get();
+    if (not lev_formatter)
+      lev_formatter = def_formatter;
+
+    const char* text;
+    size_t      n;
+
+    if (instance->binfile and level >= minlevel[4])
+      emit_binary(instance->binfile);
+
+    if (instance->netsink and level >= minlevel[3])
+      emit_network(instance->netsink);
+
+    // log to stream if configured
+    //
+    if (instance->outstream and level >= minlevel[0]) {
+      n = format(lev_formatter, 0, text);
+      Handler::stream_write(instance->outstream, text, n);
+      instance->streambytes.fetch_add(n, memory_order_relaxed);
+      stats.add(STAT_BYTES, n);
+      if (timing)
+        lap_to(STAT_WRITE_NS);
+    }
+
+    // or to the descriptor. Records cut for the handler are in 'clipbuf'
+    // and get copied to be gathered
+    //
+    if (instance->outfd >= 0 and level >= minlevel[0]) {
+      n = format(lev_formatter, 0, text);
+      if (batching) {
+        const char* begin  = recbuf.data();
+        size_t      offset = recbuf.size();
+
+        if (less_equal<const char*>()(begin, text) and
+            less<const char*>()(text, begin + offset))
+          offset = text - begin;
+        else
+          recbuf.append(text, n);
+
+        fdpiece piece = { instance->outfd, offset, n };
+        pieces.push_back(piece);
+      }
+      else {
+        struct iovec iov = { const_cast<char*>(text), n };
+        Handler::fd_write(instance->outfd, &iov, 1);
+      }
+      instance->streambytes.fetch_add(n, memory_order_relaxed);
+      stats.add(STAT_BYTES, n);
+      if (timing)
+        lap_to(STAT_WRITE_NS);
+    }
+
+    // log to log file
+    //
+    if (instance->logfile and instance->logfile->is_open() and
+        level >= minlevel[1]) {
+      n = format(lev_formatter, 1, text);
+      instance->logfile->emit(text, n, level);
+      if (timing)
+        lap_to(STAT_WRITE_NS);
+    }
+    if (instance->shardfile and level >= minlevel[1]) {
+      n = format(lev_formatter, 1, text);
+      instance->shardfile->emit(text, n, level, record.stamp);
+      if (timing)
+        lap_to(STAT_WRITE_NS);
+    }
+
+    // log to memory mapped ring
+    //
+    if (instance->ringfile and level >= minlevel[2]) {
+      n = format(lev_formatter, 2, text);
+      instance->ringfile->emit(text, n, level);
+      if (timing)
+        lap_to(STAT_WRITE_NS);
+    }
+
+    // handler chain, in the order the handlers were added
+    //
+    for (const LogTarget& target : instance->chain) {
+      if (level < target.level)
+        continue;
+
+      if (target.kind == HANDLER_BINFILE)
+        emit_binary(static_cast<BinaryHandler*>(target.handler));
+      else if (target.kind == HANDLER_NETSINK)
+        emit_network(static_cast<NetworkHandler*>(target.handler));
+      else {
+        Formatter* fmt = target.formatter ? target.formatter.get()
+                                          : lev_formatter;
+        int kind = target.kind == HANDLER_STREAM  ? 0 :
+                   target.kind == HANDLER_LOGFILE ? 1 : 2;
+
+        n = format(fmt, kind, text);
+        target.handler->emit(text, n, level);
+        if (timing)
+          lap_to(STAT_WRITE_NS);
       }
     }
 
@@ -536,4 +1327,13 @@ void LoggerTree::logaux(int level, const char* format, va_list vl) {
 
     instance = instance->parent.get();
   }
+
+  // give back the storage grown by large records. The record buffer at
+  // the end of the batch, if any
+  //
+  if (not batching)
+    recbuf.trim(LOGBUFFER_RETAIN);
+  msgbuf.trim(LOGBUFFER_RETAIN);
+  flatbuf.trim(LOGBUFFER_RETAIN);
+  clipbuf.trim(LOGBUFFER_RETAIN);
 }
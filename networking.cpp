@@ -0,0 +1,480 @@
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Network sink
+//
+// Callers frame the record outside any lock, then append it to the
+// filling queue under hmutex. The sender swaps the queues under hmutex
+// and sends the full one with the lock released, so callers only ever
+// wait for a memcpy. The sender is woken when a record lands in an empty
+// queue; records arriving while it sends are picked up in the next batch
+//
+// Over TCP the queue is written as it is, records being length prefixed.
+// Over UDP each record is a datagram. On a send error the connection is
+// dropped along with the rest of the batch and retried with backoff, up to
+// NET_RETRY_MAX ms. Meanwhile new records are queued until the queue fills
+//
+
+// syslog severity by log level
+//
+static const int severities[] = { 7,        // NOTSET   -> debug
+                                  7,        // DEBUG    -> debug
+                                  6,        // INFO     -> informational
+                                  4,        // WARNING  -> warning
+                                  3,        // ERROR    -> error
+                                  2 };      // CRITICAL -> critical
+
+NetworkHandler::NetworkHandler(const string& address, int protocol,
+                               int facility, size_t queuesize) :
+                               protocol(protocol),
+                               facility(facility),
+                               queuesize(queuesize),
+                               pid(getpid()),
+                               sock(-1),
+                               filling(0),
+                               running(true),
+                               busy(false),
+                               ndrops(0) {
+  // 'address' is host:port, [ipv6 address]:port or just host for the
+  // standard syslog ports. Names are resolved by the sender thread
+  //
+  size_t colon = address.rfind(':');
+
+  if (not address.empty() and address[0] == '[') {
+    size_t close = address.find(']');
+    if (close != string::npos) {
+      host = address.substr(1, close - 1);
+      if (close + 1 < address.size() and address[close + 1] == ':')
+        port = address.substr(close + 2);
+    }
+  }
+  else if (colon != string::npos and address.find(':') == colon) {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  }
+  else
+    host = address;
+
+  if (port.empty() and not host.empty())
+    port = protocol == NET_TCP ? "601" : "514";
+  if (host.empty() or (protocol != NET_UDP and protocol != NET_TCP))
+    port = string();
+
+  char name[256];
+  if (gethostname(name, sizeof(name)) == 0) {
+    name[sizeof(name) - 1] = '\0';
+    hostname = name;
+  }
+  else
+    hostname = "-";
+#ifdef __GLIBC__
+  appname = program_invocation_short_name;
+#else
+  appname = "-";
+#endif
+
+  if (is_open())
+    sender = thread(&NetworkHandler::run, this);
+
+  Handler::enlist(this);
+}
+
+NetworkHandler::~NetworkHandler() {
+  // Let the sender try once more with what is queued. Dropped records
+  // are reported by Logger::stats()
+  //
+  Handler::delist(this);
+
+  {
+    lock_guard<mutex> lock(hmutex);
+    running = false;
+  }
+  wake.notify_all();
+
+  if (sender.joinable())
+    sender.join();
+  if (sock >= 0)
+    close(sock);
+}
+
+void NetworkHandler::frame(LogBuffer& out, int level,
+                           const struct timespec& stamp, const string& name,
+                           const char* message, size_t length) {
+  // <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID - MSG
+  // The logger name is the MSGID, cut to the 32 characters allowed
+  //
+  struct tm tm;
+  char      timestamp[40];
+
+  gmtime_r(&stamp.tv_sec, &tm);
+  size_t n = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(timestamp + n, sizeof(timestamp) - n, ".%06ldZ",
+           stamp.tv_nsec / 1000);
+
+  int pri = facility * 8 + severities[min(max(level, (int) MINLOG),
+                                           (int) MAXLOG)];
+
+  char header[64];
+  int  hlen = snprintf(header, sizeof(header), "<%d>1 %s ", pri, timestamp);
+
+  out.append(header, hlen);
+  out.append(hostname);
+  out.append(' ');
+  out.append(appname);
+  hlen = snprintf(header, sizeof(header), " %ld ", pid);
+  out.append(header, hlen);
+  out.append(name.empty() ? "-" : name.c_str(),
+             name.empty() ? 1 : min(name.size(), (size_t) 32));
+  out.append(" - ", 3);
+
+  if (protocol == NET_UDP)
+    length = min(length, NET_MAX_DATAGRAM - min(out.size(),
+                                                 (size_t) NET_MAX_DATAGRAM));
+  out.append(message, length);
+}
+
+void NetworkHandler::enqueue(const LogBuffer& framed) {
+  // Append to the filling queue, or drop if it is full. Never waits for
+  // the sender
+  //
+  char prefix[24];
+  int  plen = 0;
+
+  if (protocol == NET_TCP)
+    plen = snprintf(prefix, sizeof(prefix), "%zu ", framed.size());
+
+  bool wasempty;
+  {
+    lock_guard<mutex> lock(hmutex);
+
+    LogBuffer& q = queue[filling];
+    if (q.size() + plen + framed.size() > queuesize) {
+      ndrops.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+    wasempty = q.size() == 0;
+    q.append(prefix, plen);
+    q.append(framed.data(), framed.size());
+    ends[filling].push_back(q.size());
+  }
+
+  if (wasempty)
+    wake.notify_one();
+}
+
+void NetworkHandler::emit(const char* record, size_t length, int level) {
+  // A formatted record. Strip the line end, stamp it now
+  //
+  if (not is_open())
+    return;
+
+  static thread_local LogBuffer framed;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (length > 0 and record[length - 1] == '\n')
+    length--;
+
+  framed.clear();
+  frame(framed, level, now, string(), record, length);
+  enqueue(framed);
+}
+
+void NetworkHandler::emit_record(const LogRecord& rec, const string& name) {
+  // The message goes as it is. Header fields take the place of the record
+  // formatting. 'rec' must have been rendered
+  //
+  if (not is_open())
+    return;
+
+  static thread_local LogBuffer framed;
+
+  framed.clear();
+  frame(framed, rec.level, rec.stamp, name, rec.message, rec.msglen);
+  enqueue(framed);
+}
+
+bool NetworkHandler::connect_socket() {
+  // Resolve the collector and connect a non-blocking socket to it, giving
+  // up after NET_TIMEOUT ms. A connected UDP socket needs no address to
+  // send and reports unreachable collectors
+  //
+  struct addrinfo hints;
+  struct addrinfo* found = nullptr;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = protocol == NET_TCP ? SOCK_STREAM : SOCK_DGRAM;
+
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+    return false;
+
+  for (struct addrinfo* ai = found; ai and sock < 0; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd < 0)
+      continue;
+
+    int rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+    if (rc < 0 and errno == EINPROGRESS) {
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      int       err = ETIMEDOUT;
+      socklen_t len = sizeof(err);
+
+      if (poll(&pfd, 1, NET_TIMEOUT) == 1)
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      rc = err == 0 ? 0 : -1;
+    }
+
+    if (rc == 0)
+      sock = fd;
+    else
+      close(fd);
+  }
+  freeaddrinfo(found);
+
+  return sock >= 0;
+}
+
+size_t NetworkHandler::send_queue(const LogBuffer& data,
+                                  const vector<size_t>& bounds) {
+  // Send a queue. Return the number of records sent in full
+  //
+  size_t nrecords = bounds.size();
+  size_t sent     = 0;          // records
+  size_t offset   = 0;          // bytes
+
+  auto wait_writable = [this]() {
+    struct pollfd pfd = { sock, POLLOUT, 0 };
+    return poll(&pfd, 1, NET_TIMEOUT) == 1;
+  };
+
+  if (protocol == NET_TCP) {
+    while (offset < data.size()) {
+      ssize_t n = send(sock, data.data() + offset, data.size() - offset,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n > 0) {
+        offset += n;
+        count_bytes(n);
+        continue;
+      }
+      if (n < 0 and errno == EINTR)
+        continue;
+      if (n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK) and
+          wait_writable())
+        continue;
+      break;
+    }
+    while (sent < nrecords and bounds[sent] <= offset)
+      sent++;
+
+    return sent;
+  }
+
+  // UDP. Up to NET_BATCH_SIZE datagrams per system call
+  //
+  while (sent < nrecords) {
+    struct iovec iov[NET_BATCH_SIZE];
+    size_t nbatch = min(nrecords - sent, (size_t) NET_BATCH_SIZE);
+    size_t start  = sent > 0 ? bounds[sent - 1] : 0;
+
+    for (size_t i = 0; i < nbatch; i++) {
+      size_t end = bounds[sent + i];
+      iov[i].iov_base = const_cast<char*>(data.data()) + start;
+      iov[i].iov_len  = end - start;
+      start = end;
+    }
+
+    int n;
+#ifdef __linux__
+    struct mmsghdr msgs[NET_BATCH_SIZE];
+
+    memset(msgs, 0, nbatch * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < nbatch; i++) {
+      msgs[i].msg_hdr.msg_iov    = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = sendmmsg(sock, msgs, nbatch, MSG_DONTWAIT);
+#else
+    n = send(sock, iov[0].iov_base, iov[0].iov_len, MSG_DONTWAIT) < 0 ? -1 : 1;
+#endif
+    if (n > 0) {
+      for (int i = 0; i < n; i++)
+        count_bytes(iov[i].iov_len);
+      sent += n;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno == EAGAIN or errno == EWOULDBLOCK) and wait_writable())
+      continue;
+    if (errno == ECONNREFUSED) {
+      // no collector listening right now. Skip the datagram
+      //
+      ndrops.fetch_add(1, memory_order_relaxed);
+      sent++;
+      continue;
+    }
+    break;
+  }
+
+  return sent;
+}
+
+void NetworkHandler::run() {
+  // Sender thread main loop
+  // Exit once stopped, after a last attempt at sending the queue
+  //
+  int retry = 0;                // current backoff (ms)
+
+  unique_lock<mutex> lock(hmutex);
+
+  while (true) {
+    wake.wait(lock, [this] { return queue[filling].size() > 0 or
+                                    not running; });
+    if (queue[filling].size() == 0)
+      break;
+
+    // take the queue. Callers go on with the other one
+    //
+    int sending = filling;
+    filling = 1 - filling;
+    bool last = not running;
+    busy = true;
+    lock.unlock();
+
+    size_t nrecords = ends[sending].size();
+    size_t sent     = 0;
+
+    if (sock >= 0 or connect_socket()) {
+      sent = send_queue(queue[sending], ends[sending]);
+      if (sent < nrecords) {
+        close(sock);
+        sock = -1;
+      }
+    }
+    ndrops.fetch_add(nrecords - sent, memory_order_relaxed);
+    queue[sending].clear();
+    ends[sending].clear();
+
+    lock.lock();
+    busy = false;
+    idle.notify_all();
+
+    if (last)
+      break;
+
+    if (sent < nrecords) {
+      // back off before reconnecting. Records keep being queued
+      //
+      retry = min(max(2 * retry, 100), (int) NET_RETRY_MAX);
+      wake.wait_for(lock, chrono::milliseconds(retry),
+                    [this] { return not running; });
+    }
+    else
+      retry = 0;
+  }
+}
+
+void NetworkHandler::flush() {
+  // Wait for the queued records to be sent, or dropped, for up to
+  // NET_TIMEOUT ms
+  //
+  unique_lock<mutex> lock(hmutex);
+
+  if (not sender.joinable())
+    return;
+
+  idle.wait_for(lock, chrono::milliseconds(NET_TIMEOUT),
+                [this] { return queue[filling].size() == 0 and not busy; });
+}
+
+void NetworkHandler::atfork(int stage) {
+  // The child drops the inherited queues, which the parent sends, and
+  // starts a sender and a connection of its own
+  //
+  if (stage == FORK_PREPARE) {
+    hmutex.lock();
+    return;
+  }
+  if (stage == FORK_PARENT) {
+    hmutex.unlock();
+    return;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    queue[i].clear();
+    ends[i].clear();
+  }
+  busy = false;
+  if (sock >= 0)
+    close(sock);
+  sock = -1;
+  pid  = getpid();
+  logging::forget_thread(sender);
+
+  hmutex.unlock();
+
+  if (is_open() and running)
+    sender = thread(&NetworkHandler::run, this);
+}
+
+//////////// Network sink configuration
+//
+// Send records to a syslog collector at 'address' (host[:port]) over
+// NET_UDP or NET_TCP, with the given syslog facility (safe)
+// An empty address closes the current sink. The old sink is closed with
+// logmutex released, since it may wait for the network to take the last
+// records
+//
+int Logger::set_netsink(const string& address, int protocol, int facility,
+                        size_t queuesize) {
+  //
+  NetworkHandler* sink    = nullptr;
+  bool            invalid = false;
+
+  TimedLock<mutex> lock(logging::filemutex);
+
+  // resolved and closed with logmutex free
+  if (not address.empty()) {
+    sink = new NetworkHandler(address, protocol, facility, queuesize);
+    if (not sink->is_open()) {
+      invalid = true;
+      delete sink;
+      sink = nullptr;
+    }
+  }
+
+  {
+    TimedLock<RWMutex> loglock(logging::logmutex);
+
+    swap(treeptr->netsink, sink);
+    treeptr->netaddr = treeptr->netsink ? address : string();
+  }
+
+  delete sink;
+
+  if (invalid) {
+    error("invalid network sink '%s'", address.c_str());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,309 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Asynchronous delivery
+//
+// A bounded queue sits between the callers and the logger tree. Callers
+// format the message and push the record; a single writer thread pops
+// records in batches and runs the handlers on them
+//
+// Producers and the consumer only meet on the queue mutex. The writer
+// takes logging::logmutex (shared) once per batch, never while holding
+// qmutex
+//
+// Records are numbered as they are queued, so that drain() can wait for
+// those queued before it while producers go on
+//
+
+atomic<LogQueue*> LogQueue::active(nullptr);
+
+
+LogQueue::LogQueue(size_t capacity, int overflow, int droplevel) :
+                         ring(capacity),
+                         head(0),
+                         count(0),
+                         overflow(overflow),
+                         droplevel(droplevel),
+                         running(true),
+                         dropped(0),
+                         pushed(0),
+                         delivered(0) {
+  // start the writer once all members are in place
+  //
+  writer = thread(&LogQueue::run, this);
+
+  active.store(this);
+}
+
+LogQueue::~LogQueue() {
+  // Stop accepting records, let the writer drain the queue and wait for it
+  //
+  LogQueue* self = this;
+  active.compare_exchange_strong(self, nullptr);
+
+  {
+    lock_guard<mutex> lock(qmutex);
+    running = false;
+  }
+  notempty.notify_all();
+  notfull.notify_all();
+
+  if (writer.joinable())
+    writer.join();
+
+  if (dropped > 0)
+    LoggerTree::get_root_logger()->autolog(WARNING,
+                        "asynchronous queue dropped %lu records", dropped);
+}
+
+bool LogQueue::push(const logptr_t& origin, const LogRecord& record) {
+  // Enqueue a record. The message is copied into the slot storage, which
+  // keeps its capacity across records
+  // Return false if the record has been discarded
+  //
+  unique_lock<mutex> lock(qmutex);
+
+  if (count == ring.size()) {
+    // queue full. Apply the overflow policy
+    //
+    if (overflow == OVERFLOW_DROP or
+        (overflow == OVERFLOW_DROPLEVEL and record.level < droplevel)) {
+      ++dropped;
+      return false;
+    }
+    notfull.wait(lock, [this] { return count < ring.size() or not running; });
+  }
+
+  if (not running) {
+    ++dropped;
+    return false;
+  }
+
+  entry& slot = ring[(head + count) % ring.size()];
+  slot.origin = origin;
+  slot.record = record;
+  if (record.render)
+    slot.text.assign(record.args, record.argslen);
+  else
+    slot.text.assign(record.message, record.msglen);
+
+  // fields of structured records, with their keys and strings
+  //
+  slot.fields.assign(record.fields, record.fields + record.nfields);
+  slot.fieldtext.clear();
+  for (const LogField& field : slot.fields) {
+    slot.fieldtext.append(field.key, field.keylen);
+    if (field.type == LogField::FIELD_STRING)
+      slot.fieldtext.append(field.value.str.data, field.value.str.length);
+  }
+  if (record.threadname)
+    slot.threadname.assign(record.threadname);
+  // shares the context levels, which are immutable
+  //
+  if (record.context)
+    slot.context = record.context->shared_from_this();
+  else
+    slot.context.reset();
+  ++count;
+  ++pushed;
+
+  lock.unlock();
+  notempty.notify_one();
+
+  return true;
+}
+
+void LogQueue::run() {
+  // Writer thread main loop
+  // Exit only when the queue is stopped and empty
+  //
+  vector<entry> batch(min(ring.size(), (size_t) QUEUE_BATCH_SIZE));
+
+  // batch storage is swapped into the slots. Sized up front, or each entry
+  // would make a producer allocate the first time a batch reaches it
+  //
+  for (entry& e : batch)
+    e.text.reserve(LOGBUFFER_CAPACITY);
+
+  while (true) {
+    size_t n = 0;
+    {
+      unique_lock<mutex> lock(qmutex);
+
+      notempty.wait(lock, [this] { return count > 0 or not running; });
+      if (count == 0)
+        break;
+
+      while (count > 0 and n < batch.size()) {
+        swap(batch[n++], ring[head]);
+        head = (head + 1) % ring.size();
+        --count;
+      }
+    }
+    notfull.notify_all();
+
+    // deliver the whole batch under a single lock. Records for
+    // descriptors go out together at the end
+    //
+    {
+      TimedSharedLock lock(logging::logmutex);
+
+      LoggerTree::begin_batch();
+      for (size_t i = 0; i < n; i++) {
+        // storage moved along with the slot. Point the message, or the
+        // captured arguments, at it
+        //
+        LogRecord& record = batch[i].record;
+
+        if (record.render)
+          record.args    = batch[i].text.data();
+        else
+          record.message = batch[i].text.data();
+
+        const char* p = batch[i].fieldtext.data();
+        for (LogField& field : batch[i].fields) {
+          field.key = p;
+          p += field.keylen;
+          if (field.type == LogField::FIELD_STRING) {
+            field.value.str.data = p;
+            p += field.value.str.length;
+          }
+        }
+        record.fields = batch[i].fields.data();
+        if (record.threadname)
+          record.threadname = batch[i].threadname.c_str();
+        record.context = batch[i].context.get();
+
+        batch[i].origin->deliver(record);
+      }
+      LoggerTree::end_batch();
+    }
+
+    {
+      lock_guard<mutex> lock(qmutex);
+      delivered += n;
+    }
+    progress.notify_all();
+
+    // release loggers outside logmutex. The last reference to a logger
+    // runs its destructor, which closes its files and autologs
+    // Storage grown by large records is given back too, or it would stay
+    // with the slots
+    //
+    for (size_t i = 0; i < n; i++) {
+      batch[i].origin.reset();
+      batch[i].context.reset();
+      if (batch[i].text.capacity() > LOGBUFFER_RETAIN)
+        string().swap(batch[i].text);
+      if (batch[i].fieldtext.capacity() > LOGBUFFER_RETAIN)
+        string().swap(batch[i].fieldtext);
+    }
+  }
+}
+
+bool LogQueue::drain(int timeout) {
+  // Records queued from now on are not waited for
+  //
+  unique_lock<mutex> lock(qmutex);
+
+  unsigned long long target = pushed;
+
+  return progress.wait_for(lock, chrono::milliseconds(max(timeout, 0)),
+                           [this, target] { return delivered >= target; });
+}
+
+bool LogQueue::stop(int timeout) {
+  // Refuse new records and give the writer 'timeout' ms to deliver the
+  // pending ones. Those left are discarded and counted as dropped
+  // Return false if any was
+  //
+  bool complete;
+  {
+    unique_lock<mutex> lock(qmutex);
+
+    running = false;
+    notempty.notify_all();
+    notfull.notify_all();
+
+    complete = progress.wait_for(lock, chrono::milliseconds(max(timeout, 0)),
+                                 [this] { return delivered >= pushed; });
+    if (not complete) {
+      dropped   += count;
+      delivered += count;
+      count      = 0;
+    }
+  }
+
+  if (writer.joinable())
+    writer.join();
+
+  return complete;
+}
+
+void LogQueue::atfork(int stage) {
+  // The writer thread does not survive fork(). The child gets a queue of
+  // its own with the same settings. The inherited one, holding records
+  // that are the parent's to write, is never released: its destructor
+  // would wait for the missing writer
+  // The child runs a single thread, no atomic access needed
+  //
+  if (stage != FORK_CHILD)
+    return;
+
+  shared_ptr<LogQueue>& queue = LoggerTree::get_async_queue();
+  if (not queue)
+    return;
+
+  shared_ptr<LogQueue> fresh = make_shared<LogQueue>(queue->ring.size(),
+                                                     queue->overflow,
+                                                     queue->droplevel);
+  new shared_ptr<LogQueue>(queue);
+  queue = fresh;
+}
+
+void LogQueue::emergency_drain(int fd) {
+  // Messages of the records still queued, as "LEVEL logger: message"
+  // Nothing is formatted: deferred records give their format instead.
+  // The batch in the hands of the writer is lost. No locks are taken
+  //
+  LogQueue* queue = active.load();
+  if (not queue)
+    return;
+
+  size_t slots = queue->ring.size();
+
+  for (size_t i = 0; i < queue->count and i < slots; i++) {
+    const entry& slot = queue->ring[(queue->head + i) % slots];
+    const LogRecord& rec = slot.record;
+
+    const char* level = Formatter::level_to_string(rec.level, true);
+    const char* text  = slot.text.data();
+    size_t      len   = slot.text.size();
+    if (rec.render) {
+      text = rec.format;
+      len  = strlen(rec.format);
+    }
+
+    const string& name = slot.origin->modname;
+    struct iovec iov[6] = {
+      { const_cast<char*>(level), strlen(level) },
+      { const_cast<char*>(" "), name.empty() ? 0 : (size_t) 1 },
+      { const_cast<char*>(name.data()), name.size() },
+      { const_cast<char*>(": "), 2 },
+      { const_cast<char*>(text), len },
+      { const_cast<char*>("\n"), 1 } };
+
+    if (writev(fd, iov, 6) < 0)
+      break;
+  }
+}
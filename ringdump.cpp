@@ -0,0 +1,29 @@
+/*
+Dump a memory mapped ring log file
+
+    usage: ringdump <ring file>
+
+*/
+
+#include <unistd.h>
+
+#include <iostream>
+
+#include "logging.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " <ring file>" << endl;
+    return 2;
+  }
+
+  if (RingHandler::dump(argv[1], STDOUT_FILENO) != 0) {
+    cerr << argv[0] << ": cannot dump ring file " << argv[1] << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <string.h>
+
+#include <memory>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Diagnostic context
+//
+// The context of a thread is a chain of LogContext levels, one per
+// field, reached through logging::context. Levels are immutable once
+// pushed and shared: a record queued for the writer thread keeps the
+// level it was created under, and with it the enclosing ones, after the
+// scope has ended
+//
+// Each level carries the encoding of its field and of the whole context
+// for every output mode, built once when the field is pushed
+//
+
+LogScope::LogScope(const LogField& field) : top(nullptr),
+                                            saved(logging::context) {
+  //
+  push(field);
+}
+
+LogScope::LogScope(initializer_list<LogField> fields) : top(nullptr),
+                                                        saved(logging::context) {
+  //
+  for (const LogField& field : fields)
+    push(field);
+}
+
+LogScope::~LogScope() {
+  // levels still referenced by queued records outlive the scope
+  //
+  logging::context = saved;
+}
+
+void LogScope::push(const LogField& field) {
+  //
+  shared_ptr<LogContext> level = make_shared<LogContext>();
+  LogBuffer              out;
+
+  if (logging::context)
+    level->parent = logging::context->shared_from_this();
+  level->key.assign(field.key, field.keylen);
+
+  // the value, as is for strings
+  //
+  if (field.type == LogField::FIELD_STRING)
+    level->value.assign(field.value.str.data, field.value.str.length);
+  else {
+    Formatter::format_value(out, field, FORMAT_TEXT);
+    level->value.assign(out.data(), out.size());
+  }
+
+  out.clear();
+  Formatter::format_key(out, field.key, field.keylen, FORMAT_JSON);
+  out.append(':');
+  Formatter::format_value(out, field, FORMAT_JSON);
+  level->jsonpair.assign(out.data(), out.size());
+
+  out.clear();
+  Formatter::format_key(out, field.key, field.keylen, FORMAT_LOGFMT);
+  out.append('=');
+  Formatter::format_value(out, field, FORMAT_LOGFMT);
+  level->logfmtpair.assign(out.data(), out.size());
+
+  // fields visible from this level, innermost first
+  //
+  vector<const LogContext*> visible;
+
+  for (const LogContext* c = level.get(); c; c = c->parent.get()) {
+    bool hidden = false;
+    for (const LogContext* v : visible)
+      hidden = hidden or v->key == c->key;
+    if (not hidden)
+      visible.push_back(c);
+  }
+
+  for (size_t i = visible.size(); i > 0; i--) {
+    const LogContext* c = visible[i - 1];
+
+    level->json.append(",");
+    level->json.append(c->jsonpair);
+    if (not level->logfmt.empty())
+      level->logfmt.append(" ");
+    level->logfmt.append(c->logfmtpair);
+  }
+
+  top = level;
+  logging::context = level.get();
+}
@@ -0,0 +1,426 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Sharded log files
+//
+// A log file shared by threads on many cores makes every record move the
+// handler mutex and buffer between caches, and between sockets on NUMA
+// hosts. Sharded files give each CPU, or each NUMA node, a stage of its
+// own: callers only touch the stage of the CPU they run on, and a writer
+// thread hands the stages over to the files in big blocks
+//
+// Lock order: wmutex, cyclemutex, stage locks, then file handler mutexes
+// Callers hold a stage lock alone, and take cyclemutex without it
+//
+
+struct alignas(CACHE_LINE_SIZE) ShardedHandler::shard {
+  mutex           lock;         // protect the stage
+  LogBuffer       stage;        // records waiting, back to back
+  vector<staged>  index;        // and their time stamps, for SHARD_MERGE
+  int             level;        // highest level staged
+  // being handed over (cyclemutex)
+  LogBuffer       outgoing;
+  vector<staged>  outindex;
+  int             outlevel;
+  //
+  shard() : level(NOTSET), outlevel(NOTSET) {}
+};
+
+static bool read_cpulist(const string& path, vector<int>& cpus) {
+  // Lists as in /sys/devices/system/node: "0-3,8-11"
+  //
+  ifstream in(path);
+  string   list;
+
+  if (not getline(in, list))
+    return false;
+
+  const char* p = list.c_str();
+  while (*p) {
+    char* end;
+    long  first = strtol(p, &end, 10);
+    if (end == p)
+      break;
+
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+
+    if (*p != ',')
+      break;
+    p++;
+  }
+
+  return true;
+}
+
+ShardedHandler::ShardedHandler(const string& fname, size_t bufsize,
+                               int flushlevel, int interval, int sharding) :
+                         sharding(sharding),
+                         flushlevel(flushlevel),
+                         interval(interval > 0 ? interval
+                                               : DEFAULT_SHARD_INTERVAL),
+                         nshards(1),
+                         shards(nullptr),
+                         pending(false),
+                         running(true) {
+  // Shards by CPU, or by NUMA node as listed by sysfs. A host without
+  // NUMA information is a single node
+  //
+  long ncpus = max(sysconf(_SC_NPROCESSORS_CONF), 1L);
+
+  shardof.assign(ncpus, 0);
+
+  if (sharding & SHARD_NODE) {
+    vector<int> nodes;
+
+    read_cpulist("/sys/devices/system/node/online", nodes);
+    for (size_t i = 0; i < nodes.size() and i < MAX_SHARDS; i++) {
+      vector<int> cpus;
+
+      read_cpulist("/sys/devices/system/node/node" + to_string(nodes[i]) +
+                   "/cpulist", cpus);
+      for (int cpu : cpus)
+        if (cpu >= 0 and cpu < ncpus)
+          shardof[cpu] = i;
+      nshards = i + 1;
+    }
+  }
+  else {
+    nshards = min(ncpus, (long) MAX_SHARDS);
+    for (long cpu = 0; cpu < ncpus; cpu++)
+      shardof[cpu] = cpu % nshards;
+  }
+
+  // new does not align to cache lines before C++17
+  //
+  void* p = nullptr;
+  if (posix_memalign(&p, CACHE_LINE_SIZE, nshards * sizeof(shard)) != 0)
+    throw bad_alloc();
+
+  shards = static_cast<shard*>(p);
+  for (size_t i = 0; i < nshards; i++)
+    new (&shards[i]) shard();
+
+  // the files are reached through this handler only
+  //
+  size_t nfiles = (sharding & SHARD_MERGE) ? 1 : nshards;
+
+  for (size_t i = 0; i < nfiles; i++) {
+    string name = i == 0 ? fname : fname + "." + to_string(i);
+
+    files.push_back(new FileHandler(name, bufsize, flushlevel, interval));
+    Handler::delist(files.back());
+  }
+
+  if (is_open()) {
+    writer = thread(&ShardedHandler::run, this);
+    Handler::enlist(this);
+  }
+}
+
+ShardedHandler::~ShardedHandler() {
+  // Stop the writer and hand over what is left. The files flush on close
+  //
+  Handler::delist(this);
+
+  {
+    lock_guard<mutex> lock(wmutex);
+    running = false;
+  }
+  wake.notify_all();
+
+  if (writer.joinable())
+    writer.join();
+
+  cycle();
+
+  for (FileHandler* file : files)
+    delete file;
+
+  for (size_t i = 0; i < nshards; i++)
+    shards[i].~shard();
+  free(shards);
+}
+
+bool ShardedHandler::is_open() {
+  //
+  for (FileHandler* file : files)
+    if (not file->is_open())
+      return false;
+
+  return true;
+}
+
+int ShardedHandler::open_error() {
+  // of the first file that failed to open
+  //
+  for (FileHandler* file : files)
+    if (not file->is_open())
+      return file->open_error();
+
+  return 0;
+}
+
+unsigned long long ShardedHandler::file_bytes() {
+  //
+  unsigned long long total = 0;
+
+  for (FileHandler* file : files)
+    total += file->bytes();
+
+  return total;
+}
+
+unsigned long long ShardedHandler::file_flushes() {
+  //
+  unsigned long long total = 0;
+
+  for (FileHandler* file : files)
+    total += file->flushes();
+
+  return total;
+}
+
+void ShardedHandler::set_policy(size_t bufsize, int new_flushlevel,
+                                int new_interval) {
+  // Callers do not log meanwhile: settings change with logmutex held
+  // exclusive
+  //
+  {
+    lock_guard<mutex> lock(wmutex);
+
+    flushlevel = new_flushlevel;
+    interval   = new_interval > 0 ? new_interval : DEFAULT_SHARD_INTERVAL;
+  }
+
+  for (FileHandler* file : files)
+    file->set_policy(bufsize, new_flushlevel, new_interval);
+}
+
+void ShardedHandler::set_rotation(const LogRotation& rotation) {
+  // every file rotates on its own
+  //
+  for (FileHandler* file : files)
+    file->set_rotation(rotation);
+}
+
+size_t ShardedHandler::current_shard() {
+  // the calling thread may move to another CPU right away. Any shard is
+  // correct, the right one just keeps the cache lines local
+  //
+  int cpu = sched_getcpu();
+  if (cpu < 0)
+    return 0;
+
+  return shardof[cpu % shardof.size()];
+}
+
+void ShardedHandler::emit(const char* record, size_t length, int level) {
+  // records with no time stamp of their own are stamped on arrival
+  //
+  struct timespec stamp;
+  clock_gettime(CLOCK_REALTIME, &stamp);
+
+  emit(record, length, level, stamp);
+}
+
+void ShardedHandler::emit(const char* record, size_t length, int level,
+                          const struct timespec& stamp) {
+  //
+  shard& s = shards[current_shard()];
+  bool   wakeup;
+  bool   full;
+
+  {
+    lock_guard<mutex> lock(s.lock);
+
+    if (sharding & SHARD_MERGE) {
+      staged entry = { stamp, s.stage.size(), length };
+      s.index.push_back(entry);
+    }
+    s.stage.append(record, length);
+    s.level = max(s.level, level);
+
+    wakeup = s.stage.size() >= SHARD_STAGE_SIZE or level >= flushlevel;
+    full   = s.stage.size() >= SHARD_STAGE_MAX;
+  }
+
+  // write through once the library has been shut down. A full stage
+  // means the writer is behind: the caller takes its place
+  //
+  if (full or logging::finished.load(memory_order_relaxed))
+    cycle();
+  else if (wakeup and not pending.exchange(true))
+    wake.notify_one();
+}
+
+void ShardedHandler::cycle() {
+  // Hand the stages over to the files. Each stage is swapped out under
+  // its lock and written with no stage lock held
+  // Merged records are put in time stamp order. Records of a shard keep
+  // their order, and records staged after the hand-over wait for the next
+  //
+  lock_guard<mutex> lock(cyclemutex);
+
+  bool merge = sharding & SHARD_MERGE;
+  int  level = NOTSET;
+
+  merged.clear();
+
+  for (size_t i = 0; i < nshards; i++) {
+    shard& s = shards[i];
+    {
+      lock_guard<mutex> slock(s.lock);
+
+      s.outgoing.swap(s.stage);
+      s.outindex.swap(s.index);
+      s.outlevel = s.level;
+      s.level    = NOTSET;
+    }
+
+    if (s.outgoing.size() == 0)
+      continue;
+
+    if (not merge) {
+      files[i]->emit(s.outgoing.data(), s.outgoing.size(), s.outlevel);
+      s.outgoing.trim(SHARD_STAGE_MAX);
+      continue;
+    }
+
+    for (const staged& entry : s.outindex) {
+      mergeitem item = { entry.stamp, s.outgoing.data() + entry.offset,
+                         entry.length };
+      merged.push_back(item);
+    }
+    level = max(level, s.outlevel);
+  }
+
+  if (merge and not merged.empty()) {
+    // the records of a shard lie in order in its stage, so ties are broken
+    // by position. std::sort, as stable_sort allocates a buffer every time
+    //
+    sort(merged.begin(), merged.end(),
+         [](const mergeitem& a, const mergeitem& b) {
+           if (a.stamp.tv_sec != b.stamp.tv_sec)
+             return a.stamp.tv_sec < b.stamp.tv_sec;
+           if (a.stamp.tv_nsec != b.stamp.tv_nsec)
+             return a.stamp.tv_nsec < b.stamp.tv_nsec;
+           return less<const char*>()(a.data, b.data);
+         });
+
+    mergebuf.clear();
+    for (const mergeitem& item : merged)
+      mergebuf.append(item.data, item.length);
+    files[0]->emit(mergebuf.data(), mergebuf.size(), level);
+
+    if (mergebuf.capacity() > SHARD_STAGE_MAX)
+      mergebuf.trim(SHARD_STAGE_MAX);
+  }
+
+  // Stages keep their storage, up to SHARD_STAGE_MAX. They are emptied as
+  // soon as they are in the files, for emergency_drain()
+  //
+  for (size_t i = 0; i < nshards; i++) {
+    shards[i].outgoing.trim(SHARD_STAGE_MAX);
+    shards[i].outindex.clear();
+  }
+}
+
+void ShardedHandler::run() {
+  // Writer thread. Hands over every 'interval' ms, or when asked
+  //
+  unique_lock<mutex> lock(wmutex);
+
+  while (running) {
+    wake.wait_for(lock, chrono::milliseconds(interval),
+                  [this] { return pending.load() or not running; });
+    pending.store(false);
+
+    lock.unlock();
+    cycle();
+    lock.lock();
+  }
+}
+
+void ShardedHandler::flush() {
+  //
+  cycle();
+
+  for (FileHandler* file : files)
+    file->flush();
+}
+
+void ShardedHandler::atfork(int stage) {
+  // The child drops the stages, which are the parent's to write, and
+  // starts a writer of its own
+  //
+  if (stage == FORK_PREPARE) {
+    wmutex.lock();
+    cyclemutex.lock();
+    for (size_t i = 0; i < nshards; i++)
+      shards[i].lock.lock();
+    for (FileHandler* file : files)
+      file->atfork(stage);
+    return;
+  }
+
+  for (FileHandler* file : files)
+    file->atfork(stage);
+
+  if (stage == FORK_CHILD) {
+    for (size_t i = 0; i < nshards; i++) {
+      shard& s = shards[i];
+      s.stage.clear();
+      s.index.clear();
+      s.level = NOTSET;
+      s.outgoing.clear();
+      s.outindex.clear();
+    }
+    pending.store(false);
+
+    logging::forget_thread(writer);
+    if (running)
+      writer = thread(&ShardedHandler::run, this);
+  }
+
+  for (size_t i = nshards; i > 0; i--)
+    shards[i - 1].lock.unlock();
+  cyclemutex.unlock();
+  wmutex.unlock();
+}
+
+void ShardedHandler::emergency_drain() {
+  // File buffers first, they hold the older records. Then the stages
+  // being handed over and the stages, unmerged. The writer thread may be
+  // writing meanwhile: records may be repeated, but not lost
+  //
+  for (FileHandler* file : files)
+    file->emergency_drain();
+
+  for (size_t i = 0; i < nshards; i++) {
+    FileHandler* file = files[(sharding & SHARD_MERGE) ? 0 : i];
+    const shard& s    = shards[i];
+
+    file->emergency_write(s.outgoing.data(), s.outgoing.size());
+    file->emergency_write(s.stage.data(), s.stage.size());
+  }
+}
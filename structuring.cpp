@@ -0,0 +1,315 @@
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "logging.h"
+
+using namespace std;
+
+//////////// Structured records
+//
+// Records logged with key/value fields carry them, typed, as an array
+// referenced by the record. Nothing is rendered until a handler needs it:
+// formatters in FORMAT_JSON and FORMAT_LOGFMT mode encode the record and
+// its fields straight into the output buffer, FORMAT_TEXT formatters
+// append the fields to the message as key=value pairs. Binary files and
+// network sinks get the message with the fields appended the same way
+//
+
+void LoggerTree::logfields(int level, const char* message,
+                           const LogField* fields, size_t nfields) {
+  // The message is taken as it is, not as a format. Rate limits apply,
+  // duplicate suppression does not look at fields and is skipped
+  //
+  if (level < get_effective_loglevel()) {
+    count_filtered();
+    return;
+  }
+  if (not sampled(level))
+    return;
+
+  if (not message)
+    message = "";
+
+  LogFilter* filter = get_filter();
+  if (filter and rate_limited(filter, level, message))
+    return;
+
+  LogRecord record(level);
+  record.message = message;
+  record.msglen  = strlen(message);
+  record.format  = message;
+  record.fields  = fields;
+  record.nfields = nfields;
+
+  dispatch(record);
+}
+
+///////////// Structured output
+//
+void Formatter::format_structured(LogBuffer& out, const LogRecord& rec,
+                                  const string& name,
+                                  const recorigin* origin) {
+  // JSON:   {"time":"...","level":"info","logger":"app","thread":"1a2b",
+  //          "msg":"...","key":value,...}
+  // logfmt: time=... level=info logger=app thread=1a2b msg="..." key=value
+  //
+  // The time is the formatter time format with microseconds. Named
+  // threads add thread_name after thread. Context fields (LogScope) go
+  // between msg and the record fields
+  //
+  static thread_local LogBuffer scratch;
+
+  bool json = mode == FORMAT_JSON;
+
+  scratch.clear();
+  format_time(scratch, rec.stamp);
+  scratch.append('.');
+  format_fraction(scratch, rec.stamp, 6);
+
+  if (json)
+    out.append("{\"time\":", 8);
+  else
+    out.append("time=", 5);
+  format_string(out, scratch.data(), scratch.size(), mode);
+
+  out.append(json ? ",\"level\":\"" : " level=");
+  out.append(level_to_string(rec.level));
+  if (json)
+    out.append('"');
+
+  if (name.size() > 0) {
+    out.append(json ? ",\"logger\":" : " logger=");
+    format_string(out, name.data(), name.size(), mode);
+  }
+
+  out.append(json ? ",\"thread\":\"" : " thread=");
+  if (origin)
+    format_tid(out, origin->tid);
+  else
+    format_tid(out, rec.tid);
+  if (json)
+    out.append('"');
+
+  if (rec.threadname and not origin) {
+    out.append(json ? ",\"thread_name\":" : " thread_name=");
+    format_string(out, rec.threadname, strlen(rec.threadname), mode);
+  }
+
+  out.append(json ? ",\"msg\":" : " msg=");
+  format_string(out, rec.message, rec.msglen, mode);
+
+  // diagnostic context, encoded when pushed
+  //
+  if (rec.context) {
+    if (json)
+      out.append(rec.context->json);
+    else {
+      out.append(' ');
+      out.append(rec.context->logfmt);
+    }
+  }
+
+  format_fields(out, rec.fields, rec.nfields, mode);
+
+  if (json)
+    out.append('}');
+}
+
+void Formatter::format_fields(LogBuffer& out, const LogField* fields,
+                              size_t nfields, int mode) {
+  // ,"key":value for JSON, ' key=value' otherwise
+  //
+  for (size_t i = 0; i < nfields; i++) {
+    out.append(mode == FORMAT_JSON ? ',' : ' ');
+    format_key(out, fields[i].key, fields[i].keylen, mode);
+    out.append(mode == FORMAT_JSON ? ':' : '=');
+    format_value(out, fields[i], mode);
+  }
+}
+
+void Formatter::format_key(LogBuffer& out, const char* key, size_t length,
+                           int mode) {
+  // logfmt keys cannot be quoted. Characters that would break them
+  // become '_'
+  //
+  if (mode == FORMAT_JSON) {
+    format_string(out, key, length, mode);
+    return;
+  }
+
+  char* p = out.tail(length);
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = key[i];
+    p[i] = (c <= ' ' or c == '=' or c == '"' or c == 0x7f) ? '_' : c;
+  }
+  out.commit(length);
+}
+
+void Formatter::format_value(LogBuffer& out, const LogField& field,
+                             int mode) {
+  //
+  switch (field.type) {
+    case LogField::FIELD_INT:
+               if (field.value.i < 0)
+                 format_integer(out, 0ULL - (unsigned long long) field.value.i,
+                                true);
+               else
+                 format_integer(out, field.value.i);
+               break;
+    case LogField::FIELD_UINT:
+               format_integer(out, field.value.u);
+               break;
+    case LogField::FIELD_DOUBLE:
+               format_double(out, field.value.d, mode);
+               break;
+    case LogField::FIELD_BOOL:
+               if (field.value.b)
+                 out.append("true", 4);
+               else
+                 out.append("false", 5);
+               break;
+    case LogField::FIELD_STRING:
+               format_string(out, field.value.str.data,
+                             field.value.str.length, mode);
+               break;
+  }
+}
+
+void Formatter::format_string(LogBuffer& out, const char* s, size_t length,
+                              int mode) {
+  // JSON strings are always quoted. logfmt values only when empty or
+  // holding blanks, '=', quotes or control characters. Escapes follow
+  // JSON in both cases. Runs of plain characters are copied at once
+  //
+  static const char hex[] = "0123456789abcdef";
+
+  bool quote = mode == FORMAT_JSON or length == 0;
+  for (size_t i = 0; i < length and not quote; i++) {
+    unsigned char c = s[i];
+    quote = c <= ' ' or c == '=' or c == '"' or c == '\\' or c == 0x7f;
+  }
+
+  if (not quote) {
+    out.append(s, length);
+    return;
+  }
+
+  out.append('"');
+
+  size_t run = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = s[i];
+    if (c >= ' ' and c != '"' and c != '\\')
+      continue;
+
+    out.append(s + run, i - run);
+    run = i + 1;
+
+    char esc[6] = { '\\', 0 };
+    switch (c) {
+      case '"':   esc[1] = '"';  break;
+      case '\\':  esc[1] = '\\'; break;
+      case '\n':  esc[1] = 'n';  break;
+      case '\r':  esc[1] = 'r';  break;
+      case '\t':  esc[1] = 't';  break;
+      case '\b':  esc[1] = 'b';  break;
+      case '\f':  esc[1] = 'f';  break;
+      default:    esc[1] = 'u';
+                  esc[2] = '0';
+                  esc[3] = '0';
+                  esc[4] = hex[c >> 4];
+                  esc[5] = hex[c & 0xf];
+                  out.append(esc, 6);
+                  continue;
+    }
+    out.append(esc, 2);
+  }
+  out.append(s + run, length - run);
+
+  out.append('"');
+}
+
+void Formatter::format_integer(LogBuffer& out, unsigned long long value,
+                               bool negative) {
+  // Two digits per division, written backwards into a local buffer
+  //
+  static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+
+  char  text[24];
+  char* p = text + sizeof(text);
+
+  while (value >= 100) {
+    unsigned int pair = (value % 100) * 2;
+    value /= 100;
+    *--p = digits[pair + 1];
+    *--p = digits[pair];
+  }
+  if (value >= 10) {
+    *--p = digits[value * 2 + 1];
+    *--p = digits[value * 2];
+  }
+  else
+    *--p = '0' + value;
+  if (negative)
+    *--p = '-';
+
+  out.append(p, text + sizeof(text) - p);
+}
+
+void Formatter::format_double(LogBuffer& out, double value, int mode) {
+  // Integral values and values with up to six decimals, the usual case
+  // for measurements, are rendered exactly without printf. The decimal
+  // text must read back as the same double, which is checked. Anything
+  // else takes "%.17g". JSON has no infinities nor NaN: they are null
+  //
+  const double exact = 9007199254740992.0;        // 2^53
+
+  if (isnan(value) or isinf(value)) {
+    if (mode == FORMAT_JSON)
+      out.append("null", 4);
+    else
+      out.append(isnan(value) ? "NaN" : value > 0 ? "+Inf" : "-Inf");
+    return;
+  }
+
+  bool   negative = signbit(value) and value != 0;
+  double magnitude = fabs(value);
+
+  if (magnitude < exact and magnitude == floor(magnitude)) {
+    format_integer(out, (unsigned long long) magnitude, negative);
+    return;
+  }
+
+  double scaled = nearbyint(magnitude * 1e6);
+  if (scaled < exact and scaled / 1e6 == magnitude) {
+    unsigned long long units = (unsigned long long) scaled;
+    unsigned long long fraction = units % 1000000;
+    int width = 6;
+
+    while (width > 1 and fraction % 10 == 0) {
+      fraction /= 10;
+      width--;
+    }
+    format_integer(out, units / 1000000, negative);
+    out.append('.');
+
+    char* p = out.tail(width);
+    for (int i = width - 1; i >= 0; i--) {
+      p[i] = '0' + fraction % 10;
+      fraction /= 10;
+    }
+    out.commit(width);
+    return;
+  }
+
+  char text[32];
+  int  n = snprintf(text, sizeof(text), "%.17g", value);
+
+  out.append(text, max(n, 0));
+}